@@ -0,0 +1,126 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! # Per-CPU Utilization Utilities
+//!
+//! Rust userland utilities to read per-CPU busy time tracked by BPF
+//! cpu_util_data. See
+//! [cpu_util.bpf.h](https://github.com/sched-ext/scx/blob/main/scheds/include/scx/cpu_util.bpf.h)
+//! and
+//! [cpu_util_impl.bpf.h](https://github.com/sched-ext/scx/blob/main/scheds/include/scx/cpu_util_impl.bpf.h)
+//! for details.
+//!
+//! Schedulers which keep an array of cpu_util_data in .bss can compute
+//! per-CPU utilization by reading the skeleton's mmapped memory, which is
+//! much cheaper than parsing /proc/stat on machines with many CPUs. Any
+//! time a CPU isn't running its idle task is accounted as busy, whichever
+//! sched class the running task belongs to.
+
+/// Read the cumulative busy time of a CPU
+///
+/// Read the busy time at `@now` of cpu_util_data (`@busy_ns`,
+/// `@running_at`). If the CPU is currently busy, the time since it left
+/// its idle task is included. `@now` must be from CLOCK_MONOTONIC, which is what
+/// bpf_ktime_get_ns() uses.
+///
+/// As with `ravg_read()`, each field is taken as a separate argument as the
+/// generated bindings can't share a pre-existing type.
+pub fn cpu_util_read(busy_ns: u64, running_at: u64, now: u64) -> u64 {
+    if running_at > 0 && now > running_at {
+        busy_ns + (now - running_at)
+    } else {
+        busy_ns
+    }
+}
+
+/// Tracks the busy time of each CPU across reads and turns it into
+/// utilization over the interval between consecutive updates.
+#[derive(Debug, Default)]
+pub struct CpuUtilTracker {
+    prev_busy: Vec<u64>,
+    prev_at: u64,
+    utils: Vec<f64>,
+}
+
+impl CpuUtilTracker {
+    /// Create a tracker for `@nr_cpus` CPUs. The first `update()` only
+    /// records the starting point and reports zero utilization.
+    pub fn new(nr_cpus: usize) -> Self {
+        Self {
+            prev_busy: vec![0; nr_cpus],
+            prev_at: 0,
+            utils: vec![0.0; nr_cpus],
+        }
+    }
+
+    /// Update the tracker at CLOCK_MONOTONIC `@now`. `@read` is called with
+    /// each CPU index and should return the (`busy_ns`, `running_at`) pair
+    /// of its cpu_util_data. Returns the utilization of each CPU between 0.0
+    /// and 1.0 since the previous update.
+    pub fn update<F>(&mut self, now: u64, mut read: F) -> &[f64]
+    where
+        F: FnMut(usize) -> (u64, u64),
+    {
+        let first = self.prev_at == 0;
+        let dur = now.saturating_sub(self.prev_at);
+
+        for cpu in 0..self.prev_busy.len() {
+            let (busy_ns, running_at) = read(cpu);
+            // Unsynchronized reads may step backwards, see cpu_util_stopping().
+            let busy = cpu_util_read(busy_ns, running_at, now).max(self.prev_busy[cpu]);
+
+            if first {
+                self.utils[cpu] = 0.0;
+            } else if dur > 0 {
+                let delta = busy - self.prev_busy[cpu];
+                self.utils[cpu] = (delta as f64 / dur as f64).clamp(0.0, 1.0);
+            }
+            self.prev_busy[cpu] = busy;
+        }
+
+        if dur > 0 {
+            self.prev_at = now;
+        }
+        &self.utils
+    }
+
+    /// Utilization of each CPU as of the last `update()`.
+    pub fn utils(&self) -> &[f64] {
+        &self.utils
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_cpu_util_read() {
+        assert_eq!(cpu_util_read(100, 0, 1000), 100);
+        assert_eq!(cpu_util_read(100, 400, 1000), 700);
+        assert_eq!(cpu_util_read(100, 2000, 1000), 100);
+    }
+
+    #[test]
+    fn test_cpu_util_tracker() {
+        let mut tracker = CpuUtilTracker::new(2);
+
+        assert_eq!(tracker.update(1000, |_| (0, 0)), &[0.0, 0.0]);
+
+        // CPU 0 busy for half the interval, CPU 1 running since 1500.
+        let utils = tracker.update(3000, |cpu| match cpu {
+            0 => (1000, 0),
+            _ => (0, 1500),
+        });
+        assert_eq!(utils, &[0.5, 0.75]);
+
+        // A torn read going backwards must not underflow.
+        let utils = tracker.update(4000, |cpu| match cpu {
+            0 => (500, 0),
+            _ => (2000, 0),
+        });
+        assert_eq!(utils, &[0.0, 0.5]);
+    }
+}
@@ -58,6 +58,8 @@ pub use libbpf_logger::init_libbpf_logging;
 
 pub mod ravg;
 
+pub mod cpu_util;
+
 mod topology;
 pub use topology::Cache;
 pub use topology::Core;
@@ -65,6 +67,8 @@ pub use topology::Cpu;
 pub use topology::Node;
 pub use topology::Topology;
 pub use topology::TopologyMap;
+pub use topology::LOCAL_DISTANCE;
+pub use topology::REMOTE_DISTANCE;
 
 mod cpumask;
 pub use cpumask::Cpumask;
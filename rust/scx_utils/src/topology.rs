@@ -77,12 +77,19 @@ use std::collections::BTreeMap;
 use std::path::Path;
 use std::slice::Iter;
 
+/// Distance of a NUMA node to itself, see include/linux/topology.h.
+pub const LOCAL_DISTANCE: usize = 10;
+/// Default distance between two different NUMA nodes.
+pub const REMOTE_DISTANCE: usize = 20;
+
 #[derive(Debug, Clone)]
 pub struct Cpu {
     id: usize,
     min_freq: usize,
     max_freq: usize,
+    hw_max_freq: usize,
     trans_lat_ns: usize,
+    cpu_capacity: usize,
 }
 
 impl Cpu {
@@ -101,10 +108,24 @@ impl Cpu {
         self.max_freq
     }
 
+    /// Get the maximum frequency the hardware supports on this CPU. Unlike
+    /// max_freq(), this isn't lowered when the scaling policy is capped,
+    /// e.g., by an administrator or a thermal daemon.
+    pub fn hw_max_freq(&self) -> usize {
+        self.hw_max_freq
+    }
+
     /// Get the transition latency of the CPU in nanoseconds
     pub fn trans_lat_ns(&self) -> usize {
         self.trans_lat_ns
     }
+
+    /// Get the relative capacity of this CPU, where the most capable CPU
+    /// in the system is 1024. This is 0 if the kernel doesn't export it,
+    /// which is the case on most x86 systems.
+    pub fn cpu_capacity(&self) -> usize {
+        self.cpu_capacity
+    }
 }
 
 #[derive(Debug, Clone)]
@@ -160,6 +181,7 @@ pub struct Node {
     id: usize,
     llcs: BTreeMap<usize, Cache>,
     span: Cpumask,
+    distance: Vec<usize>,
 }
 
 impl Node {
@@ -177,6 +199,14 @@ impl Node {
     pub fn span(&self) -> &Cpumask {
         &self.span
     }
+
+    /// Get the SLIT distances from this NUMA node to every node on the host,
+    /// indexed by node ID, as reported by
+    /// /sys/devices/system/node/nodeN/distance. The distance to the node
+    /// itself is normally LOCAL_DISTANCE (10).
+    pub fn distance(&self) -> &[usize] {
+        &self.distance
+    }
 }
 
 #[derive(Debug)]
@@ -238,6 +268,18 @@ impl Topology {
         &self.cores
     }
 
+    /// Get the SLIT distance between the NUMA nodes with IDs @from and @to. If
+    /// either node is unknown or the firmware doesn't report a distance, the
+    /// nodes are assumed to be REMOTE_DISTANCE (20) apart, or LOCAL_DISTANCE
+    /// (10) if @from and @to are the same node.
+    pub fn node_distance(&self, from: usize, to: usize) -> usize {
+        self.nodes
+            .iter()
+            .find(|node| node.id == from)
+            .and_then(|node| node.distance.get(to).copied())
+            .unwrap_or(if from == to { LOCAL_DISTANCE } else { REMOTE_DISTANCE })
+    }
+
     /// Get a hashmap of <CPU ID, Cpu> for all Cpus on the host.
     pub fn cpus(&self) -> &BTreeMap<usize, Cpu> {
         &self.cpus
@@ -340,6 +382,27 @@ fn read_file_usize(path: &Path) -> Result<usize> {
     }
 }
 
+fn read_node_distance(path: &Path) -> Result<Vec<usize>> {
+    let val = match std::fs::read_to_string(&path) {
+        Ok(val) => val,
+        Err(_) => {
+            bail!("Failed to open or read file {:?}", path);
+        }
+    };
+
+    let mut distance = Vec::new();
+    for dist in val.split_whitespace() {
+        match dist.parse::<usize>() {
+            Ok(parsed) => distance.push(parsed),
+            Err(_) => {
+                bail!("Failed to parse node distance {}", dist);
+            }
+        }
+    }
+
+    Ok(distance)
+}
+
 fn cpus_online() -> Result<Cpumask> {
     let path = "/sys/devices/system/cpu/online";
     let online = std::fs::read_to_string(&path)?;
@@ -393,8 +456,13 @@ fn create_insert_cpu(cpu_id: usize, node: &mut Node, online_mask: &Cpumask) -> R
     let freq_path = cpu_path.join("cpufreq");
     let min_freq = read_file_usize(&freq_path.join("scaling_min_freq")).unwrap_or(0);
     let max_freq = read_file_usize(&freq_path.join("scaling_max_freq")).unwrap_or(0);
+    let hw_max_freq = read_file_usize(&freq_path.join("cpuinfo_max_freq")).unwrap_or(0);
     let trans_lat_ns = read_file_usize(&freq_path.join("cpuinfo_transition_latency")).unwrap_or(0);
 
+    // Relative CPU capacity. Only exported on asymmetric systems with
+    // CONFIG_GENERIC_ARCH_TOPOLOGY, e.g., ARM big.LITTLE.
+    let cpu_capacity = read_file_usize(&cpu_path.join("cpu_capacity")).unwrap_or(0);
+
     let cache = node.llcs.entry(llc_id).or_insert(Cache{
         id: llc_id,
         cores: BTreeMap::new(),
@@ -413,7 +481,9 @@ fn create_insert_cpu(cpu_id: usize, node: &mut Node, online_mask: &Cpumask) -> R
             id: cpu_id,
             min_freq: min_freq,
             max_freq: max_freq,
+            hw_max_freq: hw_max_freq,
             trans_lat_ns: trans_lat_ns,
+            cpu_capacity: cpu_capacity,
         },
     );
 
@@ -435,6 +505,7 @@ fn create_default_node(online_mask: &Cpumask) -> Result<(Vec<Node>, usize)> {
         id: 0,
         llcs: BTreeMap::new(),
         span: Cpumask::new()?,
+        distance: vec![LOCAL_DISTANCE],
     };
 
     if !Path::new("/sys/devices/system/cpu").exists() {
@@ -478,10 +549,15 @@ fn create_numa_nodes(online_mask: &Cpumask) -> Result<(Vec<Node>, usize)> {
             }
         };
 
+        // Kernels without CONFIG_NUMA don't export distances. Treat every
+        // other node as equally far away in that case.
+        let distance = read_node_distance(&numa_path.join("distance")).unwrap_or_default();
+
         let mut node = Node {
             id: node_id,
             llcs: BTreeMap::new(),
             span: Cpumask::new()?,
+            distance,
         };
 
         let cpu_pattern = numa_path.join("cpu[0-9]*");
@@ -0,0 +1,27 @@
+#ifndef __SCX_CPU_UTIL_BPF_H__
+#define __SCX_CPU_UTIL_BPF_H__
+
+/*
+ * Per-CPU busy time accounting to be used in BPF progs. Assumes vmlinux.h has
+ * already been included.
+ *
+ * Each CPU owns a cpu_util_data which is only updated by that CPU from the
+ * sched_switch tracepoint. Place them in a .bss array, one cacheline per CPU,
+ * so that userspace can read the busy time of every CPU through the skeleton
+ * mmap instead of parsing /proc/stat. Zeroing is enough for initialization.
+ *
+ * Any time the CPU isn't running its idle task is accounted as busy, whichever
+ * sched class the running task belongs to, including the irqs and switches
+ * taken in between. Irqs taken while idle count as idle.
+ *
+ * See cpu_util_switch() and cpu_util_read() for details.
+ */
+struct cpu_util_data {
+	/* cumulative busy time as of the last switch to the idle task */
+	u64			busy_ns;
+
+	/* when the CPU left its idle task, 0 if it is idle */
+	u64			running_at;
+};
+
+#endif /* __SCX_CPU_UTIL_BPF_H__ */
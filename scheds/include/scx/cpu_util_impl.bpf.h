@@ -0,0 +1,40 @@
+/* to be included in the main bpf.c file */
+#include "cpu_util.bpf.h"
+
+#define CPU_UTIL_FN_ATTRS	inline __attribute__((unused, always_inline))
+
+/**
+ * cpu_util_switch - The CPU switched from @prev to @next
+ * @cud: cpu_util_data of the local CPU
+ * @prev: task which stopped running
+ * @next: task which starts running
+ * @now: current timestamp
+ *
+ * Must be called from a tp_btf/sched_switch program on the CPU which owns
+ * @cud. The CPU is busy from a switch away from its idle task until the next
+ * switch back to it, whichever sched classes the tasks in between belong to.
+ *
+ * Userspace reads the two fields without synchronization and may see @busy_ns
+ * and @running_at from either side of this update. As @busy_ns is cumulative,
+ * the error is corrected by the next read.
+ */
+static CPU_UTIL_FN_ATTRS void cpu_util_switch(struct cpu_util_data *cud,
+					      struct task_struct *prev,
+					      struct task_struct *next, u64 now)
+{
+	u64 running_at = cud->running_at;
+
+	/*
+	 * Switching between two busy tasks keeps the CPU busy. If the CPU was
+	 * already busy when the program was attached, start counting now.
+	 */
+	if (next->pid) {
+		if (!running_at)
+			cud->running_at = now;
+		return;
+	}
+
+	if (running_at && now > running_at)
+		cud->busy_ns += now - running_at;
+	cud->running_at = 0;
+}
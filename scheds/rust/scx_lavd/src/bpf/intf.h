@@ -89,6 +89,9 @@ enum consts {
 	LAVD_PREEMPT_KICK_LAT_PRIO	= 15,
 	LAVD_PREEMPT_KICK_MARGIN	= (2 * NSEC_PER_USEC),
 	LAVD_PREEMPT_TICK_MARGIN	= (1 * NSEC_PER_USEC),
+	LAVD_VICTIM_NR_BKTS		= 8, /* num of victim buckets by running task's lat_prio */
+	LAVD_VICTIM_NR_PROBES		= 3, /* num of CPUs sampled per victim bucket */
+	LAVD_VICTIM_BKT_NONE		= 0xff,
 
 	LAVD_SYS_STAT_INTERVAL_NS	= (25 * NSEC_PER_MSEC),
 	LAVD_TC_PER_CORE_MAX_CTUIL	= 500, /* maximum per-core CPU utilization */
@@ -98,7 +101,19 @@ enum consts {
 	LAVD_TC_CPU_PIN_INTERVAL_DIV	= (LAVD_TC_CPU_PIN_INTERVAL /
 					   LAVD_SYS_STAT_INTERVAL_NS),
 
-	LAVD_GLOBAL_DSQ			= 0,
+	LAVD_EM_MAX_PS			= 32, /* max num of performance states per core type */
+	LAVD_EM_BIG			= 0, /* energy model of big cores */
+	LAVD_EM_LITTLE			= 1, /* energy model of little cores */
+	LAVD_EM_NR_TYPES		= 2,
+	LAVD_EM_SEARCH_WIN		= 2, /* num of active CPUs searched around the current one */
+
+	LAVD_CPDOM_MAX_NR		= LAVD_CPU_ID_MAX, /* max num of compute domains */
+	LAVD_CPU_DSQ_BASE		= 0, /* per-CPU DSQs for pinned tasks */
+	LAVD_CPDOM_DSQ_BASE		= LAVD_CPU_DSQ_BASE + LAVD_CPU_ID_MAX, /* per-domain deadline DSQs */
+	LAVD_CPDOM_STEAL_MARGIN_NS	= (1 * NSEC_PER_MSEC), /* min deadline gain to steal from another domain */
+
+	LAVD_CGRP_MAX_DEPTH		= 16, /* max cgroup levels searched for a latency override */
+	LAVD_CGRP_MAX_THREADS		= 131072, /* max threads visited when a process moves */
 };
 
 /*
@@ -124,6 +139,47 @@ struct sys_stat {
 
 	volatile u32	nr_violation;	/* number of utilization violation */
 	volatile u32	nr_active;	/* number of active cores */
+	volatile u32	avg_victim_exam; /* CPUs examined per victim search (1000 = 1 CPU) */
+
+	volatile u64	util_big;	/* average of the big core utilization */
+	volatile u64	util_little;	/* average of the little core utilization */
+	volatile u32	pc_on_little;	/* share of perf-critical schedules on little cores (1000 = 100%) */
+
+	volatile u32	cpuperf_em_big;	/* minimum performance target of active big cores */
+	volatile u32	cpuperf_em_little; /* minimum performance target of active little cores */
+	volatile u64	util_fmax;	/* average of the CPU utilization at the max frequency */
+	volatile u64	energy;		/* estimated energy per interval in uJ */
+};
+
+/*
+ * Energy model of a core type
+ *
+ * Performance states are sorted by frequency in ascending order.
+ */
+struct em_table {
+	u32	nr_ps;			/* number of performance states */
+	u32	idle_power;		/* power of an active but idle CPU in uW */
+	u32	freq[LAVD_EM_MAX_PS];	/* frequency in kHz */
+	u32	power[LAVD_EM_MAX_PS];	/* power when busy at the frequency in uW */
+};
+
+/*
+ * Per-CPU statistics of an epoch
+ *
+ * Only the owner CPU writes its slots. When it first touches a slot in a new
+ * epoch, it resets the slot, so the aggregator never writes to them.
+ */
+struct cpu_epoch_stat {
+	volatile u64	epoch;		/* epoch of the stats in this slot */
+	volatile u64	idle_total;	/* total idle time in the epoch */
+	volatile u64	sum_perf_cri;	/* sum of performance criticality */
+	volatile u32	max_lat_cri;	/* maximum latency criticality */
+	volatile u32	min_lat_cri;	/* minimum latency criticality */
+	volatile u32	sum_lat_cri;	/* sum of latency criticality */
+	volatile u32	sched_nr;	/* number of schedules */
+	volatile u32	nr_perf_cri;	/* number of perf-critical schedules */
+	volatile u32	nr_victim_srch;	/* number of victim searches */
+	volatile u32	nr_victim_exam;	/* number of CPUs examined for victim searches */
 };
 
 /*
@@ -134,7 +190,6 @@ struct cpu_ctx {
 	 * Information used to keep track of CPU utilization
 	 */
 	volatile u64	util;		/* average of the CPU utilization */
-	volatile u64	idle_total;	/* total idle time so far */
 	volatile u64	idle_start_clk;	/* when the CPU becomes idle */
 
 	/*
@@ -151,24 +206,12 @@ struct cpu_ctx {
 	u64		online_clk;	/* when a CPU becomes online */
 	u64		offline_clk;	/* when a CPU becomes offline */
 
-	/*
-	 * Information used to keep track of latency criticality
-	 */
-	volatile u32	max_lat_cri;	/* maximum latency criticality */
-	volatile u32	min_lat_cri;	/* minimum latency criticality */
-	volatile u32	sum_lat_cri;	/* sum of latency criticality */
-	volatile u32	sched_nr;	/* number of schedules */
-
-	/*
-	 * Information used to keep track of performance criticality
-	 */
-	volatile u64	sum_perf_cri;	/* sum of performance criticality */
-
 	/*
 	 * Information of a current running task for preemption
 	 */
 	volatile u64	stopping_tm_est_ns; /* estimated stopping time */
 	volatile u16	lat_prio;	/* latency priority */
+	volatile u8	victim_bkt;	/* victim bucket the CPU belongs to */
 	volatile u8	is_online;	/* is this CPU online? */
 	s32		cpu_id;		/* cpu id */
 
@@ -185,6 +228,13 @@ struct cpu_ctx {
 	 */
 	struct bpf_cpumask __kptr *tmp_a_mask;	/* temporary cpu mask */
 	struct bpf_cpumask __kptr *tmp_o_mask;	/* temporary cpu mask */
+	struct bpf_cpumask __kptr *tmp_t_mask;	/* temporary cpu mask */
+
+	/*
+	 * Statistics of the current and the previous epochs, indexed by the
+	 * epoch's parity
+	 */
+	struct cpu_epoch_stat epoch_stat[2] __attribute__((aligned(CACHELINE_SIZE)));
 } __attribute__((aligned(CACHELINE_SIZE)));
 
 struct task_ctx {
@@ -223,6 +273,21 @@ struct task_ctx {
 	 * Task's performance criticality
 	 */
 	u32	perf_cri;		/* performance criticality of a task */
+
+	/*
+	 * Latency override of the task's cgroup
+	 */
+	s16	cgrp_lat_boost;		/* added to the latency priority */
+	u16	cgrp_lat_prio_max;	/* upper bound of the latency priority */
+	u32	cgrp_lat_gen;		/* cgrp_lat_gen the override was resolved at */
+};
+
+/*
+ * Per-cgroup latency override
+ */
+struct cgrp_lat {
+	s32	lat_boost;	/* added to the latency priority of the cgroup's tasks */
+	u32	lat_prio_max;	/* upper bound of the latency priority of the cgroup's tasks */
 };
 
 struct task_ctx_x {
@@ -235,7 +300,12 @@ struct task_ctx_x {
 	u32	avg_perf_cri;	/* average performance criticality */
 	u32	avg_lat_cri;	/* average latency criticality */
 	u32	nr_active;	/* number of active cores */
+	u32	avg_victim_exam; /* CPUs examined per victim search (1000 = 1 CPU) */
 	u32	cpuperf_cur;	/* CPU's current performance target */
+	u64	util_big;	/* big core utilization in [0..100] */
+	u64	util_little;	/* little core utilization in [0..100] */
+	u32	pc_on_little;	/* perf-critical schedules on little cores in [0..100] */
+	u64	energy;		/* estimated energy per interval in uJ */
 };
 
 
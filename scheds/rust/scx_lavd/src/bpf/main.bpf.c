@@ -110,8 +110,8 @@
  * 2) kick-based preemption.
  *
  * In every scheduler tick interval (when ops.tick() is called), the running
- * task checks if a higher priority task awaits execution in the global run
- * queue. If so, the running task shrinks its time slice to zero to trigger
+ * task checks if a higher priority task awaits execution in the run queues
+ * of its CPU. If so, the running task shrinks its time slice to zero to trigger
  * re-scheduling for another task as soon as possible. This is what we call
  * yield-based preemption. In addition to the tick interval, the scheduler
  * additionally performs yield-based preemption when there is no idle CPU on
@@ -119,14 +119,14 @@
  * majority (70-90%) of preemption operations in the scheduler.
  *
  * The kick-based preemption is to _immediately_ schedule an urgent task, even
- * paying a higher preemption cost. When a task is enqueued to the global run
+ * paying a higher preemption cost. When a task is enqueued to a shared run
  * queue (because no idle CPU is available), the scheduler checks if the
  * currently enqueuing task is urgent enough. The urgent task should be very
  * latency-critical (e.g., top 25%), and its latency priority should be very
  * high (e.g., 15). If the task is urgent enough, the scheduler finds a victim
  * CPU, which runs a lower-priority task, and kicks the remote victim CPU by
  * sending IPI. Then, the remote CPU will preempt out its running task and
- * schedule the highest priority task in the global run queue. The scheduler
+ * schedule the highest priority task in its run queue. The scheduler
  * uses 'The Power of Two Random Choices' heuristic so all N CPUs can run the N
  * highest priority tasks.
  *
@@ -182,6 +182,29 @@
  * kernel and pinned user-space tasks since they are manually optimized for
  * performance.
  *
+ * When an energy model is available, either from the kernel or from a
+ * user-supplied power table, the number of active cores is not derived from
+ * the utilization limit. Instead, the power of the numbers of active cores
+ * near the current one is estimated from the lowest performance state at which
+ * they can handle the system load, scaled to the maximum frequency, and the
+ * cheapest one is chosen. The active cores then do not run below that
+ * performance state.
+ *
+ *
+ * 10. Compute domains
+ * -------------------
+ *
+ * A single run queue shared by all CPUs becomes a lock hotspot on large
+ * machines, and tasks bounce across caches whenever a CPU on another LLC
+ * picks them up. Instead, CPUs are grouped into compute domains, one per LLC
+ * (or one per core with --per-core-dsq), and each domain has its own
+ * deadline-ordered run queue. A runnable task is queued in the domain of the
+ * CPU it is going to run on, a CPU runs tasks from its own domain first, and
+ * a CPU whose domain has nothing to run steals the task with the earliest
+ * deadline among the other domains. Tasks pinned to a single CPU are queued
+ * in the per-CPU run queue of that CPU, so no CPU has to traverse a run
+ * queue to find tasks which it can run.
+ *
  *
  * Copyright (c) 2023, 2024 Valve Corporation.
  * Author: Changwoo Min <changwoo@igalia.com>
@@ -205,13 +228,37 @@ volatile u64		nr_cpus_onln;
 static struct sys_stat	__sys_stats[2];
 static volatile int	__sys_stat_idx;
 
+static volatile u64	cur_epoch;	/* epoch of per-CPU stats being filled */
+static volatile u64	cur_epoch_clk;	/* when the current epoch started */
+
 private(LAVD) struct bpf_cpumask __kptr *active_cpumask; /* CPU mask for active CPUs */
 private(LAVD) struct bpf_cpumask __kptr *ovrflw_cpumask; /* CPU mask for overflow CPUs */
+private(LAVD) struct bpf_cpumask __kptr *big_cpumask; /* CPU mask for big cores */
+private(LAVD) struct bpf_cpumask __kptr *little_cpumask; /* CPU mask for little cores */
 
 /*
  * CPU topology
  */
-const volatile u16 cpu_order[LAVD_CPU_ID_MAX]; /* ordered by cpus->core->llc->numa */
+const volatile u16 cpu_order[LAVD_CPU_ID_MAX]; /* CPUs in the order of core compaction */
+const volatile u32 nr_cpu_order = 1;	/* number of CPUs in cpu_order */
+const volatile u16 cpu_core_id[LAVD_CPU_ID_MAX]; /* physical core of a CPU */
+const volatile u16 cpu_cpdom_id[LAVD_CPU_ID_MAX]; /* compute domain of a CPU */
+const volatile u32 nr_cpdoms = 1;	/* number of compute domains */
+const volatile u32 nr_cpu_ids = 1;	/* maximum possible CPU id + 1 */
+const volatile u8 cpu_big[LAVD_CPU_ID_MAX]; /* is a CPU a big core? */
+const volatile bool have_little_core; /* is there any little core? */
+const volatile u32 nr_cpus_big;	/* number of big cores */
+
+/*
+ * Energy model per core type
+ */
+const volatile bool have_energy_model; /* are the energy models loaded? */
+const volatile struct em_table em_tables[LAVD_EM_NR_TYPES];
+
+/*
+ * Per-cgroup latency overrides
+ */
+const volatile bool have_cgrp_lat; /* is there any cgroup latency override? */
 
 /*
  * Options
@@ -278,6 +325,20 @@ struct {
 	__type(value, struct task_ctx);
 } task_ctx_stor SEC(".maps");
 
+/*
+ * Per-cgroup latency overrides set by the userspace. The userspace bumps
+ * cgrp_lat_gen whenever it sets an override, e.g., on a cgroup created again,
+ * so that tasks which joined the cgroup before resolve their overrides again.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct cgrp_lat);
+} cgrp_lat_stor SEC(".maps");
+
+u32 cgrp_lat_gen;
+
 /*
  * Preemption related ones
  */
@@ -288,6 +349,20 @@ struct preemption_info {
 	struct cpu_ctx	*cpuc;
 };
 
+/*
+ * CPUs bucketed by the latency priority of their running tasks
+ */
+struct victim_bkt {
+	struct bpf_cpumask __kptr *cpumask;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct victim_bkt);
+	__uint(max_entries, LAVD_VICTIM_NR_BKTS);
+} victim_bkt_stor SEC(".maps");
+
 /*
  * Introspection commands
  */
@@ -497,6 +572,8 @@ static const u64 lat_prio_to_greedy_thresholds[NICE_WIDTH] = {
 static u16 get_nice_prio(struct task_struct *p);
 static u64 get_task_load_ideal(struct task_struct *p);
 static void adjust_slice_boost(struct cpu_ctx *cpuc, struct task_ctx *taskc);
+static void refresh_task_cgrp_lat(struct task_struct *p,
+				  struct task_ctx *taskc);
 
 static u64 sigmoid_u64(u64 v, u64 max)
 {
@@ -573,6 +650,41 @@ static struct cpu_ctx *get_cpu_ctx_id(s32 cpu_id)
 	return cpuc;
 }
 
+static bool is_big_cpu(s32 cpu)
+{
+	if (!have_little_core)
+		return true;
+	if (cpu < 0 || cpu >= LAVD_CPU_ID_MAX)
+		return true;
+	return cpu_big[cpu];
+}
+
+static struct cpu_epoch_stat *get_epoch_stat(struct cpu_ctx *cpuc)
+{
+	u64 epoch = READ_ONCE(cur_epoch);
+	struct cpu_epoch_stat *es = &cpuc->epoch_stat[epoch & 0x1];
+
+	/*
+	 * The slot still holds the stats of two epochs ago, which were
+	 * already collected. Start over.
+	 */
+	if (es->epoch != epoch) {
+		es->idle_total = 0;
+		es->sum_perf_cri = 0;
+		es->max_lat_cri = 0;
+		es->min_lat_cri = UINT_MAX;
+		es->sum_lat_cri = 0;
+		es->sched_nr = 0;
+		es->nr_perf_cri = 0;
+		es->nr_victim_srch = 0;
+		es->nr_victim_exam = 0;
+		barrier();
+		es->epoch = epoch;
+	}
+
+	return es;
+}
+
 static struct sys_stat *get_sys_stat_cur(void)
 {
 	if (READ_ONCE(__sys_stat_idx) == 0)
@@ -617,7 +729,12 @@ int submit_task_ctx(struct task_struct *p, struct task_ctx *taskc, u32 cpu_id)
 	m->taskc_x.avg_lat_cri = stat_cur->avg_lat_cri;
 	m->taskc_x.avg_perf_cri = stat_cur->avg_perf_cri;
 	m->taskc_x.nr_active = stat_cur->nr_active;
+	m->taskc_x.avg_victim_exam = stat_cur->avg_victim_exam;
 	m->taskc_x.cpuperf_cur = cpuc->cpuperf_cur;
+	m->taskc_x.util_big = stat_cur->util_big / 10;
+	m->taskc_x.util_little = stat_cur->util_little / 10;
+	m->taskc_x.pc_on_little = stat_cur->pc_on_little / 10;
+	m->taskc_x.energy = stat_cur->energy;
 
 	memcpy(&m->taskc, taskc, sizeof(m->taskc));
 
@@ -759,6 +876,8 @@ struct sys_stat_ctx {
 	struct sys_stat *stat_cur;
 	struct sys_stat	*stat_next;
 	u64		now;
+	u64		epoch;
+	u64		epoch_clk;
 	u64		duration;
 	u64		duration_total;
 	u64		idle_total;
@@ -776,6 +895,20 @@ struct sys_stat_ctx {
 	u64		new_util;
 	u64		new_load_factor;
 	u32		nr_violation;
+	u64		nr_victim_srch;
+	u64		nr_victim_exam;
+	u32		avg_victim_exam;
+	u32		nr_big;
+	u32		nr_little;
+	u64		sum_util_big;
+	u64		sum_util_little;
+	u64		util_big;
+	u64		util_little;
+	u64		sum_util_fmax;
+	u64		util_fmax;
+	u32		nr_perf_cri;
+	u32		nr_perf_cri_little;
+	u32		pc_on_little;
 };
 
 static void init_sys_stat_ctx(struct sys_stat_ctx *c)
@@ -789,12 +922,28 @@ static void init_sys_stat_ctx(struct sys_stat_ctx *c)
 	c->min_lat_cri = UINT_MAX;
 }
 
+static void close_epoch(struct sys_stat_ctx *c)
+{
+	/*
+	 * Start a new epoch so that CPUs fill the other slots from now on.
+	 * The closed epoch's slots are left for us to read.
+	 */
+	c->epoch_clk = READ_ONCE(cur_epoch_clk);
+	WRITE_ONCE(cur_epoch_clk, c->now);
+	barrier();
+	c->epoch = __sync_fetch_and_add(&cur_epoch, 1);
+}
+
 static void collect_sys_stat(struct sys_stat_ctx *c)
 {
 	int cpu;
 
 	bpf_for(cpu, 0, nr_cpus_onln) {
 		struct cpu_ctx *cpuc = get_cpu_ctx_id(cpu);
+		struct cpu_epoch_stat *es;
+		u64 idle_total = 0, idle_start_clk;
+		u32 nr_perf_cri = 0, cpuperf;
+
 		if (!cpuc) {
 			c->compute_total = 0;
 			break;
@@ -808,66 +957,96 @@ static void collect_sys_stat(struct sys_stat_ctx *c)
 		c->load_run_time_ns += cpuc->load_run_time_ns;
 
 		/*
-		 * Accumulate task's latency criticlity information.
-		 *
-		 * While updating cpu->* is racy, the resulting impact on
-		 * accuracy should be small and very rare and thus should be
-		 * fine.
+		 * Read the CPU's stats of the closed epoch. If the CPU didn't
+		 * touch its slot during the epoch, the slot is stale and there
+		 * is nothing to collect but idle time.
 		 */
-		c->sum_lat_cri += cpuc->sum_lat_cri;
-		cpuc->sum_lat_cri = 0;
+		es = &cpuc->epoch_stat[c->epoch & 0x1];
+		if (es->epoch == c->epoch) {
+			/*
+			 * Accumulate task's latency criticlity information.
+			 */
+			c->sum_lat_cri += es->sum_lat_cri;
+			c->sched_nr += es->sched_nr;
 
-		c->sched_nr += cpuc->sched_nr;
-		cpuc->sched_nr = 0;
+			if (es->max_lat_cri > c->max_lat_cri)
+				c->max_lat_cri = es->max_lat_cri;
+			if (es->min_lat_cri < c->min_lat_cri)
+				c->min_lat_cri = es->min_lat_cri;
 
-		if (cpuc->max_lat_cri > c->max_lat_cri)
-			c->max_lat_cri = cpuc->max_lat_cri;
-		cpuc->max_lat_cri = 0;
+			/*
+			 * Accumulate task's performance criticlity
+			 * information.
+			 */
+			c->sum_perf_cri += es->sum_perf_cri;
+			nr_perf_cri = es->nr_perf_cri;
 
-		if (cpuc->min_lat_cri < c->min_lat_cri)
-			c->min_lat_cri = cpuc->min_lat_cri;
-		cpuc->min_lat_cri = UINT_MAX;
+			/*
+			 * Accumulate the cost of victim CPU searches.
+			 */
+			c->nr_victim_srch += es->nr_victim_srch;
+			c->nr_victim_exam += es->nr_victim_exam;
 
-		/*
-		 * Accumulate task's performance criticlity information.
-		 */
-		c->sum_perf_cri += cpuc->sum_perf_cri;
-		cpuc->sum_perf_cri = 0;
+			idle_total = es->idle_total;
+		}
 
 		/*
 		 * If the CPU is in an idle state (i.e., idle_start_clk is
-		 * non-zero), accumulate the current idle peirod so far.
+		 * non-zero), add the current idle period within the epoch.
+		 * The CPU adds only the rest of the period to its next slot
+		 * when it wakes up.
 		 */
-		for (int i = 0; i < LAVD_MAX_CAS_RETRY; i++) {
-			u64 old_clk = cpuc->idle_start_clk;
-			if (old_clk == 0)
-				break;
-
-			bool ret = __sync_bool_compare_and_swap(
-					&cpuc->idle_start_clk, old_clk, c->now);
-			if (ret) {
-				c->idle_total += c->now - old_clk;
-				break;
-			}
+		idle_start_clk = READ_ONCE(cpuc->idle_start_clk);
+		if (idle_start_clk != 0) {
+			if (idle_start_clk < c->epoch_clk)
+				idle_start_clk = c->epoch_clk;
+			if (c->now > idle_start_clk)
+				idle_total += c->now - idle_start_clk;
 		}
+		if (idle_total > c->duration)
+			idle_total = c->duration;
 
 		/*
 		 * Calculcate per-CPU utilization
 		 */
 		u64 compute = 0;
-		if (c->duration > cpuc->idle_total)
-			compute = c->duration - cpuc->idle_total;
+		if (c->duration > idle_total)
+			compute = c->duration - idle_total;
 		c->new_util = (compute * LAVD_CPU_UTIL_MAX) / c->duration;
 		cpuc->util = calc_avg(cpuc->util, c->new_util);
 
 		if (cpuc->util > LAVD_TC_PER_CORE_MAX_CTUIL)
 			c->nr_violation += 1000;
 
+		/*
+		 * Scale the utilization to the maximum frequency for the
+		 * energy model since a CPU running below it gets less work
+		 * done in the same busy time.
+		 */
+		cpuperf = no_freq_scaling ? 0 : READ_ONCE(cpuc->cpuperf_cur);
+		if (cpuperf == 0 || cpuperf > SCX_CPUPERF_ONE)
+			cpuperf = SCX_CPUPERF_ONE;
+		c->sum_util_fmax += (c->new_util * cpuperf) / SCX_CPUPERF_ONE;
+
+		/*
+		 * Accumulate utilization and perf-critical schedules per core
+		 * type.
+		 */
+		c->nr_perf_cri += nr_perf_cri;
+		if (is_big_cpu(cpu)) {
+			c->sum_util_big += cpuc->util;
+			c->nr_big++;
+		}
+		else {
+			c->sum_util_little += cpuc->util;
+			c->nr_little++;
+			c->nr_perf_cri_little += nr_perf_cri;
+		}
+
 		/*
 		 * Accmulate system-wide idle time
 		 */
-		c->idle_total += cpuc->idle_total;
-		cpuc->idle_total = 0;
+		c->idle_total += idle_total;
 	}
 }
 
@@ -900,6 +1079,24 @@ static void calc_sys_stat(struct sys_stat_ctx *c)
 		c->avg_lat_cri = c->sum_lat_cri / c->sched_nr;
 		c->avg_perf_cri = c->sum_perf_cri / c->sched_nr;
 	}
+
+	if (c->nr_big > 0)
+		c->util_big = c->sum_util_big / c->nr_big;
+	if (c->nr_little > 0)
+		c->util_little = c->sum_util_little / c->nr_little;
+	c->util_fmax = c->sum_util_fmax / nr_cpus_onln;
+
+	if (c->nr_perf_cri == 0)
+		c->pc_on_little = c->stat_cur->pc_on_little;
+	else
+		c->pc_on_little = (c->nr_perf_cri_little * 1000) /
+				  c->nr_perf_cri;
+
+	if (c->nr_victim_srch == 0)
+		c->avg_victim_exam = c->stat_cur->avg_victim_exam;
+	else
+		c->avg_victim_exam = (c->nr_victim_exam * 1000) /
+				     c->nr_victim_srch;
 }
 
 static void update_sys_stat_next(struct sys_stat_ctx *c)
@@ -932,6 +1129,18 @@ static void update_sys_stat_next(struct sys_stat_ctx *c)
 
 	stat_next->nr_violation =
 		calc_avg32(stat_cur->nr_violation, c->nr_violation);
+
+	stat_next->avg_victim_exam =
+		calc_avg32(stat_cur->avg_victim_exam, c->avg_victim_exam);
+
+	stat_next->util_big =
+		calc_avg(stat_cur->util_big, c->util_big);
+	stat_next->util_little =
+		calc_avg(stat_cur->util_little, c->util_little);
+	stat_next->util_fmax =
+		calc_avg(stat_cur->util_fmax, c->util_fmax);
+	stat_next->pc_on_little =
+		calc_avg32(stat_cur->pc_on_little, c->pc_on_little);
 }
 
 static void calc_inc1k(struct sys_stat_ctx *c)
@@ -969,6 +1178,7 @@ static void do_update_sys_stat(void)
 	 * Collect and prepare the next version of stat.
 	 */
 	init_sys_stat_ctx(&c);
+	close_epoch(&c);
 	collect_sys_stat(&c);
 	calc_sys_stat(&c);
 	update_sys_stat_next(&c);
@@ -981,15 +1191,162 @@ static void do_update_sys_stat(void)
 	flip_sys_stat();
 }
 
-static u64 calc_nr_active_cpus(struct sys_stat *stat_cur)
+static bool calc_em_power(u32 type, u64 load, u64 *power, u32 *cpuperf)
 {
-	u64 nr_active;
+	const volatile struct em_table *emt;
+	u64 f_max, f_req, f, busy;
+	u32 nr_ps, ps;
+	int i;
+
+	if (type >= LAVD_EM_NR_TYPES)
+		return false;
+
+	emt = &em_tables[type];
+	nr_ps = min(emt->nr_ps, LAVD_EM_MAX_PS);
+	if (nr_ps == 0)
+		return false;
+
+	/*
+	 * Find the lowest performance state that can run @load, a CPU's
+	 * utilization at the maximum frequency (1000 = 100%), within
+	 * LAVD_CPU_UTIL_MAX_FOR_CPUPERF. If even the highest one cannot, the
+	 * CPU runs at the highest one and is overloaded.
+	 */
+	ps = nr_ps - 1;
+	f_max = emt->freq[ps];
+	f_req = (load * f_max) / LAVD_CPU_UTIL_MAX_FOR_CPUPERF;
+	bpf_for(i, 0, nr_ps) {
+		if (i >= LAVD_EM_MAX_PS)
+			break;
+		if (emt->freq[i] >= f_req) {
+			ps = i;
+			break;
+		}
+	}
+	f = emt->freq[ps];
+	if (f == 0)
+		return false;
+
+	/*
+	 * A CPU at a lower frequency stays busy longer for the same load. It
+	 * consumes the performance state's power while busy and the idle
+	 * power otherwise.
+	 */
+	busy = min((load * f_max) / f, LAVD_CPU_UTIL_MAX);
+	*power = (busy * emt->power[ps] +
+		  (LAVD_CPU_UTIL_MAX - busy) * emt->idle_power) /
+		 LAVD_CPU_UTIL_MAX;
+	*cpuperf = (f * SCX_CPUPERF_ONE) / f_max;
+
+	return f >= f_req;
+}
+
+static u64 calc_em_power_active(u64 nr_active, u64 load,
+				u32 *cpuperf_big, u32 *cpuperf_little,
+				bool *overload)
+{
+	u64 nr_big, nr_little, power_big = 0, power_little = 0, cpu_load;
+
+	/*
+	 * Core compaction fills the big cores first, and the active CPUs
+	 * share the system load evenly.
+	 */
+	nr_big = min(nr_active, nr_cpus_big);
+	nr_little = nr_active - nr_big;
+	cpu_load = (load + nr_active - 1) / nr_active;
+
+	*cpuperf_big = 0;
+	*cpuperf_little = 0;
+	*overload = false;
+	if (nr_big &&
+	    !calc_em_power(LAVD_EM_BIG, cpu_load, &power_big, cpuperf_big))
+		*overload = true;
+	if (nr_little &&
+	    !calc_em_power(LAVD_EM_LITTLE, cpu_load, &power_little,
+			   cpuperf_little))
+		*overload = true;
+
+	return (nr_big * power_big) + (nr_little * power_little);
+}
+
+static u64 calc_nr_active_cpus_em(struct sys_stat *stat_cur)
+{
+	u64 load, nr_cur, nr_min, lo, hi, nr_active, power;
+	u64 min_power = U64_MAX;
+	u32 cpuperf_big, cpuperf_little;
+	bool overload;
+	int n;
+
+	/*
+	 * Running more CPUs at a lower frequency is not always cheaper than
+	 * running fewer CPUs at a higher frequency, since every active CPU
+	 * also burns the idle power. Hence, estimate the power of the
+	 * numbers of active CPUs that can handle the system load and choose
+	 * the cheapest one.
+	 *
+	 * To keep the timer's work independent of the number of CPUs, only
+	 * the numbers within LAVD_EM_SEARCH_WIN of the current one are
+	 * examined, so the choice walks towards the cheapest one over a few
+	 * intervals. The window never starts below the fewest CPUs that can
+	 * handle the load at the highest frequency, so a load spike is
+	 * followed right away. If none in the window can, use its top.
+	 */
+	load = stat_cur->util_fmax * nr_cpus_onln;
+	nr_min = (load + LAVD_CPU_UTIL_MAX_FOR_CPUPERF - 1) /
+		 LAVD_CPU_UTIL_MAX_FOR_CPUPERF;
+	nr_cur = stat_cur->nr_active;
+
+	lo = nr_cur > LAVD_EM_SEARCH_WIN ? nr_cur - LAVD_EM_SEARCH_WIN : 0;
+	lo = max(max(lo, nr_min), LAVD_TC_NR_ACTIVE_MIN);
+	lo = min(lo, nr_cpus_onln);
+	hi = min(max(nr_cur, lo) + LAVD_EM_SEARCH_WIN, nr_cpus_onln);
+
+	nr_active = hi;
+	bpf_for(n, lo, hi + 1) {
+		power = calc_em_power_active(n, load, &cpuperf_big,
+					     &cpuperf_little, &overload);
+		if (!overload && power < min_power) {
+			min_power = power;
+			nr_active = n;
+		}
+	}
+
+	return nr_active;
+}
+
+static void update_em_stat(struct sys_stat *stat_cur, u64 nr_active)
+{
+	u64 load, power;
+	u32 cpuperf_big, cpuperf_little;
+	bool overload;
 
 	/*
-	 * nr_active = ceil(nr_cpus_onln * cpu_util * per_core_max_util)
+	 * Keep the performance states that the energy estimate assumes and
+	 * the estimated energy of an interval in uJ (uW * ns / 10^9).
 	 */
-	nr_active  = (nr_cpus_onln * stat_cur->util * 1000) + 500;
-	nr_active /= (LAVD_TC_PER_CORE_MAX_CTUIL * 1000);
+	load = stat_cur->util_fmax * nr_cpus_onln;
+	power = calc_em_power_active(nr_active, load, &cpuperf_big,
+				     &cpuperf_little, &overload);
+
+	stat_cur->cpuperf_em_big = cpuperf_big;
+	stat_cur->cpuperf_em_little = cpuperf_little;
+	stat_cur->energy = (power * LAVD_SYS_STAT_INTERVAL_NS) / LAVD_TIME_ONE_SEC;
+}
+
+static u64 calc_nr_active_cpus(struct sys_stat *stat_cur)
+{
+	u64 nr_active;
+
+	if (have_energy_model) {
+		nr_active = calc_nr_active_cpus_em(stat_cur);
+	}
+	else {
+		/*
+		 * nr_active = ceil(nr_cpus_onln * cpu_util * per_core_max_util)
+		 */
+		nr_active  = (nr_cpus_onln * stat_cur->util * 1000) + 500;
+		nr_active /= (LAVD_TC_PER_CORE_MAX_CTUIL * 1000);
+	}
 
 	/*
 	 * If a few CPUs are particularly busy, boost the overflow CPUs by 2x.
@@ -998,6 +1355,9 @@ static u64 calc_nr_active_cpus(struct sys_stat *stat_cur)
 	nr_active = max(min(nr_active, nr_cpus_onln),
 			LAVD_TC_NR_ACTIVE_MIN);
 
+	if (have_energy_model)
+		update_em_stat(stat_cur, nr_active);
+
 	return nr_active;
 }
 
@@ -1028,7 +1388,8 @@ static void do_core_compaction(void)
 	struct sys_stat *stat_cur = get_sys_stat_cur();
 	struct cpu_ctx *cpuc;
 	struct bpf_cpumask *active, *ovrflw;
-	int nr_cpus, nr_active, nr_active_old, cpu, i;
+	int nr_cpus, nr_active, nr_active_old, cpu, i, j = 0;
+	u32 core_last = LAVD_CPU_ID_NONE;
 
 	bpf_rcu_read_lock();
 
@@ -1048,14 +1409,17 @@ static void do_core_compaction(void)
 	nr_active_old = stat_cur->nr_active;
 	nr_active = calc_nr_active_cpus(stat_cur);
 	nr_cpus = nr_active + LAVD_TC_NR_OVRFLW;
-	bpf_for(i, 0, nr_cpus_onln) {
+	bpf_for(i, 0, nr_cpu_order) {
 		if (i >= LAVD_CPU_ID_MAX)
 			break;
 
 		/*
-		 * Skip offline cpu
+		 * Skip offline cpu. An offline CPU does not take a slot of the
+		 * active set, so count online CPUs in @j.
 		 */
 		cpu = cpu_order[i];
+		if (cpu >= LAVD_CPU_ID_MAX)
+			continue;
 		cpuc = get_cpu_ctx_id(cpu);
 		if (!cpuc || !cpuc->is_online) {
 			bpf_cpumask_clear_cpu(cpu, active);
@@ -1063,11 +1427,21 @@ static void do_core_compaction(void)
 			continue;
 		}
 
+		/*
+		 * Activate a physical core as a whole. If the last active CPU
+		 * has SMT siblings left, extend the active set to them.
+		 */
+		if (j == nr_active && cpu_core_id[cpu] == core_last) {
+			nr_active++;
+			nr_cpus++;
+		}
+
 		/*
 		 * Assign an online cpu to active and overflow cpumasks
 		 */
-		if (i < nr_cpus) {
-			if (i < nr_active) {
+		if (j < nr_cpus) {
+			if (j < nr_active) {
+				core_last = cpu_core_id[cpu];
 				bpf_cpumask_set_cpu(cpu, active);
 				bpf_cpumask_clear_cpu(cpu, ovrflw);
 			}
@@ -1078,7 +1452,7 @@ static void do_core_compaction(void)
 			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
 		}
 		else {
-			if (i < nr_active_old) {
+			if (j < nr_active_old) {
 				bpf_cpumask_clear_cpu(cpu, active);
 				bpf_cpumask_clear_cpu(cpu, ovrflw);
 			}
@@ -1101,6 +1475,7 @@ static void do_core_compaction(void)
 				bpf_cpumask_clear_cpu(cpu, ovrflw);
 			}
 		}
+		j++;
 	}
 
 	stat_cur->nr_active = nr_active;
@@ -1439,8 +1814,18 @@ static int boost_lat(struct task_struct *p, struct task_ctx *taskc,
 		boost -= LAVD_BOOST_WAKEUP_LAT;
 
 out:
+	/*
+	 * Apply the latency override of the task's cgroup, which is known
+	 * from the start, so it also takes effect on a task's first schedule.
+	 * Resolve it again if the overrides changed since.
+	 */
+	if (have_cgrp_lat && taskc->cgrp_lat_gen != READ_ONCE(cgrp_lat_gen))
+		refresh_task_cgrp_lat(p, taskc);
 	static_prio = get_nice_prio(p);
-	taskc->lat_prio = sum_prios_for_lat(p, static_prio, boost);
+	taskc->lat_prio = sum_prios_for_lat(p, static_prio,
+					    boost + taskc->cgrp_lat_boost);
+	if (taskc->lat_prio > taskc->cgrp_lat_prio_max)
+		taskc->lat_prio = taskc->cgrp_lat_prio_max;
 
 	return boost;
 }
@@ -1637,6 +2022,16 @@ static void update_stat_for_runnable(struct task_struct *p,
 	cpuc->load_run_time_ns += cap_time_slice_ns(taskc->run_time_ns);
 }
 
+static bool is_perf_cri(struct task_ctx *taskc, struct sys_stat *stat_cur)
+{
+	/*
+	 * A task deserves a big core when it is more latency-critical or more
+	 * performance-critical than average.
+	 */
+	return (taskc->lat_cri >= stat_cur->avg_lat_cri) ||
+	       (taskc->perf_cri >= stat_cur->avg_perf_cri);
+}
+
 static void update_stat_for_running(struct task_struct *p,
 				    struct task_ctx *taskc,
 				    struct cpu_ctx *cpuc)
@@ -1645,6 +2040,7 @@ static void update_stat_for_running(struct task_struct *p,
 	u64 now = bpf_ktime_get_ns();
 	u64 load_actual_ft, load_ideal_ft, wait_freq_ft, wake_freq_ft;
 	u64 perf_cri_raw;
+	struct cpu_epoch_stat *es;
 
 	/*
 	 * Since this is the start of a new schedule for @p, we update run
@@ -1660,12 +2056,13 @@ static void update_stat_for_running(struct task_struct *p,
 	 * Update per-CPU latency criticality information for ever-scheduled
 	 * tasks.
 	 */
-	if (cpuc->max_lat_cri < taskc->lat_cri)
-		cpuc->max_lat_cri = taskc->lat_cri;
-	if (cpuc->min_lat_cri > taskc->lat_cri)
-		cpuc->min_lat_cri = taskc->lat_cri;
-	cpuc->sum_lat_cri += taskc->lat_cri;
-	cpuc->sched_nr++;
+	es = get_epoch_stat(cpuc);
+	if (es->max_lat_cri < taskc->lat_cri)
+		es->max_lat_cri = taskc->lat_cri;
+	if (es->min_lat_cri > taskc->lat_cri)
+		es->min_lat_cri = taskc->lat_cri;
+	es->sum_lat_cri += taskc->lat_cri;
+	es->sched_nr++;
 
 	/*
 	 * It is clear there is no need to consider the suspended duration
@@ -1694,7 +2091,9 @@ static void update_stat_for_running(struct task_struct *p,
 	perf_cri_raw = load_actual_ft * load_ideal_ft *
 		       wait_freq_ft * wake_freq_ft;
 	taskc->perf_cri = log2_u64(perf_cri_raw + 1);
-	cpuc->sum_perf_cri += taskc->perf_cri;
+	es->sum_perf_cri += taskc->perf_cri;
+	if (is_perf_cri(taskc, get_sys_stat_cur()))
+		es->nr_perf_cri++;
 
 	/*
 	 * Update task state when starts running.
@@ -1782,20 +2181,6 @@ static int comp_preemption_info(struct preemption_info *prm_a,
 	return 0;
 }
 
-static int get_random_start_pos(u32 nuance)
-{
-	/*
-	 * Get a large enough random integer to increase or decrease the total
-	 * CPUs without worrying about over-/underflow.
-	 */
-	return (bpf_get_prandom_u32() + nuance + 1000) >> 1;
-}
-
-static int get_random_directional_inc(u32 nuance)
-{
-	return ((bpf_get_prandom_u32() + nuance) & 0x1) ? 1 : -1;
-}
-
 static  bool can_task1_kick_task2(struct preemption_info *prm_task1,
 				  struct preemption_info *prm_task2)
 {
@@ -1844,6 +2229,63 @@ static bool can_cpu_be_kicked(u64 now, struct cpu_ctx *cpuc)
 	return delta >= LAVD_PREEMPT_KICK_MARGIN;
 }
 
+static u8 lat_prio_to_victim_bkt(u16 lat_prio)
+{
+	/*
+	 * An idle CPU belongs to the lowest-priority bucket, so it is
+	 * examined first.
+	 */
+	if (lat_prio >= NICE_WIDTH)
+		return LAVD_VICTIM_NR_BKTS - 1;
+	return (lat_prio * LAVD_VICTIM_NR_BKTS) / NICE_WIDTH;
+}
+
+static struct bpf_cpumask *get_victim_bkt_mask(u32 bkt)
+{
+	struct victim_bkt *vbkt;
+
+	vbkt = bpf_map_lookup_elem(&victim_bkt_stor, &bkt);
+	if (!vbkt)
+		return NULL;
+	return vbkt->cpumask;
+}
+
+static void update_victim_bkt(struct cpu_ctx *cpuc)
+{
+	struct bpf_cpumask *old_mask, *new_mask;
+	u8 old_bkt, new_bkt;
+
+	/*
+	 * Move the CPU to the bucket of its running task's latency priority.
+	 * Since it is added to the new bucket before being removed from the
+	 * old one, a concurrent victim search never misses it.
+	 */
+	old_bkt = cpuc->victim_bkt;
+	new_bkt = cpuc->is_online ? lat_prio_to_victim_bkt(cpuc->lat_prio) :
+				    LAVD_VICTIM_BKT_NONE;
+	if (old_bkt == new_bkt)
+		return;
+
+	bpf_rcu_read_lock();
+	if (new_bkt != LAVD_VICTIM_BKT_NONE) {
+		new_mask = get_victim_bkt_mask(new_bkt);
+		if (!new_mask)
+			goto unlock_out;
+		bpf_cpumask_set_cpu(cpuc->cpu_id, new_mask);
+	}
+
+	if (old_bkt != LAVD_VICTIM_BKT_NONE) {
+		old_mask = get_victim_bkt_mask(old_bkt);
+		if (old_mask)
+			bpf_cpumask_clear_cpu(cpuc->cpu_id, old_mask);
+	}
+
+	cpuc->victim_bkt = new_bkt;
+
+unlock_out:
+	bpf_rcu_read_unlock();
+}
+
 static struct cpu_ctx *find_victim_cpu(const struct cpumask *cpumask,
 				       struct task_ctx *taskc,
 				       u64 *p_old_last_kick_clk)
@@ -1858,10 +2300,12 @@ static struct cpu_ctx *find_victim_cpu(const struct cpumask *cpumask,
 	 * choices' technique.
 	 */
 	u64 now = bpf_ktime_get_ns();
-	struct cpu_ctx *cpuc;
+	struct cpu_ctx *cpuc, *cpuc_cur;
 	struct preemption_info prm_task, prm_cpus[2], *victim_cpu;
-	int cpu_base, cpu_inc, cpu;
-	int i, v = 0, cur_cpu = bpf_get_smp_processor_id();
+	struct bpf_cpumask *bkt_mask;
+	struct cpu_epoch_stat *es;
+	int cpu, bkt, i, j, v = 0, cur_cpu = bpf_get_smp_processor_id();
+	u32 nr_exam = 1;
 	int ret;
 
 	/*
@@ -1870,19 +2314,19 @@ static struct cpu_ctx *find_victim_cpu(const struct cpumask *cpumask,
 	prm_task.stopping_tm_est_ns = get_est_stopping_time(taskc) +
 				      LAVD_PREEMPT_KICK_MARGIN;
 	prm_task.lat_prio = taskc->lat_prio;
-	prm_task.cpuc = cpuc = get_cpu_ctx();
-	if (!cpuc) {
+	prm_task.cpuc = cpuc_cur = get_cpu_ctx();
+	if (!cpuc_cur) {
 		scx_bpf_error("Failed to lookup the current cpu_ctx");
 		goto null_out;
 	}
-	prm_task.last_kick_clk = cpuc->last_kick_clk;
+	prm_task.last_kick_clk = cpuc_cur->last_kick_clk;
 
 	/*
 	 * First, test the current CPU since it can skip the expensive IPI.
 	 */
-	if (can_cpu_be_kicked(now, cpuc) &&
+	if (can_cpu_be_kicked(now, cpuc_cur) &&
 	    bpf_cpumask_test_cpu(cur_cpu, cpumask) &&
-	    can_cpu1_kick_cpu2(&prm_task, &prm_cpus[0], cpuc)) {
+	    can_cpu1_kick_cpu2(&prm_task, &prm_cpus[0], cpuc_cur)) {
 		victim_cpu = &prm_task;
 		goto bingo_out;
 	}
@@ -1895,45 +2339,60 @@ static struct cpu_ctx *find_victim_cpu(const struct cpumask *cpumask,
 		goto null_out;
 
 	/*
-	 * Randomly find _two_ CPUs that run lower-priority tasks than @p. To
-	 * traverse CPUs in a random order, we start from a random CPU ID in a
-	 * random direction (left or right). The random-order traversal helps
-	 * to mitigate the thundering herd problem. Otherwise, all CPUs may end
-	 * up finding the same victim CPU.
-	 *
-	 * In the worst case, the current logic traverses _all_ CPUs. It would
-	 * be too expensive to perform every task queue. We need to revisit
-	 * this if the traversal cost becomes problematic.
+	 * Find _two_ CPUs that run lower-priority tasks than @p. CPUs are
+	 * bucketed by their running task's latency priority, so we sample a
+	 * few random qualifying CPUs per bucket starting from the
+	 * lowest-priority bucket instead of walking all CPUs. The random
+	 * sampling helps to mitigate the thundering herd problem. Otherwise,
+	 * all CPUs may end up finding the same victim CPU.
 	 */
-	barrier();
-	cpu_base = get_random_start_pos(cur_cpu);
-	cpu_inc = get_random_directional_inc(cur_cpu);
-	bpf_for(i, 0, nr_cpus_onln) {
-		/*
-		 * Decide a CPU ID to examine.
-		 */
-		cpu = (cpu_base + (i * cpu_inc)) % nr_cpus_onln;
-
-		/*
-		 * Check whether that CPU is qualified to run @p.
-		 */
-		if (cur_cpu == cpu || !can_cpu_be_kicked(now, cpuc) ||
-		    !bpf_cpumask_test_cpu(cpu, cpumask))
+	bpf_rcu_read_lock();
+	bpf_for(i, 0, LAVD_VICTIM_NR_BKTS) {
+		bkt = LAVD_VICTIM_NR_BKTS - 1 - i;
+		bkt_mask = get_victim_bkt_mask(bkt);
+		if (!bkt_mask)
 			continue;
 
+		bpf_for(j, 0, LAVD_VICTIM_NR_PROBES) {
+			/*
+			 * Pick a CPU which is qualified to run @p.
+			 */
+			cpu = bpf_cpumask_any_and_distribute(cast_mask(bkt_mask),
+							     cpumask);
+			if (cpu >= nr_cpu_ids)
+				break;
+			if (cpu == cur_cpu ||
+			    (v == 1 && cpu == prm_cpus[0].cpuc->cpu_id))
+				continue;
+
+			cpuc = get_cpu_ctx_id(cpu);
+			if (!cpuc) {
+				scx_bpf_error("Failed to lookup cpu_ctx: %d", cpu);
+				bpf_rcu_read_unlock();
+				goto null_out;
+			}
+			nr_exam++;
+
+			if (!can_cpu_be_kicked(now, cpuc))
+				continue;
+
+			/*
+			 * If that CPU runs a lower priority task, that's a
+			 * victim candidate.
+			 */
+			ret = can_cpu1_kick_cpu2(&prm_task, &prm_cpus[v], cpuc);
+			if (ret == true && ++v >= 2)
+				break;
+		}
+
 		/*
-		 * If that CPU runs a lower priority task, that's a victim
-		 * candidate.
+		 * Candidates in higher-priority buckets are worse victims than
+		 * the ones we already found.
 		 */
-		cpuc = get_cpu_ctx_id(cpu);
-		if (!cpuc) {
-			scx_bpf_error("Failed to lookup cpu_ctx: %d", cpu);
-			goto null_out;
-		}
-		ret = can_cpu1_kick_cpu2(&prm_task, &prm_cpus[v], cpuc);
-		if (ret == true && ++v >= 2)
+		if (v > 0)
 			break;
 	}
+	bpf_rcu_read_unlock();
 
 	/*
 	 * Choose a final victim CPU.
@@ -1952,11 +2411,19 @@ static struct cpu_ctx *find_victim_cpu(const struct cpumask *cpumask,
 	}
 
 bingo_out:
+	es = get_epoch_stat(cpuc_cur);
+	es->nr_victim_srch++;
+	es->nr_victim_exam += nr_exam;
 	taskc->victim_cpu = victim_cpu->cpuc->cpu_id;
 	*p_old_last_kick_clk = victim_cpu->last_kick_clk;
 	return victim_cpu->cpuc;
 
 null_out:
+	if (cpuc_cur) {
+		es = get_epoch_stat(cpuc_cur);
+		es->nr_victim_srch++;
+		es->nr_victim_exam += nr_exam;
+	}
 	taskc->victim_cpu = (s32)LAVD_CPU_ID_NONE;
 	return NULL;
 }
@@ -1969,7 +2436,7 @@ static bool kick_cpu(struct cpu_ctx *victim_cpuc, u64 victim_last_kick_clk)
 	 * preemption.
 	 *
 	 * Kicking the victim CPU does _not_ guarantee that task @p will run on
-	 * that CPU. Enqueuing @p to the global queue is one operation, and
+	 * that CPU. Enqueuing @p to the victim's run queue is one operation, and
 	 * kicking the victim is another asynchronous operation. However, it is
 	 * okay because, anyway, the victim CPU will run a higher-priority task
 	 * than @p.
@@ -2017,28 +2484,98 @@ static bool try_find_and_kick_victim_cpu(const struct cpumask *cpumask,
 	return ret;
 }
 
-static bool try_yield_current_cpu(struct task_struct *p_run,
-				  struct cpu_ctx *cpuc_run,
-				  struct task_ctx *taskc_run)
+static u64 cpu_to_dsq(s32 cpu)
 {
-	struct task_struct *p_wait;
-	struct task_ctx *taskc_wait;
-	struct preemption_info prm_run, prm_wait;
-	s32 cpu_id = scx_bpf_task_cpu(p_run), wait_vtm_cpu_id;
-	bool ret = false;
+	return LAVD_CPU_DSQ_BASE + cpu;
+}
+
+static u64 cpu_to_cpdom_dsq(s32 cpu)
+{
+	u32 cpdom_id = 0;
+
+	if (cpu >= 0 && cpu < LAVD_CPU_ID_MAX)
+		cpdom_id = cpu_cpdom_id[cpu];
+	return LAVD_CPDOM_DSQ_BASE + cpdom_id;
+}
+
+static bool peek_dsq_vdeadline(u64 dsq_id, u64 *vdeadline)
+{
+	struct task_struct *p;
+	bool found = false;
 
 	/*
-	 * If there is a higher priority task waiting on the global rq, the
-	 * current running task yield the CPU by shrinking its time slice to
-	 * zero.
+	 * The DSQ iterator is not available on older kernels. Then, the
+	 * caller should fall back to the order without deadlines.
 	 */
-	prm_run.stopping_tm_est_ns = taskc_run->last_running_clk +
-				     taskc_run->run_time_ns -
-				     LAVD_PREEMPT_TICK_MARGIN;
-	prm_run.lat_prio = taskc_run->lat_prio;
+	bpf_rcu_read_lock();
+	__COMPAT_DSQ_FOR_EACH(p, dsq_id, 0) {
+		*vdeadline = p->scx.dsq_vtime;
+		found = true;
+		break;
+	}
+	bpf_rcu_read_unlock();
+
+	return found;
+}
+
+/*
+ * The virtual deadline of the first task in each compute domain's DSQ, 0 if
+ * the DSQ is empty or its deadline is unknown. CPUs of other domains compare
+ * against it to decide whether to steal without touching the DSQ itself,
+ * whose lock is taken by every peek. It is lowered at enqueue and refreshed
+ * after a consume from the DSQ, racily, so it is only a hint. A lost update
+ * is repaired by the next enqueue to the domain and, in the meantime, idle
+ * CPUs still steal from a non-empty DSQ regardless of the hint.
+ */
+static u64 cpdom_head_vdl[LAVD_CPDOM_MAX_NR];
+
+static u64 *get_cpdom_head_vdl(u64 dsq_id)
+{
+	u64 cpdom_id = dsq_id - LAVD_CPDOM_DSQ_BASE;
+
+	/* per-CPU DSQs are below LAVD_CPDOM_DSQ_BASE and wrap around */
+	if (cpdom_id >= LAVD_CPDOM_MAX_NR)
+		return NULL;
+	return &cpdom_head_vdl[cpdom_id];
+}
+
+static void publish_cpdom_head_vdl(u64 dsq_id, u64 vdeadline)
+{
+	u64 *head = get_cpdom_head_vdl(dsq_id);
+	u64 cur;
+
+	if (!head)
+		return;
+
+	cur = READ_ONCE(*head);
+	if (!cur || vdeadline < cur)
+		WRITE_ONCE(*head, vdeadline);
+}
+
+static void refresh_cpdom_head_vdl(u64 dsq_id)
+{
+	u64 *head = get_cpdom_head_vdl(dsq_id);
+	u64 vdeadline;
+
+	if (!head)
+		return;
+
+	if (!peek_dsq_vdeadline(dsq_id, &vdeadline))
+		vdeadline = 0;
+	WRITE_ONCE(*head, vdeadline);
+}
+
+static bool try_yield_for_dsq(u64 dsq_id, struct task_struct *p_run,
+			      struct preemption_info *prm_run, s32 cpu_id)
+{
+	struct task_struct *p_wait;
+	struct task_ctx *taskc_wait;
+	struct preemption_info prm_wait;
+	s32 wait_vtm_cpu_id;
+	bool ret = false;
 
 	bpf_rcu_read_lock();
-	__COMPAT_DSQ_FOR_EACH(p_wait, LAVD_GLOBAL_DSQ, 0) {
+	__COMPAT_DSQ_FOR_EACH(p_wait, dsq_id, 0) {
 		taskc_wait = get_task_ctx(p_wait);
 		if (!taskc_wait)
 			break;
@@ -2050,7 +2587,7 @@ static bool try_yield_current_cpu(struct task_struct *p_run,
 		prm_wait.stopping_tm_est_ns = get_est_stopping_time(taskc_wait);
 		prm_wait.lat_prio = taskc_wait->lat_prio;
 
-		if (can_task1_kick_task2(&prm_wait, &prm_run)) {
+		if (can_task1_kick_task2(&prm_wait, prm_run)) {
 			/*
 			 * The atomic CAS guarantees only one task yield its
 			 * CPU for the waiting task.
@@ -2063,7 +2600,7 @@ static bool try_yield_current_cpu(struct task_struct *p_run,
 		}
 
 		/*
-		 * Test only the first entry on the LAVD_GLOBAL_DSQ.
+		 * Test only the first entry on the DSQ.
 		 */
 		break;
 	}
@@ -2072,18 +2609,111 @@ static bool try_yield_current_cpu(struct task_struct *p_run,
 	return ret;
 }
 
-static void put_global_rq(struct task_struct *p, struct task_ctx *taskc,
-			  struct cpu_ctx *cpuc, u64 enq_flags)
+static bool try_yield_current_cpu(struct task_struct *p_run,
+				  struct cpu_ctx *cpuc_run,
+				  struct task_ctx *taskc_run)
 {
-	struct task_ctx *taskc_run;
-	struct task_struct *p_run;
-	u64 vdeadline;
+	struct preemption_info prm_run;
+	s32 cpu_id = scx_bpf_task_cpu(p_run);
 
 	/*
-	 * Calculate when a tack can be scheduled.
-	 *
-	 * Note that the task's time slice will be calculated and reassigned
-	 * right before running at ops.running().
+	 * If there is a higher priority task waiting on the run queues this
+	 * CPU consumes from, the current running task yield the CPU by
+	 * shrinking its time slice to zero.
+	 */
+	prm_run.stopping_tm_est_ns = taskc_run->last_running_clk +
+				     taskc_run->run_time_ns -
+				     LAVD_PREEMPT_TICK_MARGIN;
+	prm_run.lat_prio = taskc_run->lat_prio;
+
+	if (scx_bpf_dsq_nr_queued(cpu_to_dsq(cpu_id)) &&
+	    try_yield_for_dsq(cpu_to_dsq(cpu_id), p_run, &prm_run, cpu_id))
+		return true;
+
+	return try_yield_for_dsq(cpu_to_cpdom_dsq(cpu_id), p_run, &prm_run,
+				 cpu_id);
+}
+
+static bool use_full_cpus(void)
+{
+	struct sys_stat *stat_cur = get_sys_stat_cur();
+	return no_core_compaction ||
+	       ((stat_cur->nr_active + LAVD_TC_NR_OVRFLW) >= nr_cpus_onln);
+}
+
+static s32 pick_cpu_in_use(struct task_struct *p, s32 cpu)
+{
+	struct bpf_cpumask *active, *ovrflw;
+	s32 cpu_in_use;
+
+	if (use_full_cpus())
+		return cpu;
+
+	/*
+	 * An inactive CPU only runs tasks which cannot run elsewhere, and
+	 * active CPUs look into other domains only for more urgent tasks. So,
+	 * if @cpu is neither active nor overflow, a task queued in its domain
+	 * could wait for long. Instead, pick an active or overflow CPU the
+	 * task can run on, if any.
+	 */
+	bpf_rcu_read_lock();
+
+	active = active_cpumask;
+	ovrflw = ovrflw_cpumask;
+	if (!active || !ovrflw)
+		goto unlock_out;
+
+	if (bpf_cpumask_test_cpu(cpu, cast_mask(active)) ||
+	    bpf_cpumask_test_cpu(cpu, cast_mask(ovrflw)))
+		goto unlock_out;
+
+	cpu_in_use = bpf_cpumask_any_and_distribute(p->cpus_ptr,
+						    cast_mask(active));
+	if (cpu_in_use >= nr_cpu_ids)
+		cpu_in_use = bpf_cpumask_any_and_distribute(p->cpus_ptr,
+							    cast_mask(ovrflw));
+	if (cpu_in_use < nr_cpu_ids)
+		cpu = cpu_in_use;
+
+unlock_out:
+	bpf_rcu_read_unlock();
+	return cpu;
+}
+
+static u64 pick_dsq(struct task_struct *p, struct task_ctx *taskc)
+{
+	s32 cpu;
+
+	/*
+	 * A task pinned to a CPU goes to the CPU's own DSQ, so other CPUs
+	 * never need to skip over it.
+	 */
+	if (p->nr_cpus_allowed == 1)
+		return cpu_to_dsq(bpf_cpumask_first(p->cpus_ptr));
+
+	/*
+	 * If a victim CPU was kicked for the task, queue it where the victim
+	 * will look first. Otherwise, stay in the domain of the CPU chosen at
+	 * ops.select_cpu() unless core compaction turned that CPU off.
+	 */
+	cpu = taskc->victim_cpu;
+	if (cpu == (s32)LAVD_CPU_ID_NONE)
+		cpu = pick_cpu_in_use(p, scx_bpf_task_cpu(p));
+	return cpu_to_cpdom_dsq(cpu);
+}
+
+static void put_cpdom_rq(struct task_struct *p, struct task_ctx *taskc,
+			  struct cpu_ctx *cpuc, u64 enq_flags)
+{
+	struct task_ctx *taskc_run;
+	struct task_struct *p_run;
+	u64 dsq_id, vdeadline;
+
+	/*
+	 * Calculate when a tack can be scheduled.
+	 *
+	 * Note that the task's time slice will be calculated and reassigned
+	 * right before running at ops.running().
 	 */
 	calc_when_to_run(p, taskc, cpuc, enq_flags);
 	vdeadline = taskc->eligible_delta_ns + taskc->vdeadline_delta_ns +
@@ -2104,11 +2734,14 @@ static void put_global_rq(struct task_struct *p, struct task_ctx *taskc,
 		try_yield_current_cpu(p_run, cpuc, taskc_run);
 
 	/*
-	 * Enqueue the task to the global runqueue based on its virtual
-	 * deadline.
+	 * Enqueue the task to the run queue of its compute domain based on
+	 * its virtual deadline, and let the other domains know if it is now
+	 * the most urgent one there.
 	 */
-	scx_bpf_dispatch_vtime(p, LAVD_GLOBAL_DSQ, LAVD_SLICE_UNDECIDED,
-			       vdeadline, enq_flags);
+	dsq_id = pick_dsq(p, taskc);
+	scx_bpf_dispatch_vtime(p, dsq_id, LAVD_SLICE_UNDECIDED, vdeadline,
+			       enq_flags);
+	publish_cpdom_head_vdl(dsq_id, vdeadline);
 
 }
 
@@ -2167,8 +2800,10 @@ static bool could_run_on_prev(struct task_struct *p, s32 prev_cpu,
 static s32 pick_cpu(struct task_struct *p, struct task_ctx *taskc,
 		    s32 prev_cpu, u64 wake_flags, bool *is_idle)
 {
+	struct sys_stat *stat_cur = get_sys_stat_cur();
 	struct cpu_ctx *cpuc;
-	struct bpf_cpumask *a_cpumask, *o_cpumask, *active, *ovrflw;
+	struct bpf_cpumask *a_cpumask, *o_cpumask, *t_cpumask, *active, *ovrflw;
+	struct bpf_cpumask *big, *little;
 	s32 cpu_id;
 
 	bpf_rcu_read_lock();
@@ -2193,9 +2828,57 @@ static s32 pick_cpu(struct task_struct *p, struct task_ctx *taskc,
 	}
 
 	bpf_cpumask_and(a_cpumask, p->cpus_ptr, cast_mask(active));
+	bpf_cpumask_and(o_cpumask, p->cpus_ptr, cast_mask(ovrflw));
+
+	/*
+	 * On a heterogeneous system, first look for an idle CPU of the type
+	 * the task prefers. A performance-critical task goes to an active big
+	 * core. Other tasks go to an active or overflow little core, which is
+	 * cheap to run, so they stay off the big cores that compaction fills
+	 * first. Little cores that compaction turned off are left alone.
+	 */
+	if (have_little_core) {
+		t_cpumask = cpuc->tmp_t_mask;
+		big = big_cpumask;
+		little = little_cpumask;
+		if (!t_cpumask || !big || !little) {
+			cpu_id = -ENOENT;
+			goto unlock_out;
+		}
+
+		if (is_perf_cri(taskc, stat_cur))
+			bpf_cpumask_and(t_cpumask, cast_mask(a_cpumask),
+					cast_mask(big));
+		else {
+			bpf_cpumask_or(t_cpumask, cast_mask(a_cpumask),
+				       cast_mask(o_cpumask));
+			bpf_cpumask_and(t_cpumask, cast_mask(t_cpumask),
+					cast_mask(little));
+		}
+
+		if (bpf_cpumask_test_cpu(prev_cpu, cast_mask(t_cpumask)) &&
+		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
+			cpu_id = prev_cpu;
+			*is_idle = true;
+			goto unlock_out;
+		}
+
+		cpu_id = scx_bpf_pick_idle_cpu(cast_mask(t_cpumask),
+					       SCX_PICK_IDLE_CORE);
+		if (cpu_id >= 0) {
+			*is_idle = true;
+			goto unlock_out;
+		}
+
+		cpu_id = scx_bpf_pick_idle_cpu(cast_mask(t_cpumask), 0);
+		if (cpu_id >= 0) {
+			*is_idle = true;
+			goto unlock_out;
+		}
+	}
 
 	/*
-	 * First, try to stay on the previous core if it is on active or ovrfw.
+	 * Then, try to stay on the previous core if it is on active or ovrfw.
 	 */
 	if (could_run_on_prev(p, prev_cpu, a_cpumask, o_cpumask) &&
 	    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
@@ -2226,8 +2909,6 @@ static s32 pick_cpu(struct task_struct *p, struct task_ctx *taskc,
 	/*
 	 * Then, pick an any idle core among overflow CPUs.
 	 */
-	bpf_cpumask_and(o_cpumask, p->cpus_ptr, cast_mask(ovrflw));
-
 	cpu_id = scx_bpf_pick_idle_cpu(cast_mask(o_cpumask), 0);
 	if (cpu_id >= 0) {
 		*is_idle = true;
@@ -2302,7 +2983,7 @@ s32 BPF_STRUCT_OPS(lavd_select_cpu, struct task_struct *p, s32 prev_cpu,
 	 * Prepare to put a task into a local queue. If the task is
 	 * over-scheduled or any error happens during the preparation, it won't
 	 * be put into the local queue. Instead, the task will be put into the
-	 * global queue during ops.enqueue().
+	 * run queue of its compute domain during ops.enqueue().
 	 */
 	if (!prep_put_local_rq(p, taskc, 0))
 		goto try_yield_out;
@@ -2310,8 +2991,8 @@ s32 BPF_STRUCT_OPS(lavd_select_cpu, struct task_struct *p, s32 prev_cpu,
 	/*
 	 * If the task can be put into the local queue, find an idle CPU first.
 	 * If there is an idle CPU, put the task into the local queue as
-	 * planned. Otherwise, let ops.enqueue() put the task into the global
-	 * queue.
+	 * planned. Otherwise, let ops.enqueue() put the task into the run
+	 * queue of its compute domain.
 	 *
 	 * Note that once an idle CPU is successfully picked (i.e., found_idle
 	 * == true), then the picked CPU must be returned. Otherwise, that CPU
@@ -2326,7 +3007,7 @@ s32 BPF_STRUCT_OPS(lavd_select_cpu, struct task_struct *p, s32 prev_cpu,
 
 	/*
 	 * If there is no idle CPU, consider to preempt out the current running
-	 * task if there is a higher priority task in the global run queue.
+	 * task if there is a higher priority task in its run queues.
 	 */
 try_yield_out:
 	p_run = bpf_get_current_task_btf();
@@ -2353,8 +3034,8 @@ void BPF_STRUCT_OPS(lavd_enqueue, struct task_struct *p, u64 enq_flags)
 	 * Hence, the task that is enqueued here are the cases: 1) there is no
 	 * idle CPU when ops.select_cpu() or 2) the task is not the case of
 	 * being wakened up (i.e., resume after preemption). Therefore, we
-	 * always put the task to the global DSQ, so any idle CPU can pick it
-	 * up.
+	 * always put the task to the DSQ of its compute domain, where the
+	 * domain's CPUs pick it up first and the others can steal it.
 	 */
 	cpuc = get_cpu_ctx();
 	taskc = get_task_ctx(p);
@@ -2362,9 +3043,9 @@ void BPF_STRUCT_OPS(lavd_enqueue, struct task_struct *p, u64 enq_flags)
 		return;
 
 	/*
-	 * Place a task to the global run queue.
+	 * Place a task to the run queue of its compute domain.
 	 */
-	put_global_rq(p, taskc, cpuc, enq_flags);
+	put_cpdom_rq(p, taskc, cpuc, enq_flags);
 }
 
 static bool is_kernel_task(struct task_struct *p)
@@ -2372,23 +3053,158 @@ static bool is_kernel_task(struct task_struct *p)
 	return p->flags & PF_KTHREAD;
 }
 
-static bool use_full_cpus(void)
+static bool can_steal_from(u64 dsq_id, u64 vdl_local, u64 *vdeadline)
 {
-	struct sys_stat *stat_cur = get_sys_stat_cur();
-	return no_core_compaction ||
-	       ((stat_cur->nr_active + LAVD_TC_NR_OVRFLW) >= nr_cpus_onln);
+	u64 *head = get_cpdom_head_vdl(dsq_id);
+
+	if (!head)
+		return false;
+
+	/*
+	 * While there are local tasks, decide only by the published head
+	 * deadline, so that busy CPUs do not touch the other domains' DSQs
+	 * unless stealing is worth it. Without a known deadline, steal only
+	 * not to go idle.
+	 */
+	*vdeadline = READ_ONCE(*head);
+	if (vdl_local != U64_MAX &&
+	    (!*vdeadline || (*vdeadline + LAVD_CPDOM_STEAL_MARGIN_NS) >= vdl_local))
+		return false;
+
+	if (!scx_bpf_dsq_nr_queued(dsq_id))
+		return false;
+
+	if (!*vdeadline)
+		*vdeadline = U64_MAX;
+	return true;
+}
+
+/*
+ * Consume a task from the compute domain DSQ @dsq_id and publish its new
+ * head deadline.
+ */
+static bool consume_cpdom_dsq(u64 dsq_id)
+{
+	if (!scx_bpf_consume(dsq_id))
+		return false;
+
+	refresh_cpdom_head_vdl(dsq_id);
+	return true;
+}
+
+static bool steal_task(s32 cpu, u64 vdl_local)
+{
+	u64 own_dsq = cpu_to_cpdom_dsq(cpu), victim_dsq = own_dsq;
+	u64 vdeadline, min_vdeadline = U64_MAX;
+	u32 i;
+
+	/*
+	 * Steal the task with the earliest deadline among the other domains
+	 * if there is nothing to run locally (@vdl_local == U64_MAX) or if
+	 * that task is more urgent than the local ones by more than
+	 * LAVD_CPDOM_STEAL_MARGIN_NS. So the system as a whole still runs
+	 * tasks in the deadline order, while tasks do not bounce across
+	 * domains over small deadline differences. The other domains are
+	 * compared by their published head deadlines, so only the DSQ which
+	 * is actually stolen from is locked.
+	 */
+	bpf_for(i, 0, nr_cpdoms) {
+		u64 dsq_id = LAVD_CPDOM_DSQ_BASE + i;
+
+		if (dsq_id == own_dsq ||
+		    !can_steal_from(dsq_id, vdl_local, &vdeadline))
+			continue;
+
+		if (victim_dsq == own_dsq || vdeadline < min_vdeadline) {
+			victim_dsq = dsq_id;
+			min_vdeadline = vdeadline;
+		}
+	}
+
+	if (victim_dsq == own_dsq)
+		return false;
+	if (consume_cpdom_dsq(victim_dsq))
+		return true;
+
+	/*
+	 * None of the tasks in the chosen domain can run on this CPU (e.g.,
+	 * due to their affinity). Try the other domains.
+	 */
+	bpf_for(i, 0, nr_cpdoms) {
+		u64 dsq_id = LAVD_CPDOM_DSQ_BASE + i;
+
+		if (dsq_id == own_dsq || dsq_id == victim_dsq ||
+		    !can_steal_from(dsq_id, vdl_local, &vdeadline))
+			continue;
+
+		if (consume_cpdom_dsq(dsq_id))
+			return true;
+	}
+
+	return false;
+}
+
+static bool consume_task(s32 cpu)
+{
+	u64 cpu_dsq = cpu_to_dsq(cpu), cpdom_dsq = cpu_to_cpdom_dsq(cpu);
+	u64 vdl_cpu = U64_MAX, vdl_cpdom = U64_MAX;
+	bool has_cpu, has_cpdom;
+
+	has_cpu = scx_bpf_dsq_nr_queued(cpu_dsq) > 0;
+	has_cpdom = scx_bpf_dsq_nr_queued(cpdom_dsq) > 0;
+
+	/*
+	 * Find the earliest deadline among the tasks pinned to this CPU and
+	 * the ones in the compute domain. Without deadlines, local tasks are
+	 * considered the most urgent.
+	 */
+	if (has_cpu && !peek_dsq_vdeadline(cpu_dsq, &vdl_cpu))
+		vdl_cpu = 0;
+	if (has_cpdom && !peek_dsq_vdeadline(cpdom_dsq, &vdl_cpdom))
+		vdl_cpdom = 0;
+
+	/*
+	 * A task in another domain goes first if it is more urgent than any
+	 * local one. Otherwise, tasks in a domain whose CPUs are busy or
+	 * turned off by core compaction could wait indefinitely.
+	 */
+	if (steal_task(cpu, min(vdl_cpu, vdl_cpdom)))
+		return true;
+
+	/*
+	 * Run whichever task has the earlier deadline between the ones pinned
+	 * to this CPU and the ones in the compute domain. Pinned tasks win a
+	 * tie since no other CPU can run them.
+	 */
+	if (has_cpu && vdl_cpu <= vdl_cpdom && scx_bpf_consume(cpu_dsq))
+		return true;
+	if (has_cpdom && consume_cpdom_dsq(cpdom_dsq))
+		return true;
+	if (has_cpu && scx_bpf_consume(cpu_dsq))
+		return true;
+
+	/*
+	 * None of the local tasks could be consumed, so take whatever the
+	 * other domains have.
+	 */
+	if (has_cpu || has_cpdom)
+		return steal_task(cpu, U64_MAX);
+
+	return false;
 }
 
 void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 {
 	struct bpf_cpumask *active, *ovrflw;
 	struct task_struct *p;
+	u64 cpu_dsq, cpdom_dsq;
+	bool in_use;
 
 	/*
 	 * If all CPUs are using, directly consume without checking CPU masks.
 	 */
 	if (use_full_cpus()) {
-		scx_bpf_consume(LAVD_GLOBAL_DSQ);
+		consume_task(cpu);
 		return;
 	}
 
@@ -2407,27 +3223,47 @@ void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 	/*
 	 * If the CPU belonges to the active or overflow set, dispatch a task.
 	 */
-	if (bpf_cpumask_test_cpu(cpu, cast_mask(active)) ||
-	    bpf_cpumask_test_cpu(cpu, cast_mask(ovrflw))) {
-		scx_bpf_consume(LAVD_GLOBAL_DSQ);
-		goto unlock_out;
+	in_use = bpf_cpumask_test_cpu(cpu, cast_mask(active)) ||
+		 bpf_cpumask_test_cpu(cpu, cast_mask(ovrflw));
+	if (in_use) {
+		bpf_rcu_read_unlock();
+		consume_task(cpu);
+		return;
 	}
 
 	/*
-	 * If this CPU is not either in active or overflow CPUs, it tries to
-	 * find and run a task pinned to run on this CPU.
+	 * If this CPU is not either in active or overflow CPUs, it only runs
+	 * tasks which cannot run elsewhere. First, run a task pinned to this
+	 * CPU. Most pinned tasks are kernel tasks, which are latency-critical
+	 * (e.g., ksoftirqd, kworker, etc) and run without activating the CPU.
 	 */
-	__COMPAT_DSQ_FOR_EACH(p, LAVD_GLOBAL_DSQ, 0) {
-		/*
-		 * Prioritize kernel tasks because most kernel tasks are pinned
-		 * to a particular CPU and latency-critical (e.g., ksoftirqd,
-		 * kworker, etc).
-		 */
-		if (is_kernel_task(p)) {
-			scx_bpf_consume(LAVD_GLOBAL_DSQ);
+	cpu_dsq = cpu_to_dsq(cpu);
+	if (scx_bpf_dsq_nr_queued(cpu_dsq)) {
+		__COMPAT_DSQ_FOR_EACH(p, cpu_dsq, 0) {
+			/*
+			 * This is the first time a particular pinned
+			 * user-space task is run on this CPU at this interval.
+			 * From now on, this CPU will be part of the active CPU
+			 * so can be used to run the pinned task and the other
+			 * tasks. Note that we don't need to kick @cpu here
+			 * since @cpu is the current CPU, which is obviously
+			 * not idle.
+			 */
+			if (!is_kernel_task(p))
+				bpf_cpumask_set_cpu(cpu, active);
 			break;
 		}
 
+		if (scx_bpf_consume(cpu_dsq))
+			goto unlock_out;
+	}
+
+	/*
+	 * Then, run the first task of the compute domain if it cannot run on
+	 * any of the active or overflow CPUs.
+	 */
+	cpdom_dsq = cpu_to_cpdom_dsq(cpu);
+	__COMPAT_DSQ_FOR_EACH(p, cpdom_dsq, 0) {
 		/*
 		 * This is a hack to bypass the restriction of the current BPF
 		 * not trusting the pointer p. Once the BPF verifier gets
@@ -2448,25 +3284,11 @@ void BPF_STRUCT_OPS(lavd_dispatch, s32 cpu, struct task_struct *prev)
 
 		/*
 		 * Otherwise, that means there is a task that should run on
-		 * this particular CPU. So, consume one of such tasks.
-		 *
-		 * Note that this path is not optimized since scx_bpf_consume()
-		 * should traverse until it finds any task that can run on this
-		 * CPU. The scheduled task might be runnable on the active
-		 * cores. We will optimize this path after introducing per-core
-		 * DSQ.
+		 * this CPU. So, consume the task and make this CPU part of the
+		 * active CPUs as above.
 		 */
-		scx_bpf_consume(LAVD_GLOBAL_DSQ);
-
-		/*
-		 * This is the first time a particular pinned user-space task
-		 * is run on this CPU at this interval. From now on, this CPU
-		 * will be part of the active CPU so can be used to run the
-		 * pinned task and the other tasks. Note that we don't need to
-		 * kick @cpu here since @cpu is the current CPU, which is
-		 * obviously not idle.
-		 */
-		bpf_cpumask_set_cpu(cpu, active);
+		if (scx_bpf_consume(cpdom_dsq))
+			bpf_cpumask_set_cpu(cpu, active);
 
 release_break:
 		bpf_task_release(p);
@@ -2511,6 +3333,20 @@ static int calc_cpuperf_target(struct sys_stat *stat_cur,
 	cpuperf_target = (cpu_load * SCX_CPUPERF_ONE) / max_load;
 	cpuperf_target = min(cpuperf_target, SCX_CPUPERF_ONE);
 
+	/*
+	 * With an energy model, core compaction sizes the active set assuming
+	 * that the active CPUs run at least at the chosen performance state.
+	 * Do not go below it, or the active CPUs cannot handle the load.
+	 */
+	if (have_energy_model && !no_core_compaction) {
+		if (is_big_cpu(cpuc->cpu_id))
+			cpuperf_target = max(cpuperf_target,
+					     stat_cur->cpuperf_em_big);
+		else
+			cpuperf_target = max(cpuperf_target,
+					     stat_cur->cpuperf_em_little);
+	}
+
 	cpuc->cpuperf_task = cpuperf_target;
 	cpuc->cpuperf_avg = calc_avg32(cpuc->cpuperf_avg, cpuperf_target);
 	return 0;
@@ -2683,6 +3519,7 @@ void BPF_STRUCT_OPS(lavd_running, struct task_struct *p)
 	 */
 	cpuc->lat_prio = taskc->lat_prio;
 	cpuc->stopping_tm_est_ns = get_est_stopping_time(taskc);
+	update_victim_bkt(cpuc);
 
 	/*
 	 * Calculate the task's time slice based on updated load if necessary.
@@ -2794,6 +3631,7 @@ static void cpu_ctx_init_online(struct cpu_ctx *cpuc, u32 cpu_id, u64 now)
 	barrier();
 
 	cpuc->is_online = true;
+	update_victim_bkt(cpuc);
 }
 
 static void cpu_ctx_init_offline(struct cpu_ctx *cpuc, u32 cpu_id, u64 now)
@@ -2806,6 +3644,7 @@ static void cpu_ctx_init_offline(struct cpu_ctx *cpuc, u32 cpu_id, u64 now)
 
 	cpuc->lat_prio = LAVD_LAT_PRIO_IDLE;
 	cpuc->stopping_tm_est_ns = LAVD_TIME_INFINITY_NS;
+	update_victim_bkt(cpuc);
 }
 
 void BPF_STRUCT_OPS(lavd_cpu_online, s32 cpu)
@@ -2867,6 +3706,7 @@ void BPF_STRUCT_OPS(lavd_update_idle, s32 cpu, bool idle)
 		cpuc->idle_start_clk = bpf_ktime_get_ns();
 		cpuc->lat_prio = LAVD_LAT_PRIO_IDLE;
 		cpuc->stopping_tm_est_ns = LAVD_TIME_INFINITY_NS;
+		update_victim_bkt(cpuc);
 	}
 	/*
 	 * The CPU is exiting from the idle state.
@@ -2880,16 +3720,20 @@ void BPF_STRUCT_OPS(lavd_update_idle, s32 cpu, bool idle)
 		u64 old_clk = cpuc->idle_start_clk;
 		if (old_clk != 0) {
 			/*
-			 * The CAS failure happens when idle_start_clk is
-			 * updated by the update timer. That means the update
-			 * timer already took the idle_time duration. Hence the
-			 * idle duration should not be accumulated.
+			 * The part of the idle period before the current
+			 * epoch was already taken by the update timer when it
+			 * closed the previous epoch. Hence, only the rest is
+			 * accumulated.
 			 */
-			u64 duration = bpf_ktime_get_ns() - old_clk;
-			bool ret = __sync_bool_compare_and_swap(
-					&cpuc->idle_start_clk, old_clk, 0);
-			if (ret)
-				cpuc->idle_total += duration;
+			struct cpu_epoch_stat *es = get_epoch_stat(cpuc);
+			u64 epoch_clk = READ_ONCE(cur_epoch_clk);
+			u64 now = bpf_ktime_get_ns();
+
+			if (old_clk < epoch_clk)
+				old_clk = epoch_clk;
+			if (now > old_clk)
+				es->idle_total += now - old_clk;
+			cpuc->idle_start_clk = 0;
 		}
 	}
 }
@@ -2931,6 +3775,137 @@ static void init_task_ctx(struct task_struct *p, struct task_ctx *taskc)
 	taskc->slice_ns = 0;
 }
 
+static void update_task_cgrp_lat(struct task_ctx *taskc, struct cgroup *cgrp)
+{
+	struct cgroup *ancestor;
+	struct cgrp_lat *cgl;
+	int i, level;
+
+	taskc->cgrp_lat_boost = 0;
+	taskc->cgrp_lat_prio_max = NICE_WIDTH - 1;
+
+	if (!have_cgrp_lat || !cgrp)
+		return;
+
+	/*
+	 * The override of the closest ancestor, including @cgrp itself, is
+	 * applied to the task.
+	 */
+	bpf_for(i, 0, LAVD_CGRP_MAX_DEPTH) {
+		level = cgrp->level - i;
+		if (level < 0)
+			break;
+
+		ancestor = bpf_cgroup_ancestor(cgrp, level);
+		if (!ancestor)
+			break;
+
+		cgl = bpf_cgrp_storage_get(&cgrp_lat_stor, ancestor, 0, 0);
+		if (cgl) {
+			taskc->cgrp_lat_boost = cgl->lat_boost;
+			taskc->cgrp_lat_prio_max = cgl->lat_prio_max;
+		}
+		bpf_cgroup_release(ancestor);
+
+		if (cgl)
+			break;
+	}
+}
+
+static void refresh_task_cgrp_lat(struct task_struct *p,
+				  struct task_ctx *taskc)
+{
+	struct cgroup *cgrp = NULL;
+
+	/*
+	 * Record the generation first so that an override set during the
+	 * lookup is picked up next time.
+	 */
+	taskc->cgrp_lat_gen = READ_ONCE(cgrp_lat_gen);
+
+	/*
+	 * Overrides are set on the cgroups of the default hierarchy, which
+	 * tasks belong to regardless of whether the cpu controller is enabled
+	 * there. So, resolve them from the task's default hierarchy cgroup
+	 * instead of the cpu controller membership that ops.init_task() and
+	 * ops.cgroup_move() follow.
+	 */
+	if (have_cgrp_lat)
+		cgrp = bpf_cgroup_from_id(BPF_CORE_READ(p, cgroups, dfl_cgrp,
+							kn, id));
+	update_task_cgrp_lat(taskc, cgrp);
+	if (cgrp)
+		bpf_cgroup_release(cgrp);
+}
+
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(lavd_process_fork, struct task_struct *parent,
+	     struct task_struct *child)
+{
+	struct task_ctx *taskc;
+
+	/*
+	 * A forked task is assigned to its cgroup after ops.init_task(), but
+	 * before it first runs.
+	 */
+	if (have_cgrp_lat && (taskc = try_get_task_ctx(child)))
+		refresh_task_cgrp_lat(child, taskc);
+	return 0;
+}
+
+SEC("tp_btf/cgroup_attach_task")
+int BPF_PROG(lavd_cgroup_attach_task, struct cgroup *cgrp,
+	     const char *cgrp_path, struct task_struct *leader,
+	     bool threadgroup)
+{
+	struct list_head *thread_head;
+	struct task_struct *next, *p;
+	struct task_ctx *taskc;
+	int pid;
+
+	if (!have_cgrp_lat)
+		return 0;
+
+	/*
+	 * The tracepoint fires after @leader, and all its threads if
+	 * @threadgroup, moved to @cgrp. Resolve the overrides again for all
+	 * of them.
+	 */
+	if ((taskc = try_get_task_ctx(leader)))
+		refresh_task_cgrp_lat(leader, taskc);
+
+	if (!threadgroup)
+		return 0;
+
+	thread_head = &leader->signal->thread_head;
+
+	if (!(next = bpf_task_acquire(leader)))
+		return 0;
+
+	bpf_repeat(LAVD_CGRP_MAX_THREADS) {
+		p = container_of(next->thread_node.next, struct task_struct,
+				 thread_node);
+		bpf_task_release(next);
+
+		if (&p->thread_node == thread_head) {
+			next = NULL;
+			break;
+		}
+
+		pid = BPF_CORE_READ(p, pid);
+		next = bpf_task_from_pid(pid);
+		if (!next)
+			break;
+
+		if ((taskc = try_get_task_ctx(next)))
+			refresh_task_cgrp_lat(next, taskc);
+	}
+
+	if (next)
+		bpf_task_release(next);
+	return 0;
+}
+
 s32 BPF_STRUCT_OPS(lavd_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
@@ -2953,6 +3928,10 @@ s32 BPF_STRUCT_OPS(lavd_init_task, struct task_struct *p,
 	 * Initialize @p's context.
 	 */
 	init_task_ctx(p, taskc);
+	if (args->fork)
+		update_task_cgrp_lat(taskc, NULL);
+	else
+		refresh_task_cgrp_lat(p, taskc);
 
 	/*
 	 * When a task is forked, we immediately reflect changes to the current
@@ -2985,7 +3964,7 @@ static int calloc_cpumask(struct bpf_cpumask **p_cpumask)
 
 static int init_cpumasks(void)
 {
-	struct bpf_cpumask *active;
+	struct bpf_cpumask *active, *big, *little;
 	int err = 0;
 	u32 cpu;
 
@@ -2999,6 +3978,26 @@ static int init_cpumasks(void)
 	if (err)
 		goto out;
 
+	/*
+	 * Split CPUs into big and little cores.
+	 */
+	err = calloc_cpumask(&big_cpumask);
+	if (err)
+		goto out;
+
+	err = calloc_cpumask(&little_cpumask);
+	big = big_cpumask;
+	little = little_cpumask;
+	if (err || !big || !little)
+		goto out;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		if (is_big_cpu(cpu))
+			bpf_cpumask_set_cpu(cpu, big);
+		else
+			bpf_cpumask_set_cpu(cpu, little);
+	}
+
 	/*
 	 * Initially activate all CPUs until we know the system load.
 	 */
@@ -3011,6 +4010,39 @@ out:
 	return err;
 }
 
+static int init_victim_bkts(void)
+{
+	struct victim_bkt *vbkt;
+	struct cpu_ctx *cpuc;
+	int err;
+	u32 i;
+
+	bpf_for(i, 0, LAVD_VICTIM_NR_BKTS) {
+		vbkt = bpf_map_lookup_elem(&victim_bkt_stor, &i);
+		if (!vbkt) {
+			scx_bpf_error("Failed to lookup victim bucket: %d", i);
+			return -ESRCH;
+		}
+
+		err = calloc_cpumask(&vbkt->cpumask);
+		if (err)
+			return err;
+	}
+
+	/*
+	 * Put online CPUs into the buckets of their running tasks.
+	 */
+	bpf_for(i, 0, nr_cpus_onln) {
+		cpuc = get_cpu_ctx_id(i);
+		if (!cpuc)
+			return -ESRCH;
+
+		update_victim_bkt(cpuc);
+	}
+
+	return 0;
+}
+
 static s32 init_per_cpu_ctx(u64 now)
 {
 	int cpu;
@@ -3031,6 +4063,11 @@ static s32 init_per_cpu_ctx(u64 now)
 		if (err)
 			return err;
 
+		err = calloc_cpumask(&cpuc->tmp_t_mask);
+		if (err)
+			return err;
+
+		cpuc->victim_bkt = LAVD_VICTIM_BKT_NONE;
 		cpu_ctx_init_online(cpuc, cpu, now);
 		cpuc->offline_clk = now;
 	}
@@ -3047,6 +4084,8 @@ static s32 init_sys_stat(u64 now)
 	memset(__sys_stats, 0, sizeof(__sys_stats));
 	__sys_stats[0].last_update_clk = now;
 	__sys_stats[1].last_update_clk = now;
+	cur_epoch = 1; /* not to match the zero-initialized slots */
+	cur_epoch_clk = now;
 	__sys_stats[0].nr_active = nr_cpus_onln;
 	__sys_stats[1].nr_active = nr_cpus_onln;
 
@@ -3066,19 +4105,53 @@ static s32 init_sys_stat(u64 now)
 	return 0;
 }
 
+static s32 init_dsqs(void)
+{
+	int err;
+	u32 i;
+
+	/*
+	 * Create a deadline-ordered task queue per compute domain.
+	 */
+	bpf_for(i, 0, nr_cpdoms) {
+		if (i >= LAVD_CPDOM_MAX_NR)
+			break;
+
+		err = scx_bpf_create_dsq(LAVD_CPDOM_DSQ_BASE + i, -1);
+		if (err) {
+			scx_bpf_error("Failed to create a DSQ for domain %d", i);
+			return err;
+		}
+	}
+
+	/*
+	 * Create a task queue per CPU for pinned tasks.
+	 */
+	bpf_for(i, 0, nr_cpu_ids) {
+		if (i >= LAVD_CPU_ID_MAX)
+			break;
+
+		err = scx_bpf_create_dsq(cpu_to_dsq(i), -1);
+		if (err) {
+			scx_bpf_error("Failed to create a DSQ for cpu %d", i);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
 s32 BPF_STRUCT_OPS_SLEEPABLE(lavd_init)
 {
 	u64 now = bpf_ktime_get_ns();
 	int err;
 
 	/*
-	 * Create a central task queue.
+	 * Create DSQs.
 	 */
-	err = scx_bpf_create_dsq(LAVD_GLOBAL_DSQ, -1);
-	if (err) {
-		scx_bpf_error("Failed to create a shared DSQ");
+	err = init_dsqs();
+	if (err)
 		return err;
-	}
 
 	/*
 	 * Initialize per-CPU context.
@@ -3100,11 +4173,20 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(lavd_init)
 	 *  - active CPUs: a group of CPUs will be used for now.
 	 *  - overflow CPUs: a pair of hyper-twin which will be used when there
 	 *    is no idle active CPUs.
+	 *  - big and little CPUs: CPUs split by their capacity.
 	 */
 	err = init_cpumasks();
 	if (err)
 		return err;
 
+	/*
+	 * Allocate cpumasks for the victim CPU search, which must follow the
+	 * per-CPU context initialization.
+	 */
+	err = init_victim_bkts();
+	if (err)
+		return err;
+
 	return err;
 }
 
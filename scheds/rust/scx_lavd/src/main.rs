@@ -11,7 +11,19 @@ pub use bpf_skel::*;
 pub mod bpf_intf;
 pub use bpf_intf::*;
 
+use std::cell::RefCell;
+use std::cmp::Reverse;
+use std::fs::File;
+use std::io::BufReader;
+use std::io::BufWriter;
+use std::io::ErrorKind;
+use std::io::Read;
+use std::io::Write;
 use std::mem;
+use std::os::fd::AsRawFd;
+use std::os::unix::fs::MetadataExt;
+use std::path::Path;
+use std::rc::Rc;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
 use std::time::Duration;
@@ -20,6 +32,7 @@ use libc::c_char;
 use std::ffi::CStr;
 use std::str;
 
+use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
 use clap::Parser;
@@ -27,12 +40,17 @@ use libbpf_rs::skel::OpenSkel;
 use libbpf_rs::skel::Skel;
 use libbpf_rs::skel::SkelBuilder;
 use log::info;
+use log::warn;
 use scx_utils::build_id;
 use scx_utils::scx_ops_attach;
 use scx_utils::scx_ops_load;
 use scx_utils::scx_ops_open;
 use scx_utils::uei_exited;
 use scx_utils::uei_report;
+use scx_utils::Cache;
+use scx_utils::Core;
+use scx_utils::Cpu;
+use scx_utils::Node;
 use scx_utils::Topology;
 use scx_utils::UserExitInfo;
 
@@ -42,6 +60,30 @@ use rlimit::{getrlimit, setrlimit, Resource};
 
 static RUNNING: AtomicBool = AtomicBool::new(true);
 
+/// Magic, version and the size of msg_task_ctx at the start of a capture
+/// file. The header is followed by raw introspection records, each prefixed
+/// with its length as a u32. All integers are in the native byte order of the
+/// capturing host. Only captures whose record size matches this build's
+/// msg_task_ctx are decoded.
+const CAPTURE_MAGIC: &[u8; 8] = b"LAVDCAP\0";
+const CAPTURE_VERSION: u32 = 3;
+const CAPTURE_BUF_SIZE: usize = 1 << 20;
+
+/// Capture writer shared with the ring buffer callback. It outlives
+/// scheduler restarts and becomes None after a write error.
+type Capture = Rc<RefCell<Option<BufWriter<File>>>>;
+
+/// A CPU whose capacity is below this percentage of the most capable CPU is a
+/// little core.
+const LITTLE_CORE_CAPACITY_PCT: usize = 80;
+
+/// The kernel energy model, one directory per performance domain.
+const ENERGY_MODEL_PATH: &str = "/sys/kernel/debug/energy_model";
+
+/// The power of an active but idle CPU, in percent of the power of its
+/// lowest performance state, when the energy model doesn't tell.
+const EM_IDLE_POWER_PCT: u32 = 10;
+
 /// scx_lavd: Latency-criticality Aware Virtual Deadline (LAVD) scheduler
 ///
 /// The rust part is minimal. It processes command line options and logs out
@@ -57,6 +99,11 @@ struct Opts {
     #[clap(long = "no-freq-scaling", action = clap::ArgAction::SetTrue)]
     no_freq_scaling: bool,
 
+    /// Use a run queue per core instead of per LLC. This improves cache locality further at the
+    /// cost of more frequent task stealing across cores.
+    #[clap(long = "per-core-dsq", action = clap::ArgAction::SetTrue)]
+    per_core_dsq: bool,
+
     /// The number of scheduling samples to be reported every second (default: 1)
     #[clap(short = 's', long, default_value = "1")]
     nr_sched_samples: u64,
@@ -65,6 +112,33 @@ struct Opts {
     #[clap(short = 'p', long, default_value = "0")]
     pid_traced: u64,
 
+    /// Write the raw scheduling samples to a file or a named pipe instead of printing them, so
+    /// that heavy sampling doesn't slow down the scheduler. Use --decode to print them later.
+    #[clap(long)]
+    capture: Option<String>,
+
+    /// Print the scheduling samples in a file written by --capture and exit.
+    #[clap(long)]
+    decode: Option<String>,
+
+    /// Override the latency priority of the tasks in a cgroup and its descendants, in the form
+    /// CGROUP:BOOST[:MAX]. CGROUP is a path relative to /sys/fs/cgroup. BOOST is added to the
+    /// latency priority, so a negative BOOST makes the tasks more latency-critical and a positive
+    /// one demotes them. MAX, in [0, 40), caps the latency priority so that the tasks are never
+    /// treated as less latency-critical than that. Membership follows the cgroup v2 hierarchy
+    /// whether or not the cpu controller is enabled. The override is kept by path: it is applied
+    /// once the cgroup exists and again whenever the cgroup is created again, e.g. when a
+    /// service restarts. Can be specified multiple times.
+    #[clap(long, value_parser = parse_cgroup_lat)]
+    cgroup_lat: Vec<(String, cgrp_lat)>,
+
+    /// Read the power of each performance state from a file instead of the kernel energy model.
+    /// Each line is TYPE FREQ POWER, where TYPE is big or little, FREQ is a frequency in kHz or
+    /// idle for an active but idle CPU, and POWER is in microwatts. With an energy model, core
+    /// compaction chooses the number of active CPUs that minimizes the estimated energy.
+    #[clap(long)]
+    power_table: Option<String>,
+
     /// Exit debug dump buffer length. 0 indicates default.
     #[clap(long, default_value = "0")]
     exit_dump_len: u32,
@@ -77,6 +151,135 @@ struct Opts {
 
 unsafe impl Plain for msg_task_ctx {}
 
+unsafe impl Plain for cgrp_lat {}
+
+fn parse_cgroup_lat(arg: &str) -> Result<(String, cgrp_lat)> {
+    let nice_width = 40;
+    let mut fields = arg.split(':');
+    let path = fields.next().unwrap_or("").trim_matches('/').to_string();
+    let boost: i32 = match fields.next() {
+        Some(v) => v
+            .parse()
+            .with_context(|| format!("Invalid boost {:?}", v))?,
+        None => bail!("Missing boost in {:?}", arg),
+    };
+    let max: u32 = match fields.next() {
+        Some(v) => v.parse().with_context(|| format!("Invalid max {:?}", v))?,
+        None => nice_width - 1,
+    };
+    if fields.next().is_some() {
+        bail!("Too many fields in {:?}", arg);
+    }
+    if boost.unsigned_abs() >= nice_width || max >= nice_width {
+        bail!("Boost and max should be within the nice range in {:?}", arg);
+    }
+
+    Ok((
+        path,
+        cgrp_lat {
+            lat_boost: boost,
+            lat_prio_max: max,
+        },
+    ))
+}
+
+/// A --cgroup-lat override and the cgroup it is currently set on
+struct CgroupLat {
+    path: String,
+    cgl: cgrp_lat,
+    /// ID of the cgroup last seen at @path, None if there was none
+    cgrp_id: Option<u64>,
+}
+
+/// Energy model of a core type
+#[derive(Debug, Default)]
+struct EnergyModel {
+    /// Performance states as (frequency in kHz, power in uW)
+    ps: Vec<(u32, u32)>,
+    /// Power of an active but idle CPU in uW
+    idle_power: Option<u32>,
+}
+
+fn read_file_u32(path: &Path) -> Result<u32> {
+    let val =
+        std::fs::read_to_string(path).with_context(|| format!("Failed to read {:?}", path))?;
+    val.trim()
+        .parse()
+        .with_context(|| format!("Failed to parse {:?}", path))
+}
+
+fn read_kernel_energy_model(cpu_is_big: &[bool]) -> Result<[EnergyModel; 2]> {
+    let mut em: [EnergyModel; 2] = Default::default();
+    for pd in std::fs::read_dir(ENERGY_MODEL_PATH)? {
+        // A performance domain lists its CPUs, which share the same
+        // performance states, so its first CPU tells the core type.
+        let pd = pd?.path();
+        let cpus = std::fs::read_to_string(pd.join("cpus"))?;
+        let first: usize = match cpus.trim().split(['-', ',']).next() {
+            Some(cpu) => cpu.parse()?,
+            None => continue,
+        };
+        let em_type = match cpu_is_big.get(first) {
+            Some(false) => consts_LAVD_EM_LITTLE,
+            _ => consts_LAVD_EM_BIG,
+        } as usize;
+        if !em[em_type].ps.is_empty() {
+            continue;
+        }
+
+        for ps in std::fs::read_dir(&pd)? {
+            let ps = ps?.path();
+            let is_ps = ps
+                .file_name()
+                .map_or(false, |name| name.to_string_lossy().starts_with("ps:"));
+            if !is_ps {
+                continue;
+            }
+            let freq = read_file_u32(&ps.join("frequency"))?;
+            let power = read_file_u32(&ps.join("power"))?;
+            em[em_type].ps.push((freq, power));
+        }
+    }
+    Ok(em)
+}
+
+fn read_power_table(path: &str) -> Result<[EnergyModel; 2]> {
+    let table = std::fs::read_to_string(path)
+        .with_context(|| format!("Failed to read power table {:?}", path))?;
+    let mut em: [EnergyModel; 2] = Default::default();
+    for (i, line) in table.lines().enumerate() {
+        let line = line.split('#').next().unwrap_or("").trim();
+        if line.is_empty() {
+            continue;
+        }
+        let fields: Vec<&str> = line.split_whitespace().collect();
+        if fields.len() != 3 {
+            bail!("{}:{}: expected TYPE FREQ POWER", path, i + 1);
+        }
+        let em_type = match fields[0] {
+            "big" => consts_LAVD_EM_BIG,
+            "little" => consts_LAVD_EM_LITTLE,
+            t => bail!("{}:{}: invalid core type {:?}", path, i + 1, t),
+        } as usize;
+        let power: u32 = fields[2]
+            .parse()
+            .with_context(|| format!("{}:{}: invalid power", path, i + 1))?;
+        match fields[1] {
+            "idle" => em[em_type].idle_power = Some(power),
+            f => {
+                let freq: u32 = f
+                    .parse()
+                    .with_context(|| format!("{}:{}: invalid frequency", path, i + 1))?;
+                if freq == 0 {
+                    bail!("{}:{}: zero frequency", path, i + 1);
+                }
+                em[em_type].ps.push((freq, power));
+            }
+        }
+    }
+    Ok(em)
+}
+
 impl msg_task_ctx {
     fn from_bytes(buf: &[u8]) -> &msg_task_ctx {
         plain::from_bytes(buf).expect("The buffer is either too short or not aligned!")
@@ -111,10 +314,12 @@ struct Scheduler<'a> {
     nr_cpus_onln: u64,
     rb_mgr: libbpf_rs::RingBuffer<'static>,
     intrspc: introspec,
+    capture: Option<Capture>,
+    cgroup_lats: Vec<CgroupLat>,
 }
 
 impl<'a> Scheduler<'a> {
-    fn init(opts: &'a Opts) -> Result<Self> {
+    fn init(opts: &'a Opts, capture: Option<Capture>) -> Result<Self> {
         // Increase MEMLOCK size since the BPF scheduler might use
         // more than the current limit
         let (soft_limit, _) = getrlimit(Resource::MEMLOCK).unwrap();
@@ -125,17 +330,131 @@ impl<'a> Scheduler<'a> {
         skel_builder.obj_builder.debug(opts.verbose > 0);
         let mut skel = scx_ops_open!(skel_builder, lavd_ops)?;
 
-        // Initialize CPU order topologically sorted by cpu, core, LLC, and NUMA.
+        // Classify CPUs into big and little cores by their capacity. Use
+        // the kernel-provided capacity if any, otherwise the maximum
+        // hardware frequency, which tells P-cores from E-cores on x86. The
+        // scaling maximum isn't used as capping it, e.g., by a thermal
+        // daemon, would turn a big core into a little one.
         let topo = Topology::new().expect("Failed to build host topology");
+        let use_cpu_capacity = topo.cpus().values().any(|cpu| cpu.cpu_capacity() > 0);
+        let capacity_of = |cpu: &Cpu| -> usize {
+            match use_cpu_capacity {
+                true => cpu.cpu_capacity(),
+                false => cpu.hw_max_freq(),
+            }
+        };
+        let max_capacity = topo.cpus().values().map(capacity_of).max().unwrap_or(0);
+        let is_big = |cpu: &Cpu| capacity_of(cpu) * 100 >= max_capacity * LITTLE_CORE_CAPACITY_PCT;
+        let mut nr_little = 0;
+        let mut cpu_is_big = vec![true; topo.nr_cpu_ids()];
+        for (cpu_id, cpu) in topo.cpus().iter() {
+            skel.rodata_mut().cpu_big[*cpu_id] = is_big(cpu) as u8;
+            cpu_is_big[*cpu_id] = is_big(cpu);
+            if !is_big(cpu) {
+                nr_little += 1;
+            }
+        }
+        skel.rodata_mut().have_little_core = nr_little > 0;
+        skel.rodata_mut().nr_cpus_big = (topo.cpus().len() - nr_little) as u32;
+        if nr_little > 0 {
+            info!(
+                "{} little cores out of {} CPUs",
+                nr_little,
+                topo.cpus().len()
+            );
+        }
+
+        // Load the energy model of each core type so that core compaction
+        // can weigh more CPUs at a lower frequency against fewer CPUs at a
+        // higher frequency. Without one, fall back to the utilization-based
+        // core compaction.
+        let em = match &opts.power_table {
+            Some(path) => read_power_table(path)?,
+            None => read_kernel_energy_model(&cpu_is_big).unwrap_or_default(),
+        };
+        let have_em = !em[consts_LAVD_EM_BIG as usize].ps.is_empty()
+            && (nr_little == 0 || !em[consts_LAVD_EM_LITTLE as usize].ps.is_empty());
+        if have_em {
+            for (em_type, em) in em.iter().enumerate() {
+                Scheduler::set_energy_model(&mut skel, em_type, em);
+            }
+            skel.rodata_mut().have_energy_model = true;
+            info!("Energy model loaded: {:?}", em);
+        } else if opts.power_table.is_some() {
+            bail!("The power table should have both big and little cores if any");
+        }
+
+        // Initialize CPU order, in which core compaction activates CPUs.
+        // Fill all the cores of an LLC before opening another LLC or NUMA
+        // node, and keep SMT siblings next to each other so that physical
+        // cores fill up as a whole. Prefer the nodes, LLCs, and cores with
+        // the highest maximum frequency, and put big cores ahead of little
+        // ones.
+        let core_max_freq = |core: &Core| -> usize {
+            core.cpus()
+                .values()
+                .map(|cpu| cpu.max_freq())
+                .max()
+                .unwrap_or(0)
+        };
+        let llc_max_freq = |llc: &Cache| -> usize {
+            llc.cores()
+                .values()
+                .map(|core| core_max_freq(core))
+                .max()
+                .unwrap_or(0)
+        };
+        let node_max_freq = |node: &Node| -> usize {
+            node.llcs()
+                .values()
+                .map(|llc| llc_max_freq(llc))
+                .max()
+                .unwrap_or(0)
+        };
+        let mut nodes: Vec<&Node> = topo.nodes().iter().collect();
+        nodes.sort_by_key(|node| Reverse(node_max_freq(node)));
+        let mut cpu_order = vec![];
+        let mut nr_cores = 0;
+        for node in nodes {
+            let mut llcs: Vec<&Cache> = node.llcs().values().collect();
+            llcs.sort_by_key(|llc| Reverse(llc_max_freq(llc)));
+            for llc in llcs {
+                let mut cores: Vec<&Core> = llc.cores().values().collect();
+                cores.sort_by_key(|core| Reverse(core_max_freq(core)));
+                for core in cores {
+                    for cpu in core.cpus().values() {
+                        cpu_order.push(cpu);
+                        skel.rodata_mut().cpu_core_id[cpu.id()] = nr_cores;
+                    }
+                    nr_cores += 1;
+                }
+            }
+        }
+        cpu_order.sort_by_key(|cpu| !is_big(*cpu));
+        for (i, cpu) in cpu_order.iter().enumerate() {
+            skel.rodata_mut().cpu_order[i] = cpu.id() as u16;
+        }
+        skel.rodata_mut().nr_cpu_order = cpu_order.len() as u32;
+
+        // Group CPUs into compute domains, each of which has its own run queue.
+        let mut nr_cpdoms = 0;
         for node in topo.nodes().iter() {
             for llc in node.llcs().values() {
                 for core in llc.cores().values() {
-                    for (cpu_id, cpu) in core.cpus().iter() {
-                        skel.rodata_mut().cpu_order[*cpu_id] = cpu.id() as u16;
+                    for cpu_id in core.cpus().keys() {
+                        skel.rodata_mut().cpu_cpdom_id[*cpu_id] = nr_cpdoms as u16;
+                    }
+                    if opts.per_core_dsq {
+                        nr_cpdoms += 1;
                     }
                 }
+                if !opts.per_core_dsq {
+                    nr_cpdoms += 1;
+                }
             }
         }
+        skel.rodata_mut().nr_cpdoms = nr_cpdoms;
+        skel.rodata_mut().nr_cpu_ids = topo.nr_cpu_ids() as u32;
 
         // Initialize skel according to @opts.
         let nr_cpus_onln = topo.span().weight() as u64;
@@ -146,15 +465,47 @@ impl<'a> Scheduler<'a> {
         skel.rodata_mut().verbose = opts.verbose;
         let intrspc = introspec::init(opts);
 
-        // Attach.
+        skel.rodata_mut().have_cgrp_lat = !opts.cgroup_lat.is_empty();
+
+        // Attach. Set up the cgroup latency overrides of the cgroups which
+        // already exist before attaching so that they apply to all existing
+        // tasks. The others are set by the run loop once they appear.
         let mut skel = scx_ops_load!(skel, lavd_ops, uei)?;
+        let mut cgroup_lats: Vec<CgroupLat> = opts
+            .cgroup_lat
+            .iter()
+            .map(|(path, cgl)| CgroupLat {
+                path: path.clone(),
+                cgl: *cgl,
+                cgrp_id: None,
+            })
+            .collect();
+        Scheduler::apply_cgroup_lats(&mut skel, &mut cgroup_lats);
+        for cl in cgroup_lats.iter().filter(|cl| cl.cgrp_id.is_none()) {
+            info!(
+                "cgroup {:?} doesn't exist yet, its latency override applies once it does",
+                cl.path
+            );
+        }
         let struct_ops = Some(scx_ops_attach!(skel, lavd_ops)?);
 
         // Build a ring buffer for instrumentation
         let mut maps = skel.maps_mut();
         let rb_map = maps.introspec_msg();
         let mut builder = libbpf_rs::RingBufferBuilder::new();
-        builder.add(rb_map, Scheduler::print_bpf_msg).unwrap();
+        match &capture {
+            Some(writer) => {
+                let writer = writer.clone();
+                builder
+                    .add(rb_map, move |data| {
+                        Scheduler::capture_bpf_msg(&writer, data)
+                    })
+                    .unwrap();
+            }
+            None => {
+                builder.add(rb_map, Scheduler::print_bpf_msg).unwrap();
+            }
+        }
         let rb_mgr = builder.build().unwrap();
 
         Ok(Self {
@@ -163,6 +514,8 @@ impl<'a> Scheduler<'a> {
             nr_cpus_onln,
             rb_mgr,
             intrspc,
+            capture,
+            cgroup_lats,
         })
     }
 
@@ -174,8 +527,191 @@ impl<'a> Scheduler<'a> {
         }
     }
 
+    /// Set the override @cgl on the cgroup at @cg_path and return the
+    /// cgroup's ID.
+    fn set_cgroup_lat(skel: &mut BpfSkel, cg_path: &str, cgl: &cgrp_lat) -> Result<u64> {
+        let cg_file =
+            File::open(cg_path).with_context(|| format!("Failed to open cgroup {:?}", cg_path))?;
+        // On cgroup v2, the inode number of a cgroup is its ID.
+        let cgrp_id = cg_file
+            .metadata()
+            .with_context(|| format!("Failed to stat cgroup {:?}", cg_path))?
+            .ino();
+        let cg_fd = cg_file.as_raw_fd();
+        skel.maps_mut()
+            .cgrp_lat_stor()
+            .update(
+                &cg_fd.to_ne_bytes(),
+                plain::as_bytes(cgl),
+                libbpf_rs::MapFlags::ANY,
+            )
+            .with_context(|| format!("Failed to set the latency override of {:?}", cg_path))?;
+        Ok(cgrp_id)
+    }
+
+    /// Set each --cgroup-lat override on its cgroup if the cgroup appeared
+    /// or was created again since the last call, and make the tasks resolve
+    /// their overrides again if any was set. The overrides are kept by path,
+    /// so a cgroup which is removed is picked up again once it is recreated.
+    fn apply_cgroup_lats(skel: &mut BpfSkel, cgroup_lats: &mut [CgroupLat]) {
+        let mut updated = false;
+
+        for cl in cgroup_lats.iter_mut() {
+            let cg_path = format!("/sys/fs/cgroup/{}", cl.path);
+            let cgrp_id = std::fs::metadata(&cg_path).ok().map(|meta| meta.ino());
+            if cgrp_id == cl.cgrp_id {
+                continue;
+            }
+
+            // Remember what was seen even on failure so that a persistent
+            // error is reported once, not on every interval.
+            cl.cgrp_id = cgrp_id;
+            if cgrp_id.is_none() {
+                info!("cgroup {:?} is gone, keeping its latency override", cl.path);
+                continue;
+            }
+
+            match Scheduler::set_cgroup_lat(skel, &cg_path, &cl.cgl) {
+                Ok(id) => {
+                    cl.cgrp_id = Some(id);
+                    updated = true;
+                    info!(
+                        "cgroup {:?}: latency boost {}, max latency priority {}",
+                        cl.path, cl.cgl.lat_boost, cl.cgl.lat_prio_max
+                    );
+                }
+                Err(e) => warn!("{:#}", e),
+            }
+        }
+
+        if updated {
+            skel.bss_mut().cgrp_lat_gen += 1;
+        }
+    }
+
+    fn set_energy_model(skel: &mut OpenBpfSkel, em_type: usize, em: &EnergyModel) {
+        // Keep the highest performance states if there are too many.
+        let mut ps = em.ps.clone();
+        ps.sort();
+        ps.dedup_by_key(|(freq, _)| *freq);
+        let ps = &ps[ps.len().saturating_sub(consts_LAVD_EM_MAX_PS as usize)..];
+        if ps.is_empty() {
+            return;
+        }
+
+        let emt = &mut skel.rodata_mut().em_tables[em_type];
+        for (i, (freq, power)) in ps.iter().enumerate() {
+            emt.freq[i] = *freq;
+            emt.power[i] = *power;
+        }
+        emt.nr_ps = ps.len() as u32;
+        emt.idle_power = em.idle_power.unwrap_or(ps[0].1 * EM_IDLE_POWER_PCT / 100);
+    }
+
+    fn open_capture(path: &str) -> Result<BufWriter<File>> {
+        let file =
+            File::create(path).with_context(|| format!("Failed to open capture {:?}", path))?;
+        let mut writer = BufWriter::with_capacity(CAPTURE_BUF_SIZE, file);
+        writer.write_all(CAPTURE_MAGIC)?;
+        writer.write_all(&CAPTURE_VERSION.to_ne_bytes())?;
+        writer.write_all(&(mem::size_of::<msg_task_ctx>() as u32).to_ne_bytes())?;
+        info!("Capturing scheduling samples to {}", path);
+        Ok(writer)
+    }
+
+    fn capture_bpf_msg(writer: &Capture, data: &[u8]) -> i32 {
+        // Copy the record from the ring buffer as is. Formatting is left to
+        // --decode.
+        let mut writer = writer.borrow_mut();
+        if let Some(w) = writer.as_mut() {
+            let res = w
+                .write_all(&(data.len() as u32).to_ne_bytes())
+                .and_then(|_| w.write_all(data));
+            if let Err(e) = res {
+                warn!("Stop capturing scheduling samples ({})", &e);
+                *writer = None;
+            }
+        }
+        0
+    }
+
+    fn flush_capture(&mut self) {
+        if let Some(capture) = &self.capture {
+            let mut writer = capture.borrow_mut();
+            if let Some(w) = writer.as_mut() {
+                if let Err(e) = w.flush() {
+                    warn!("Stop capturing scheduling samples ({})", &e);
+                    *writer = None;
+                }
+            }
+        }
+    }
+
+    fn decode_capture(path: &str) -> Result<()> {
+        let file =
+            File::open(path).with_context(|| format!("Failed to open capture {:?}", path))?;
+        let mut reader = BufReader::with_capacity(CAPTURE_BUF_SIZE, file);
+
+        let mut magic = [0u8; 8];
+        let mut word = [0u8; 4];
+        reader.read_exact(&mut magic)?;
+        reader.read_exact(&mut word)?;
+        if &magic != CAPTURE_MAGIC || u32::from_ne_bytes(word) != CAPTURE_VERSION {
+            bail!("{:?} is not a scx_lavd capture", path);
+        }
+
+        // A build with a different msg_task_ctx layout would decode into
+        // the wrong fields.
+        let rec_size = mem::size_of::<msg_task_ctx>();
+        reader.read_exact(&mut word)?;
+        if u32::from_ne_bytes(word) as usize != rec_size {
+            bail!(
+                "{:?} has {} byte records but this build expects {}",
+                path,
+                u32::from_ne_bytes(word),
+                rec_size
+            );
+        }
+
+        let mut data = vec![];
+        loop {
+            match reader.read_exact(&mut word) {
+                Ok(()) => {}
+                Err(e) if e.kind() == ErrorKind::UnexpectedEof => break,
+                Err(e) => return Err(e.into()),
+            }
+            data.resize(u32::from_ne_bytes(word) as usize, 0);
+            if let Err(e) = reader.read_exact(&mut data) {
+                // The capture may have been cut off in the middle of a record.
+                if e.kind() == ErrorKind::UnexpectedEof {
+                    break;
+                }
+                return Err(e.into());
+            }
+
+            if data.len() != rec_size {
+                bail!(
+                    "Record of {} bytes in {:?}, expected {}",
+                    data.len(),
+                    path,
+                    rec_size
+                );
+            }
+
+            // Records in the file aren't aligned, so copy each out.
+            let mut mt = unsafe { mem::MaybeUninit::<msg_task_ctx>::zeroed().assume_init() };
+            plain::copy_from_bytes(&mut mt, &data).expect("record size was checked");
+            Scheduler::print_msg_task_ctx(&mt);
+        }
+
+        Ok(())
+    }
+
     fn print_bpf_msg(data: &[u8]) -> i32 {
-        let mt = msg_task_ctx::from_bytes(data);
+        Scheduler::print_msg_task_ctx(msg_task_ctx::from_bytes(data))
+    }
+
+    fn print_msg_task_ctx(mt: &msg_task_ctx) -> i32 {
         let tx = mt.taskc_x;
         let tc = mt.taskc;
 
@@ -196,7 +732,9 @@ impl<'a> Scheduler<'a> {
                    | {:7} | {:9} | {:9} \
                    | {:9} | {:9} | {:8} \
                    | {:8} | {:8} | {:8} \
-                   | {:6} | {:6} |",
+                   | {:6} | {:6} | {:6} \
+                   | {:6} | {:6} | {:6} \
+                   | {:8} |",
                 "mseq",
                 "pid",
                 "comm",
@@ -220,6 +758,11 @@ impl<'a> Scheduler<'a> {
                 "cpu_util",
                 "sys_ld",
                 "nr_act",
+                "vexam",
+                "big_ut",
+                "ltl_ut",
+                "pc_ltl",
+                "energy_uj",
             );
         }
 
@@ -235,7 +778,9 @@ impl<'a> Scheduler<'a> {
                | {:7} | {:9} | {:9} \
                | {:9} | {:9} | {:8} \
                | {:8} | {:8} | {:8} \
-               | {:6} | {:6} |",
+               | {:6} | {:6} | {:6} \
+               | {:6} | {:6} | {:6} \
+               | {:8} |",
             mseq,
             tx.pid,
             tx_comm,
@@ -259,6 +804,11 @@ impl<'a> Scheduler<'a> {
             tx.cpu_util,
             tx.sys_load_factor,
             tx.nr_active,
+            tx.avg_victim_exam,
+            tx.util_big,
+            tx.util_little,
+            tx.pc_on_little,
+            tx.energy,
         );
 
         0
@@ -302,9 +852,12 @@ impl<'a> Scheduler<'a> {
             let interval_ms = self.prep_introspec();
             std::thread::sleep(Duration::from_millis(interval_ms));
             self.rb_mgr.poll(Duration::from_millis(100)).unwrap();
+            self.flush_capture();
             self.cleanup_introspec();
+            Scheduler::apply_cgroup_lats(&mut self.skel, &mut self.cgroup_lats);
         }
         self.rb_mgr.consume().unwrap();
+        self.flush_capture();
 
         self.struct_ops.take();
         uei_report!(&self.skel, uei)
@@ -359,10 +912,21 @@ fn main() -> Result<()> {
     let opts = Opts::parse();
 
     init_log(&opts);
+
+    if let Some(path) = &opts.decode {
+        return Scheduler::decode_capture(path);
+    }
+
     init_signal_handlers();
 
+    // Open the capture once so that restarts keep appending to it.
+    let capture = match &opts.capture {
+        Some(path) => Some(Rc::new(RefCell::new(Some(Scheduler::open_capture(path)?)))),
+        None => None,
+    };
+
     loop {
-	let mut sched = Scheduler::init(&opts)?;
+	let mut sched = Scheduler::init(&opts, capture.clone())?;
 	info!("scx_lavd scheduler is initialized (build ID: {})", *build_id::SCX_FULL_VERSION);
 	info!("    Note that scx_lavd currently is not optimized for multi-CCX/NUMA architectures.");
 	info!("    Stay tuned for future improvements!");
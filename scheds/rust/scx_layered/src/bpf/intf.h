@@ -26,15 +26,27 @@ enum consts {
 	MAX_CPUS_SHIFT		= 9,
 	MAX_CPUS		= 1 << MAX_CPUS_SHIFT,
 	MAX_CPUS_U8		= MAX_CPUS / 8,
+	CACHELINE_SIZE		= 64,
 	MAX_TASKS		= 131072,
 	MAX_PATH		= 4096,
 	MAX_COMM		= 16,
 	MAX_LAYER_MATCH_ORS	= 32,
-	MAX_LAYERS		= 16,
+	MAX_LAYERS		= 64,
+	MAX_LLCS		= 64,
+	MAX_PREEMPT_TRIES	= 4,
 	USAGE_HALF_LIFE		= 100000000,	/* 100ms */
 
+	/* compiled layer match table, see struct match_table */
+	MAX_MATCH_RULES		= 512,
+	MATCH_MASK_WORDS	= MAX_MATCH_RULES / 64,
+	MAX_MATCH_NODES		= 8192,
+	MAX_MATCH_ACCEPTS	= 1024,
+	MAX_MATCH_KEYS		= 4096,
+	NR_NICES		= 40,
+
 	HI_FALLBACK_DSQ		= MAX_LAYERS,
 	LO_FALLBACK_DSQ		= MAX_LAYERS + 1,
+	LAYER_LLC_DSQ_BASE	= MAX_LAYERS + 2,
 
 	/* XXX remove */
 	MAX_CGRP_PREFIXES = 32
@@ -44,6 +56,7 @@ enum consts {
 enum global_stat_idx {
 	GSTAT_EXCL_IDLE,
 	GSTAT_EXCL_WAKEUP,
+	GSTAT_EXCL_IDLE_NS,
 	NR_GSTATS,
 };
 
@@ -64,19 +77,22 @@ enum layer_stat_idx {
 	LSTAT_PREEMPT_FIRST,
 	LSTAT_PREEMPT_IDLE,
 	LSTAT_PREEMPT_FAIL,
+	LSTAT_PREEMPT_SCAN,
+	LSTAT_PREEMPT_CAND,
 	LSTAT_EXCL_COLLISION,
 	LSTAT_EXCL_PREEMPT,
 	LSTAT_KICK,
 	LSTAT_YIELD,
 	LSTAT_YIELD_IGNORE,
 	LSTAT_MIGRATION,
+	LSTAT_XLLC_MIGRATION,
+	LSTAT_LLC_MISS,
 	NR_LSTATS,
 };
 
 struct cpu_ctx {
 	bool			current_preempt;
 	bool			current_exclusive;
-	bool			prev_exclusive;
 	bool			maybe_idle;
 	bool			yielding;
 	bool			try_preempt_first;
@@ -84,6 +100,8 @@ struct cpu_ctx {
 	u64			gstats[NR_GSTATS];
 	u64			lstats[MAX_LAYERS][NR_LSTATS];
 	u64			ran_current_for;
+	u64			llc_misses_at;
+	u64			excl_idle_at;	/* kept idle for exclusive sibling since */
 };
 
 enum layer_match_kind {
@@ -93,26 +111,106 @@ enum layer_match_kind {
 	MATCH_NICE_ABOVE,
 	MATCH_NICE_BELOW,
 	MATCH_NICE_EQUALS,
+	MATCH_UID_EQUALS,
+	MATCH_GID_EQUALS,
+	MATCH_CGROUP_ID_EQUALS,
+	MATCH_EXEC_PATH,
+	MATCH_IS_KTHREAD,
+	MATCH_IS_GROUP_LEADER,
 
 	NR_LAYER_MATCH_KINDS,
 };
 
-struct layer_match {
-	int		kind;
-	char		cgroup_prefix[MAX_PATH];
-	char		comm_prefix[MAX_COMM];
-	char		pcomm_prefix[MAX_COMM];
-	int		nice;
+enum match_trie_kind {
+	MATCH_TRIE_CGROUP,
+	MATCH_TRIE_COMM,
+	MATCH_TRIE_PCOMM,
+
+	NR_MATCH_TRIES,
+};
+
+/* exact value matches, looked up in the match_keys hash map */
+enum match_key_kind {
+	MATCH_KEY_UID,
+	MATCH_KEY_GID,
+	MATCH_KEY_CGROUP_ID,
+	MATCH_KEY_EXEC_HASH,
+
+	NR_MATCH_KEYS,
+};
+
+/* boolean task properties, combined into an index into prop_masks */
+enum match_prop {
+	MATCH_PROP_KTHREAD	= 1 << 0,
+	MATCH_PROP_GROUP_LEADER	= 1 << 1,
+
+	NR_MATCH_PROP_COMBOS	= 1 << 2,
+};
+
+struct match_key {
+	u32		table;		/* match_tables[] index */
+	u32		kind;		/* enum match_key_kind */
+	u64		val;
+};
+
+struct match_mask {
+	u64		bits[MATCH_MASK_WORDS];
+};
+
+/*
+ * A trie node. Children of a node are chained through @sibling starting from
+ * @child. Both are MAX_MATCH_NODES if there's none. If not negative, @accept
+ * indexes match_table->accept_masks and the mask includes all rules whose
+ * prefix is this node or one of its ancestors.
+ */
+struct match_trie_node {
+	u32		child;
+	u32		sibling;
+	s32		accept;
+	char		c;
+};
+
+/*
+ * Layer matches compiled by userspace. Each OR block of each layer is a rule
+ * and rules are numbered in layer order so that the lowest numbered rule
+ * which a task satisfies determines its layer. A task satisfies a rule if the
+ * rule's bit is set in the nice mask for the task's nice level and in the
+ * property mask for the task's properties and:
+ *
+ * - for each trie, either in @trie_none or in the accept mask of the deepest
+ *   accepting node on the path spelled by the task's cgroup path, comm or
+ *   pcomm.
+ *
+ * - for each key kind, either in @key_none or in the match_keys entry for the
+ *   task's uid, gid, cgroup ID or exec path hash. @nr_keys is the number of
+ *   entries of each kind so that the lookups can be skipped if there's none.
+ */
+struct match_table {
+	u32			nr_rules;
+	u32			trie_root[NR_MATCH_TRIES];
+	u32			nr_keys[NR_MATCH_KEYS];
+	u32			rule_layer[MAX_MATCH_RULES];
+	u64			trie_none[NR_MATCH_TRIES][MATCH_MASK_WORDS];
+	u64			key_none[NR_MATCH_KEYS][MATCH_MASK_WORDS];
+	u64			nice_masks[NR_NICES][MATCH_MASK_WORDS];
+	u64			prop_masks[NR_MATCH_PROP_COMBOS][MATCH_MASK_WORDS];
+	u64			accept_masks[MAX_MATCH_ACCEPTS][MATCH_MASK_WORDS];
+	struct match_trie_node	nodes[MAX_MATCH_NODES];
 };
 
-struct layer_match_ands {
-	struct layer_match	matches[NR_LAYER_MATCH_KINDS];
-	int			nr_match_ands;
+/*
+ * Layers which a CPU consumes from after the preempting layers, in layer
+ * order. These are the layers whose cpumasks include the CPU plus, on the
+ * fallback CPU, the confined and grouped layers without any CPU. Maintained
+ * by userspace whenever layer cpumasks change so that dispatch only visits
+ * the layers which are eligible on the CPU.
+ */
+struct cpu_dispatch {
+	u32			nr_layers;
+	unsigned char		layers[MAX_LAYERS];
 };
 
 struct layer {
-	struct layer_match_ands	matches[MAX_LAYER_MATCH_ORS];
-	unsigned int		nr_match_ors;
 	unsigned int		idx;
 	u64			min_exec_ns;
 	u64			max_exec_ns;
@@ -121,6 +219,7 @@ struct layer {
 	bool			preempt;
 	bool			preempt_first;
 	bool			exclusive;
+	bool			llc_dsqs;	/* per-LLC DSQs instead of one */
 
 	u64			vtime_now;
 	u64			nr_tasks;
@@ -1,6 +1,7 @@
 /* Copyright (c) Meta Platforms, Inc. and affiliates. */
 #include <scx/common.bpf.h>
 #include <scx/ravg_impl.bpf.h>
+#include <scx/cpu_util_impl.bpf.h>
 #include "intf.h"
 
 #include <errno.h>
@@ -20,11 +21,43 @@ const volatile u32 nr_layers = 1;
 const volatile bool smt_enabled = true;
 const volatile s32 __sibling_cpu[MAX_CPUS];
 const volatile unsigned char all_cpus[MAX_CPUS_U8];
+const volatile u32 nr_llcs = 1;
+const volatile u32 cpu_llc_id[MAX_CPUS];
+const volatile bool llc_miss_enabled;
 
 private(all_cpumask) struct bpf_cpumask __kptr *all_cpumask;
+/* CPUs which aren't running a task from a preempting layer */
+private(preemptible_cpumask) struct bpf_cpumask __kptr *preemptible_cpumask;
 struct layer layers[MAX_LAYERS];
-u32 fallback_cpu;
-static u32 preempt_cursor;
+struct cpu_dispatch cpu_dispatch[MAX_CPUS];
+
+/*
+ * Layer configuration which userspace may rewrite when the layer specs are
+ * reloaded. A reload compiles the new matches and the layer lists dispatch
+ * walks into the copies which aren't in use, flips @match_table_idx and then
+ * bumps @layer_refresh_seq so that every task is matched again the next time
+ * it becomes runnable.
+ */
+u32 nr_preempt_layers[2];
+u32 preempt_layers[2][MAX_LAYERS];
+u32 nr_open_layers[2];
+u32 open_layers[2][MAX_LAYERS];	/* open && !preempt */
+struct match_table match_tables[2];
+u32 match_table_idx;
+u64 layer_refresh_seq;
+
+/*
+ * Busy time of each CPU, read by userspace through the skeleton mmap. Each
+ * CPU updates its own entry on every context switch, so keep them on separate
+ * cachelines. The explicit padding keeps what libbpf-cargo has to generate
+ * within what rustc can derive Default for.
+ */
+struct cpu_util_ctx {
+	struct cpu_util_data	util;
+	u64			pad[4];
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct cpu_util_ctx cpu_utils[MAX_CPUS];
 
 #define dbg(fmt, args...)	do { if (debug) bpf_printk(fmt, ##args); } while (0)
 #define trace(fmt, args...)	do { if (debug > 1) bpf_printk(fmt, ##args); } while (0)
@@ -55,6 +88,22 @@ static inline s32 sibling_cpu(s32 cpu)
 		return -1;
 }
 
+static inline u32 cpu_to_llc(s32 cpu)
+{
+	const volatile u32 *llc;
+
+	llc = MEMBER_VPTR(cpu_llc_id, [cpu]);
+	if (llc)
+		return *llc;
+	else
+		return 0;
+}
+
+static inline u64 layer_llc_dsq_id(u32 layer_idx, u32 llc)
+{
+	return LAYER_LLC_DSQ_BASE + layer_idx * MAX_LLCS + llc;
+}
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__type(key, u32);
@@ -90,6 +139,16 @@ static void gstat_inc(enum global_stat_idx idx, struct cpu_ctx *cctx)
 	cctx->gstats[idx]++;
 }
 
+static void gstat_add(enum global_stat_idx idx, struct cpu_ctx *cctx, u64 delta)
+{
+	if (idx < 0 || idx >= NR_GSTATS) {
+		scx_bpf_error("invalid global stat idx %d", idx);
+		return;
+	}
+
+	cctx->gstats[idx] += delta;
+}
+
 static void lstat_add(enum layer_stat_idx idx, struct layer *layer,
 		      struct cpu_ctx *cctx, s64 delta)
 {
@@ -154,6 +213,17 @@ struct {
 	__uint(map_flags, 0);
 } layer_cpumasks SEC(".maps");
 
+static struct cpu_util_data *lookup_cpu_util(s32 cpu)
+{
+	struct cpu_util_ctx *cuc;
+
+	if (!(cuc = MEMBER_VPTR(cpu_utils, [cpu]))) {
+		scx_bpf_error("invalid cpu %d", cpu);
+		return NULL;
+	}
+	return &cuc->util;
+}
+
 static struct cpumask *lookup_layer_cpumask(int idx)
 {
 	struct layer_cpumask_wrapper *cpumaskw;
@@ -231,12 +301,14 @@ struct task_ctx {
 	int			last_cpu;
 	int			layer;
 	bool			refresh_layer;
+	u64			layer_refresh_seq;
 	u64			layer_cpus_seq;
 	struct bpf_cpumask __kptr *layered_cpumask;
 
 	bool			all_cpus_allowed;
 	u64			runnable_at;
 	u64			running_at;
+	u64			exec_hash;	/* hash_exec_path() of the last exec */
 };
 
 struct {
@@ -270,6 +342,59 @@ static struct layer *lookup_layer(int idx)
 	return &layers[idx];
 }
 
+/*
+ * Confined and grouped layers can span many CPUs. Instead of having all of
+ * them contend on a single DSQ, such layers have a DSQ per LLC and tasks are
+ * queued on the one of the LLC they last ran in. All shards share the layer's
+ * vtime_now, so vtime ordering stays consistent across them.
+ */
+static u64 layer_dsq_id(struct layer *layer, s32 cpu)
+{
+	if (layer->llc_dsqs)
+		return layer_llc_dsq_id(layer->idx, cpu_to_llc(cpu));
+	else
+		return layer->idx;
+}
+
+/*
+ * Consume from @layer_idx on @cpu. Per-LLC layers are consumed from @cpu's
+ * LLC first and then from the other LLCs so that tasks queued on an LLC which
+ * no longer has CPUs in the layer don't get stranded.
+ */
+static bool consume_layer(u32 layer_idx, s32 cpu)
+{
+	struct layer *layer;
+	u32 llc, i;
+
+	if (!(layer = MEMBER_VPTR(layers, [layer_idx])))
+		return false;
+
+	if (!layer->llc_dsqs)
+		return scx_bpf_consume(layer_idx);
+
+	llc = cpu_to_llc(cpu);
+	bpf_for(i, 0, nr_llcs) {
+		if (scx_bpf_consume(layer_llc_dsq_id(layer_idx, (llc + i) % nr_llcs)))
+			return true;
+	}
+
+	return false;
+}
+
+static s32 layer_nr_queued(struct layer *layer)
+{
+	s32 nr_queued = 0;
+	u32 llc;
+
+	if (!layer->llc_dsqs)
+		return scx_bpf_dsq_nr_queued(layer->idx);
+
+	bpf_for(llc, 0, nr_llcs)
+		nr_queued += scx_bpf_dsq_nr_queued(layer_llc_dsq_id(layer->idx, llc));
+
+	return nr_queued;
+}
+
 /*
  * Because the layer membership is by the default hierarchy cgroups rather than
  * the CPU controller membership, we can't use ops.cgroup_move(). Let's iterate
@@ -329,6 +454,62 @@ int BPF_PROG(tp_cgroup_attach_task, struct cgroup *cgrp, const char *cgrp_path,
 	return 0;
 }
 
+/*
+ * LLC miss counters opened by userspace, one per CPU. The count accumulated
+ * between two context switches is charged to the layer of the task which
+ * switched out. sched_ext ops can't read perf events, so this is done from the
+ * sched_switch tracepoint which brackets the same running/stopping window.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(u32));
+	__uint(max_entries, MAX_CPUS);
+} llc_miss_events SEC(".maps");
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(tp_sched_switch, bool preempt, struct task_struct *prev,
+	     struct task_struct *next)
+{
+	struct bpf_perf_event_value val;
+	struct cpu_util_data *cud;
+	struct cpu_ctx *cctx;
+	struct task_ctx *tctx;
+	struct layer *layer;
+	u64 prev_misses;
+
+	/*
+	 * Busy time is accounted here rather than in ops.running() and
+	 * ops.stopping() so that tasks of other sched classes and the switches
+	 * in between count as busy too.
+	 */
+	if ((cud = lookup_cpu_util(bpf_get_smp_processor_id())))
+		cpu_util_switch(cud, prev, next, bpf_ktime_get_ns());
+
+	if (!llc_miss_enabled)
+		return 0;
+
+	if (bpf_perf_event_read_value(&llc_miss_events, BPF_F_CURRENT_CPU,
+				      &val, sizeof(val)))
+		return 0;
+
+	if (!(cctx = lookup_cpu_ctx(-1)))
+		return 0;
+
+	prev_misses = cctx->llc_misses_at;
+	cctx->llc_misses_at = val.counter;
+	if (!prev_misses)
+		return 0;
+
+	if (!(tctx = lookup_task_ctx_may_fail(prev)) ||
+	    !(layer = MEMBER_VPTR(layers, [tctx->layer])) ||
+	    tctx->layer >= nr_layers)
+		return 0;
+
+	lstat_add(LSTAT_LLC_MISS, layer, cctx, val.counter - prev_misses);
+	return 0;
+}
+
 SEC("tp_btf/task_rename")
 int BPF_PROG(tp_task_rename, struct task_struct *p, const char *buf)
 {
@@ -339,6 +520,39 @@ int BPF_PROG(tp_task_rename, struct task_struct *p, const char *buf)
 	return 0;
 }
 
+/*
+ * UidEquals and GidEquals match the effective IDs, which a task can change
+ * without exec, e.g. a daemon dropping privileges with setuid(). All such
+ * changes go through commit_creds() on the task itself.
+ */
+SEC("fentry/commit_creds")
+int BPF_PROG(fentry_commit_creds, struct cred *new)
+{
+	struct task_struct *p = bpf_get_current_task_btf();
+	struct task_ctx *tctx;
+
+	if (BPF_CORE_READ(p, cred, euid.val) == BPF_CORE_READ(new, euid.val) &&
+	    BPF_CORE_READ(p, cred, egid.val) == BPF_CORE_READ(new, egid.val))
+		return 0;
+
+	if ((tctx = lookup_task_ctx_may_fail(p)))
+		tctx->refresh_layer = true;
+	return 0;
+}
+
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(tp_sched_process_exec, struct task_struct *p, pid_t old_pid,
+	     struct linux_binprm *bprm)
+{
+	struct task_ctx *tctx;
+
+	if ((tctx = lookup_task_ctx_may_fail(p))) {
+		tctx->exec_hash = hash_exec_path(BPF_CORE_READ(bprm, filename));
+		tctx->refresh_layer = true;
+	}
+	return 0;
+}
+
 static void maybe_refresh_layered_cpumask(struct cpumask *layered_cpumask,
 					  struct task_struct *p, struct task_ctx *tctx,
 					  const struct cpumask *layer_cpumask)
@@ -358,28 +572,32 @@ static void maybe_refresh_layered_cpumask(struct cpumask *layered_cpumask,
 	trace("%s[%d] cpumask refreshed to seq %llu", p->comm, p->pid, layer_seq);
 }
 
+static s32 pick_idle_core_from(const struct cpumask *cand_cpumask, s32 prev_cpu,
+			       const struct cpumask *idle_smtmask)
+{
+	if (bpf_cpumask_test_cpu(prev_cpu, cand_cpumask) &&
+	    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
+	    scx_bpf_test_and_clear_cpu_idle(prev_cpu))
+		return prev_cpu;
+
+	return scx_bpf_pick_idle_cpu(cand_cpumask, SCX_PICK_IDLE_CORE);
+}
+
 static s32 pick_idle_cpu_from(const struct cpumask *cand_cpumask, s32 prev_cpu,
 			      const struct cpumask *idle_smtmask)
 {
-	bool prev_in_cand = bpf_cpumask_test_cpu(prev_cpu, cand_cpumask);
 	s32 cpu;
 
 	/*
 	 * If CPU has SMT, any wholly idle CPU is likely a better pick than
 	 * partially idle @prev_cpu.
 	 */
-	if (smt_enabled) {
-		if (prev_in_cand &&
-		    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
-		    scx_bpf_test_and_clear_cpu_idle(prev_cpu))
-			return prev_cpu;
-
-		cpu = scx_bpf_pick_idle_cpu(cand_cpumask, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0)
-			return cpu;
-	}
+	if (smt_enabled &&
+	    (cpu = pick_idle_core_from(cand_cpumask, prev_cpu, idle_smtmask)) >= 0)
+		return cpu;
 
-	if (prev_in_cand && scx_bpf_test_and_clear_cpu_idle(prev_cpu))
+	if (bpf_cpumask_test_cpu(prev_cpu, cand_cpumask) &&
+	    scx_bpf_test_and_clear_cpu_idle(prev_cpu))
 		return prev_cpu;
 
 	return scx_bpf_pick_idle_cpu(cand_cpumask, 0);
@@ -444,6 +662,24 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 
 	idle_smtmask = scx_bpf_get_idle_smtmask();
 
+	/*
+	 * An exclusive task keeps its sibling CPU idle, so a wholly idle core
+	 * anywhere it may run beats a partially idle CPU in the layer, which
+	 * would leave the sibling's current task in the way.
+	 */
+	if (smt_enabled && layer->exclusive) {
+		if ((cpu = pick_idle_core_from(layered_cpumask, prev_cpu,
+					       idle_smtmask)) >= 0)
+			goto out_put;
+
+		if (layer->open &&
+		    (cpu = pick_idle_core_from(p->cpus_ptr, prev_cpu,
+					       idle_smtmask)) >= 0) {
+			lstat_inc(LSTAT_OPEN_IDLE, layer, cctx);
+			goto out_put;
+		}
+	}
+
 	/*
 	 * If CPU has SMT, any wholly idle CPU is likely a better pick than
 	 * partially idle @prev_cpu.
@@ -563,6 +799,35 @@ bool try_preempt(s32 cand, struct task_struct *p, struct cpu_ctx *cctx,
 	return true;
 }
 
+/*
+ * Pick a CPU which isn't running a preempting task, from @layer's CPUs if
+ * @in_layer, otherwise from the CPUs @p is allowed on.
+ */
+static s32 pick_preemptible_cpu(struct task_struct *p, struct layer *layer,
+				bool in_layer)
+{
+	const struct cpumask *preemptible, *mask;
+	u32 cpu;
+
+	if (!(preemptible = (const struct cpumask *)preemptible_cpumask)) {
+		scx_bpf_error("NULL preemptible_cpumask");
+		return -1;
+	}
+
+	if (in_layer) {
+		if (!(mask = lookup_layer_cpumask(layer->idx)))
+			return -1;
+	} else {
+		mask = p->cpus_ptr;
+	}
+
+	cpu = bpf_cpumask_any_and_distribute(preemptible, mask);
+	if (cpu < nr_possible_cpus)
+		return cpu;
+	else
+		return -1;
+}
+
 void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 {
 	struct cpu_ctx *cctx;
@@ -639,7 +904,8 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 		goto find_cpu;
 	}
 
-	scx_bpf_dispatch_vtime(p, tctx->layer, slice_ns, vtime, enq_flags);
+	scx_bpf_dispatch_vtime(p, layer_dsq_id(layer, task_cpu), slice_ns, vtime,
+			       enq_flags);
 
 find_cpu:
 	if (try_preempt_first) {
@@ -667,17 +933,22 @@ find_cpu:
 			return;
 	}
 
-	bpf_for(idx, 0, nr_possible_cpus) {
-		s32 cand = (preempt_cursor + idx) % nr_possible_cpus;
+	/*
+	 * Look for a CPU to preempt among the ones which aren't running
+	 * preempting tasks, starting with the layer's own CPUs. The mask is
+	 * maintained racily and try_preempt() may still refuse a candidate, so
+	 * retry a few times.
+	 */
+	lstat_inc(LSTAT_PREEMPT_SCAN, layer, cctx);
+	bpf_for(idx, 0, MAX_PREEMPT_TRIES) {
+		s32 cand;
 
-		if (try_preempt(cand, p, cctx, tctx, layer, false)) {
-			/*
-			 * Round-robining doesn't have to be strict. Let's
-			 * not bother with atomic ops on $preempt_cursor.
-			 */
-			preempt_cursor = (cand + 1) % nr_possible_cpus;
+		if ((cand = pick_preemptible_cpu(p, layer, idx == 0)) < 0)
+			continue;
+
+		lstat_inc(LSTAT_PREEMPT_CAND, layer, cctx);
+		if (try_preempt(cand, p, cctx, tctx, layer, false))
 			return;
-		}
 	}
 
 	lstat_inc(LSTAT_PREEMPT_FAIL, layer, cctx);
@@ -722,7 +993,7 @@ static bool keep_running(struct cpu_ctx *cctx, struct task_struct *p)
 		 * have tasks waiting, keep running it. If there are multiple
 		 * competing preempting layers, this won't work well.
 		 */
-		if (!scx_bpf_dsq_nr_queued(layer->idx)) {
+		if (!layer_nr_queued(layer)) {
 			lstat_inc(LSTAT_KEEP, layer, cctx);
 			return true;
 		}
@@ -758,11 +1029,29 @@ no:
 	return false;
 }
 
+/*
+ * Charge the time the local CPU was held idle for its exclusive sibling and
+ * clear the mark so that the sibling stops kicking it. Called both when the
+ * CPU dispatches again and when a task starts running on it, as a task
+ * directly dispatched from select_cpu() runs without going through
+ * ops.dispatch().
+ */
+static void charge_excl_idle(struct cpu_ctx *cctx)
+{
+	if (cctx->excl_idle_at) {
+		gstat_add(GSTAT_EXCL_IDLE_NS, cctx,
+			  bpf_ktime_get_ns() - cctx->excl_idle_at);
+		cctx->excl_idle_at = 0;
+	}
+}
+
 void BPF_STRUCT_OPS(layered_dispatch, s32 cpu, struct task_struct *prev)
 {
 	s32 sib = sibling_cpu(cpu);
 	struct cpu_ctx *cctx, *sib_cctx;
-	int idx;
+	struct cpu_dispatch *cd;
+	u32 lists = match_table_idx & 1;
+	u32 i;
 
 	if (!(cctx = lookup_cpu_ctx(-1)))
 		return;
@@ -783,150 +1072,273 @@ void BPF_STRUCT_OPS(layered_dispatch, s32 cpu, struct task_struct *prev)
 		return;
 
 	/*
-	 * If the sibling CPU is running an exclusive task, keep this CPU idle.
-	 * This test is a racy test but should be good enough for best-effort
-	 * optimization.
+	 * If the sibling CPU is running an exclusive task, keep this CPU idle
+	 * and mark it so that the sibling kicks this CPU when the exclusive
+	 * task stops. The mark is set before testing again so that either the
+	 * sibling sees the mark or we see the exclusive task gone. This isn't
+	 * strictly ordered but should be good enough for best-effort
+	 * optimization. The tick catches what slips through.
 	 */
 	if (sib >= 0 && (sib_cctx = lookup_cpu_ctx(sib)) &&
 	    sib_cctx->current_exclusive) {
-		gstat_inc(GSTAT_EXCL_IDLE, cctx);
-		return;
+		if (!cctx->excl_idle_at)
+			cctx->excl_idle_at = bpf_ktime_get_ns();
+		if (sib_cctx->current_exclusive) {
+			gstat_inc(GSTAT_EXCL_IDLE, cctx);
+			return;
+		}
 	}
 
+	charge_excl_idle(cctx);
+
 	/* consume preempting layers first */
-	bpf_for(idx, 0, nr_layers)
-		if (layers[idx].preempt && scx_bpf_consume(idx))
+	bpf_for(i, 0, nr_preempt_layers[lists]) {
+		u32 *idxp = MEMBER_VPTR(preempt_layers, [lists][i]);
+
+		if (idxp && consume_layer(*idxp, cpu))
 			return;
+	}
 
 	if (scx_bpf_consume(HI_FALLBACK_DSQ))
 		return;
 
-	/* consume !open layers second */
-	bpf_for(idx, 0, nr_layers) {
-		struct layer *layer = &layers[idx];
-		struct cpumask *layer_cpumask;
+	/* consume layers which own this CPU second */
+	if (!(cd = MEMBER_VPTR(cpu_dispatch, [cpu]))) {
+		scx_bpf_error("invalid cpu %d", cpu);
+		return;
+	}
 
-		/* consume matching layers */
-		if (!(layer_cpumask = lookup_layer_cpumask(idx)))
-			return;
+	bpf_for(i, 0, cd->nr_layers) {
+		unsigned char *idxp = MEMBER_VPTR(*cd, .layers[i]);
 
-		if (bpf_cpumask_test_cpu(cpu, layer_cpumask) ||
-		    (cpu == fallback_cpu && layer->nr_cpus == 0)) {
-			if (scx_bpf_consume(idx))
-				return;
-		}
+		if (!idxp)
+			break;
+		if (*idxp < nr_layers && consume_layer(*idxp, cpu))
+			return;
 	}
 
 	/* consume !preempting open layers */
-	bpf_for(idx, 0, nr_layers) {
-		if (!layers[idx].preempt && layers[idx].open &&
-		    scx_bpf_consume(idx))
+	bpf_for(i, 0, nr_open_layers[lists]) {
+		u32 *idxp = MEMBER_VPTR(open_layers, [lists][i]);
+
+		if (idxp && consume_layer(*idxp, cpu))
 			return;
 	}
 
 	scx_bpf_consume(LO_FALLBACK_DSQ);
 }
 
-static bool match_one(struct layer_match *match, struct task_struct *p, const char *cgrp_path)
+/*
+ * Walk @trie along @str and return the accept index of the deepest accepting
+ * node, or -1 if no prefix in the trie matches.
+ */
+static s32 match_trie_walk(struct match_table *mt, u32 trie, const char *str,
+			   u32 max_len)
 {
-	switch (match->kind) {
-	case MATCH_CGROUP_PREFIX: {
-		return match_prefix(match->cgroup_prefix, cgrp_path, MAX_PATH);
-	}
-	case MATCH_COMM_PREFIX: {
-		char comm[MAX_COMM];
-		memcpy(comm, p->comm, MAX_COMM);
-		return match_prefix(match->comm_prefix, comm, MAX_COMM);
-	}
-	case MATCH_PCOMM_PREFIX: {
-		char pcomm[MAX_COMM];
-
-		memcpy(pcomm, p->group_leader->comm, MAX_COMM);
-		return match_prefix(match->pcomm_prefix, pcomm, MAX_COMM);
-	}
-	case MATCH_NICE_ABOVE:
-		return prio_to_nice((s32)p->static_prio) > match->nice;
-	case MATCH_NICE_BELOW:
-		return prio_to_nice((s32)p->static_prio) < match->nice;
-	case MATCH_NICE_EQUALS:
-		return prio_to_nice((s32)p->static_prio) == match->nice;
-	default:
-		scx_bpf_error("invalid match kind %d", match->kind);
-		return false;
+	struct match_trie_node *node;
+	u32 *root;
+	s32 accept;
+	u32 i, j;
+
+	if (!(root = MEMBER_VPTR(*mt, .trie_root[trie])) ||
+	    !(node = MEMBER_VPTR(*mt, .nodes[*root]))) {
+		scx_bpf_error("invalid match trie %u", trie);
+		return -1;
+	}
+	accept = node->accept;
+
+	bpf_for(i, 0, max_len) {
+		char c = str[i];
+		u32 cur = node->child;
+		bool found = false;
+
+		if (!c)
+			break;
+
+		/* children are keyed by distinct chars */
+		bpf_for(j, 0, 256) {
+			struct match_trie_node *child;
+
+			if (!(child = MEMBER_VPTR(*mt, .nodes[cur])))
+				break;
+			if (child->c == c) {
+				node = child;
+				found = true;
+				break;
+			}
+			cur = child->sibling;
+		}
+
+		if (!found)
+			break;
+		if (node->accept >= 0)
+			accept = node->accept;
 	}
+
+	return accept;
 }
 
-static bool match_layer(struct layer *layer, struct task_struct *p, const char *cgrp_path)
+/* whether any rule of @mt has a prefix match of the @trie kind */
+static bool match_trie_used(struct match_table *mt, u32 trie)
 {
-	u32 nr_match_ors = layer->nr_match_ors;
-	u64 or_idx, and_idx;
+	struct match_trie_node *root;
+	u32 *root_idx;
+
+	if (!(root_idx = MEMBER_VPTR(*mt, .trie_root[trie])) ||
+	    !(root = MEMBER_VPTR(*mt, .nodes[*root_idx])))
+		return true;
 
-	if (nr_match_ors > MAX_LAYER_MATCH_ORS) {
-		scx_bpf_error("too many ORs");
+	return root->child != MAX_MATCH_NODES;
+}
+
+static bool match_trie(struct match_table *mt, u64 *sat, u32 trie,
+		       const char *str, u32 max_len)
+{
+	u64 *none, *acc = NULL;
+	s32 accept;
+	int w;
+
+	if (!(none = (u64 *)MEMBER_VPTR(*mt, .trie_none[trie]))) {
+		scx_bpf_error("invalid match trie %u", trie);
 		return false;
 	}
 
-	bpf_for(or_idx, 0, nr_match_ors) {
-		struct layer_match_ands *ands;
-		bool matched = true;
+	accept = match_trie_walk(mt, trie, str, max_len);
+	if (accept >= 0 &&
+	    !(acc = (u64 *)MEMBER_VPTR(*mt, .accept_masks[accept]))) {
+		scx_bpf_error("invalid match accept %d", accept);
+		return false;
+	}
 
-		barrier_var(or_idx);
-		if (or_idx >= MAX_LAYER_MATCH_ORS)
-			return false; /* can't happen */
-		ands = &layer->matches[or_idx];
+	for (w = 0; w < MATCH_MASK_WORDS; w++)
+		sat[w] &= none[w] | (acc ? acc[w] : 0);
+	return true;
+}
 
-		if (ands->nr_match_ands > NR_LAYER_MATCH_KINDS) {
-			scx_bpf_error("too many ANDs");
-			return false;
-		}
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct match_key);
+	__type(value, struct match_mask);
+	__uint(max_entries, 2 * MAX_MATCH_KEYS);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} match_keys SEC(".maps");
 
-		bpf_for(and_idx, 0, ands->nr_match_ands) {
-			struct layer_match *match;
+static bool match_key(struct match_table *mt, u32 table, u64 *sat, u32 kind,
+		      u64 val)
+{
+	struct match_key key = { .table = table, .kind = kind, .val = val };
+	struct match_mask *mask = NULL;
+	u64 *none;
+	u32 *nr_keys;
+	int w;
+
+	if (!(none = (u64 *)MEMBER_VPTR(*mt, .key_none[kind])) ||
+	    !(nr_keys = MEMBER_VPTR(*mt, .nr_keys[kind]))) {
+		scx_bpf_error("invalid match key kind %u", kind);
+		return false;
+	}
 
-			barrier_var(and_idx);
-			if (and_idx >= NR_LAYER_MATCH_KINDS)
-				return false; /* can't happen */
-			match = &ands->matches[and_idx];
+	if (*nr_keys)
+		mask = bpf_map_lookup_elem(&match_keys, &key);
 
-			if (!match_one(match, p, cgrp_path)) {
-				matched = false;
-				break;
-			}
-		}
+	for (w = 0; w < MATCH_MASK_WORDS; w++)
+		sat[w] &= none[w] | (mask ? mask->bits[w] : 0);
+	return true;
+}
 
-		if (matched)
-			return true;
+/*
+ * Evaluate match_tables[@table] against @p in one pass and return the index of
+ * the layer @p belongs to, -1 if none.
+ */
+static s32 match_task_layer(struct task_struct *p, struct task_ctx *tctx,
+			    u32 table, const char *cgrp_path)
+{
+	s32 nice = prio_to_nice((s32)p->static_prio);
+	u64 sat[MATCH_MASK_WORDS];
+	char comm[MAX_COMM], pcomm[MAX_COMM];
+	struct match_table *mt;
+	u64 *nice_mask, *prop_mask;
+	u32 *layer_idx, props = 0;
+	int w;
+
+	if (!(mt = MEMBER_VPTR(match_tables, [table]))) {
+		scx_bpf_error("invalid match table %u", table);
+		return -1;
 	}
 
-	return false;
+	if (!(nice_mask = (u64 *)MEMBER_VPTR(*mt, .nice_masks[nice + NR_NICES / 2]))) {
+		scx_bpf_error("invalid nice %d", nice);
+		return -1;
+	}
+
+	if (p->flags & PF_KTHREAD)
+		props |= MATCH_PROP_KTHREAD;
+	if (p->group_leader == p)
+		props |= MATCH_PROP_GROUP_LEADER;
+	if (!(prop_mask = (u64 *)MEMBER_VPTR(*mt, .prop_masks[props]))) {
+		scx_bpf_error("invalid task props %u", props);
+		return -1;
+	}
+
+	for (w = 0; w < MATCH_MASK_WORDS; w++)
+		sat[w] = nice_mask[w] & prop_mask[w];
+
+	if (!match_key(mt, table, sat, MATCH_KEY_UID,
+		       BPF_CORE_READ(p, cred, euid.val)) ||
+	    !match_key(mt, table, sat, MATCH_KEY_GID,
+		       BPF_CORE_READ(p, cred, egid.val)) ||
+	    !match_key(mt, table, sat, MATCH_KEY_CGROUP_ID,
+		       p->cgroups->dfl_cgrp->kn->id) ||
+	    !match_key(mt, table, sat, MATCH_KEY_EXEC_HASH, tctx->exec_hash))
+		return -1;
+
+	memcpy(comm, p->comm, MAX_COMM);
+	memcpy(pcomm, p->group_leader->comm, MAX_COMM);
+
+	if (!match_trie(mt, sat, MATCH_TRIE_CGROUP, cgrp_path, MAX_PATH) ||
+	    !match_trie(mt, sat, MATCH_TRIE_COMM, comm, MAX_COMM) ||
+	    !match_trie(mt, sat, MATCH_TRIE_PCOMM, pcomm, MAX_COMM))
+		return -1;
+
+	for (w = 0; w < MATCH_MASK_WORDS; w++) {
+		u32 rule;
+
+		if (!sat[w])
+			continue;
+
+		rule = w * 64 + lowest_bit_idx(sat[w]);
+		if (!(layer_idx = MEMBER_VPTR(*mt, .rule_layer[rule])))
+			return -1;
+		return *layer_idx;
+	}
+
+	return -1;
 }
 
 static void maybe_refresh_layer(struct task_struct *p, struct task_ctx *tctx)
 {
-	const char *cgrp_path;
-	bool matched = false;
-	u64 idx;	// XXX - int makes verifier unhappy
+	u64 refresh_seq = layer_refresh_seq;
+	u32 table = match_table_idx & 1;
+	const char *cgrp_path = "";
+	struct layer *layer;
+	s32 idx;
 
-	if (!tctx->refresh_layer)
+	if (!tctx->refresh_layer && tctx->layer_refresh_seq == refresh_seq)
 		return;
 	tctx->refresh_layer = false;
+	tctx->layer_refresh_seq = refresh_seq;
 
-	if (!(cgrp_path = format_cgrp_path(p->cgroups->dfl_cgrp)))
+	/* formatting the path is expensive, skip if no rule looks at it */
+	if (match_trie_used(&match_tables[table], MATCH_TRIE_CGROUP) &&
+	    !(cgrp_path = format_cgrp_path(p->cgroups->dfl_cgrp)))
 		return;
 
 	if (tctx->layer >= 0 && tctx->layer < nr_layers)
 		__sync_fetch_and_add(&layers[tctx->layer].nr_tasks, -1);
 
-	bpf_for(idx, 0, nr_layers) {
-		if (match_layer(&layers[idx], p, cgrp_path)) {
-			matched = true;
-			break;
-		}
-	}
-
-	if (matched) {
-		struct layer *layer = &layers[idx];
+	idx = match_task_layer(p, tctx, table, cgrp_path);
 
+	if (idx >= 0 && idx < nr_layers && (layer = MEMBER_VPTR(layers, [idx]))) {
 		tctx->layer = idx;
 		tctx->layer_cpus_seq = layer->cpus_seq - 1;
 		__sync_fetch_and_add(&layer->nr_tasks, 1);
@@ -970,41 +1382,31 @@ void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
 	struct layer *layer;
 	s32 task_cpu = scx_bpf_task_cpu(p);
 
-	if (!(cctx = lookup_cpu_ctx(-1)) || !(tctx = lookup_task_ctx(p)) ||
-	    !(layer = lookup_layer(tctx->layer)))
+	if (!(cctx = lookup_cpu_ctx(-1)))
+		return;
+
+	charge_excl_idle(cctx);
+
+	if (!(tctx = lookup_task_ctx(p)) || !(layer = lookup_layer(tctx->layer)))
 		return;
 
-	if (tctx->last_cpu >= 0 && tctx->last_cpu != task_cpu)
+	if (tctx->last_cpu >= 0 && tctx->last_cpu != task_cpu) {
 		lstat_inc(LSTAT_MIGRATION, layer, cctx);
+		if (cpu_to_llc(tctx->last_cpu) != cpu_to_llc(task_cpu))
+			lstat_inc(LSTAT_XLLC_MIGRATION, layer, cctx);
+	}
 	tctx->last_cpu = task_cpu;
 
 	if (vtime_before(layer->vtime_now, p->scx.dsq_vtime))
 		layer->vtime_now = p->scx.dsq_vtime;
 
+	if (layer->preempt && preemptible_cpumask)
+		bpf_cpumask_clear_cpu(task_cpu, preemptible_cpumask);
+
 	cctx->current_preempt = layer->preempt;
 	cctx->current_exclusive = layer->exclusive;
 	tctx->running_at = bpf_ktime_get_ns();
 
-	/*
-	 * If this CPU is transitioning from running an exclusive task to a
-	 * non-exclusive one, the sibling CPU has likely been idle. Wake it up.
-	 */
-	if (cctx->prev_exclusive && !cctx->current_exclusive) {
-		s32 sib = sibling_cpu(task_cpu);
-		struct cpu_ctx *sib_cctx;
-
-		/*
-		 * %SCX_KICK_IDLE would be great here but we want to support
-		 * older kernels. Let's use racy and inaccruate custom idle flag
-		 * instead.
-		 */
-		if (sib >= 0 && (sib_cctx = lookup_cpu_ctx(sib)) &&
-		    sib_cctx->maybe_idle) {
-			gstat_inc(GSTAT_EXCL_WAKEUP, cctx);
-			scx_bpf_kick_cpu(sib, 0);
-		}
-	}
-
 	if (layer->perf > 0)
 		scx_bpf_cpuperf_set(task_cpu, layer->perf);
 
@@ -1034,9 +1436,27 @@ void BPF_STRUCT_OPS(layered_stopping, struct task_struct *p, bool runnable)
 	}
 
 	cctx->layer_cycles[lidx] += used;
+	if (cctx->current_preempt && preemptible_cpumask)
+		bpf_cpumask_set_cpu(bpf_get_smp_processor_id(), preemptible_cpumask);
 	cctx->current_preempt = false;
-	cctx->prev_exclusive = cctx->current_exclusive;
-	cctx->current_exclusive = false;
+
+	/*
+	 * Hand the core back. If the sibling CPU was kept idle for the
+	 * exclusive task, kick it so that it doesn't wait for the next tick to
+	 * dispatch. If the next task is exclusive too, the sibling will find
+	 * out and go back to idle.
+	 */
+	if (cctx->current_exclusive) {
+		s32 sib = sibling_cpu(bpf_get_smp_processor_id());
+		struct cpu_ctx *sib_cctx;
+
+		cctx->current_exclusive = false;
+		if (sib >= 0 && (sib_cctx = lookup_cpu_ctx(sib)) &&
+		    sib_cctx->excl_idle_at) {
+			gstat_inc(GSTAT_EXCL_WAKEUP, cctx);
+			scx_bpf_kick_cpu(sib, 0);
+		}
+	}
 
 	/* scale the execution time by the inverse of the weight and charge */
 	if (cctx->yielding && used < slice_ns)
@@ -1148,6 +1568,15 @@ s32 BPF_STRUCT_OPS(layered_init_task, struct task_struct *p,
 	tctx->layer = -1;
 	tctx->refresh_layer = true;
 
+	/* a forked task runs the same binary as its parent */
+	if (args->fork) {
+		struct task_struct *parent = bpf_get_current_task_btf();
+		struct task_ctx *parent_tctx;
+
+		if ((parent_tctx = lookup_task_ctx_may_fail(parent)))
+			tctx->exec_hash = parent_tctx->exec_hash;
+	}
+
 	if (all_cpumask)
 		tctx->all_cpus_allowed =
 			bpf_cpumask_subset((const struct cpumask *)all_cpumask, p->cpus_ptr);
@@ -1222,14 +1651,32 @@ static void dump_layer_cpumask(int idx)
 void BPF_STRUCT_OPS(layered_dump, struct scx_dump_ctx *dctx)
 {
 	u64 now = bpf_ktime_get_ns();
-	int i;
+	int i, llc;
 
 	bpf_for(i, 0, nr_layers) {
-		scx_bpf_dump("LAYER[%d] nr_cpus=%u nr_queued=%d -%llums cpus=",
-			     i, layers[i].nr_cpus, scx_bpf_dsq_nr_queued(i),
-			     dsq_first_runnable_for_ms(i, now));
+		struct layer *layer = &layers[i];
+
+		if (!layer->llc_dsqs) {
+			scx_bpf_dump("LAYER[%d] nr_cpus=%u nr_queued=%d -%llums cpus=",
+				     i, layer->nr_cpus, scx_bpf_dsq_nr_queued(i),
+				     dsq_first_runnable_for_ms(i, now));
+			dump_layer_cpumask(i);
+			scx_bpf_dump("\n");
+			continue;
+		}
+
+		scx_bpf_dump("LAYER[%d] nr_cpus=%u nr_queued=%d cpus=",
+			     i, layer->nr_cpus, layer_nr_queued(layer));
 		dump_layer_cpumask(i);
 		scx_bpf_dump("\n");
+
+		bpf_for(llc, 0, nr_llcs) {
+			u64 dsq_id = layer_llc_dsq_id(i, llc);
+
+			scx_bpf_dump("  LLC[%d] nr_queued=%d -%llums\n",
+				     llc, scx_bpf_dsq_nr_queued(dsq_id),
+				     dsq_first_runnable_for_ms(dsq_id, now));
+		}
 	}
 
 	scx_bpf_dump("HI_FALLBACK nr_queued=%d -%llums\n",
@@ -1243,7 +1690,7 @@ void BPF_STRUCT_OPS(layered_dump, struct scx_dump_ctx *dctx)
 s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
 {
 	struct bpf_cpumask *cpumask;
-	int i, j, k, nr_online_cpus, ret;
+	int i, llc, nr_online_cpus, ret;
 
 	ret = scx_bpf_create_dsq(HI_FALLBACK_DSQ, -1);
 	if (ret < 0)
@@ -1275,6 +1722,15 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
 	if (cpumask)
 		bpf_cpumask_release(cpumask);
 
+	cpumask = bpf_cpumask_create();
+	if (!cpumask)
+		return -ENOMEM;
+	bpf_cpumask_setall(cpumask);
+
+	cpumask = bpf_kptr_xchg(&preemptible_cpumask, cpumask);
+	if (cpumask)
+		bpf_cpumask_release(cpumask);
+
 	dbg("CFG: Dumping configuration, nr_online_cpus=%d smt_enabled=%d",
 	    nr_online_cpus, smt_enabled);
 
@@ -1284,67 +1740,18 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
 		dbg("CFG LAYER[%d] min_exec_ns=%lu open=%d preempt=%d exclusive=%d",
 		    i, layer->min_exec_ns, layer->open, layer->preempt,
 		    layer->exclusive);
+	}
 
-		if (layer->nr_match_ors > MAX_LAYER_MATCH_ORS) {
-			scx_bpf_error("too many ORs");
-			return -EINVAL;
-		}
-
-		bpf_for(j, 0, layer->nr_match_ors) {
-			struct layer_match_ands *ands = MEMBER_VPTR(layers, [i].matches[j]);
-			if (!ands) {
-				scx_bpf_error("shouldn't happen");
-				return -EINVAL;
-			}
+	dbg("CFG MATCH nr_rules=%u", match_tables[0].nr_rules);
 
-			if (ands->nr_match_ands > NR_LAYER_MATCH_KINDS) {
-				scx_bpf_error("too many ANDs");
-				return -EINVAL;
-			}
+	bpf_for(i, 0, match_tables[0].nr_rules) {
+		u32 *layer_idx = MEMBER_VPTR(match_tables, [0].rule_layer[i]);
 
-			dbg("CFG   OR[%02d]", j);
-
-			bpf_for(k, 0, ands->nr_match_ands) {
-				char header[32];
-				u64 header_data[1] = { k };
-				struct layer_match *match;
-
-				bpf_snprintf(header, sizeof(header), "CFG     AND[%02d]:",
-					     header_data, sizeof(header_data));
-
-				match = MEMBER_VPTR(layers, [i].matches[j].matches[k]);
-				if (!match) {
-					scx_bpf_error("shouldn't happen");
-					return -EINVAL;
-				}
-
-				switch (match->kind) {
-				case MATCH_CGROUP_PREFIX:
-					dbg("%s CGROUP_PREFIX \"%s\"", header, match->cgroup_prefix);
-					break;
-				case MATCH_COMM_PREFIX:
-					dbg("%s COMM_PREFIX \"%s\"", header, match->comm_prefix);
-					break;
-				case MATCH_PCOMM_PREFIX:
-					dbg("%s PCOMM_PREFIX \"%s\"", header, match->pcomm_prefix);
-					break;
-				case MATCH_NICE_ABOVE:
-					dbg("%s NICE_ABOVE %d", header, match->nice);
-					break;
-				case MATCH_NICE_BELOW:
-					dbg("%s NICE_BELOW %d", header, match->nice);
-					break;
-				case MATCH_NICE_EQUALS:
-					dbg("%s NICE_EQUALS %d", header, match->nice);
-					break;
-				default:
-					scx_bpf_error("%s Invalid kind", header);
-					return -EINVAL;
-				}
-			}
-			if (ands->nr_match_ands == 0)
-				dbg("CFG     DEFAULT");
+		if (!layer_idx) {
+			scx_bpf_error("too many match rules");
+			return -EINVAL;
 		}
+		dbg("CFG   RULE[%03d] LAYER[%d]", i, *layer_idx);
 	}
 
 	bpf_for(i, 0, nr_layers) {
@@ -1352,9 +1759,17 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(layered_init)
 
 		layers[i].idx = i;
 
-		ret = scx_bpf_create_dsq(i, -1);
-		if (ret < 0)
-			return ret;
+		if (layers[i].llc_dsqs) {
+			bpf_for(llc, 0, nr_llcs) {
+				ret = scx_bpf_create_dsq(layer_llc_dsq_id(i, llc), -1);
+				if (ret < 0)
+					return ret;
+			}
+		} else {
+			ret = scx_bpf_create_dsq(i, -1);
+			if (ret < 0)
+				return ret;
+		}
 
 		if (!(cpumaskw = bpf_map_lookup_elem(&layer_cpumasks, &i)))
 			return -ENOENT;
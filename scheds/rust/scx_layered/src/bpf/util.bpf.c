@@ -54,15 +54,71 @@ static char *format_cgrp_path(struct cgroup *cgrp)
 	return path;
 }
 
-static inline bool match_prefix(const char *prefix, const char *str, u32 max_len)
+/*
+ * Scratch buffer for hash_exec_path(). It's called from a tracepoint which
+ * only disables migration, so an ops callback interrupting it on the same CPU
+ * may format a cgroup path into cgrp_path_bufs. Keep the two separate.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, MAX_PATH);
+	__uint(max_entries, 1);
+} exec_path_bufs SEC(".maps");
+
+/*
+ * FNV-1a hash of the kernel string @kpath. Must match exec_path_hash() in
+ * layer_match.rs. Returns 0 on failure which never matches.
+ */
+static u64 hash_exec_path(const char *kpath)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+	u32 zero = 0;
+	char *path = bpf_map_lookup_elem(&exec_path_bufs, &zero);
+	int len, i;
+
+	if (!path)
+		return 0;
+
+	len = bpf_probe_read_kernel_str(path, MAX_PATH, kpath);
+	if (len <= 1)
+		return 0;
+
+	bpf_for(i, 0, len - 1) {
+		if (i >= MAX_PATH)
+			break;
+		hash ^= (u8)path[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static inline u32 lowest_bit_idx(u64 v)
 {
-	int c;
+	u32 idx = 0;
 
-	bpf_for(c, 0, max_len) {
-		if (prefix[c] == '\0')
-			return true;
-		if (str[c] != prefix[c])
-			return false;
+	if (!(v & 0xffffffff)) {
+		idx += 32;
+		v >>= 32;
+	}
+	if (!(v & 0xffff)) {
+		idx += 16;
+		v >>= 16;
+	}
+	if (!(v & 0xff)) {
+		idx += 8;
+		v >>= 8;
+	}
+	if (!(v & 0xf)) {
+		idx += 4;
+		v >>= 4;
+	}
+	if (!(v & 0x3)) {
+		idx += 2;
+		v >>= 2;
 	}
-	return false;
+	if (!(v & 0x1))
+		idx += 1;
+	return idx;
 }
@@ -0,0 +1,175 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+use std::fs;
+use std::io::ErrorKind;
+use std::io::Read;
+use std::io::Write;
+use std::net::TcpListener;
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::net::UnixListener;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::sync::Mutex;
+use std::thread;
+use std::time::Duration;
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use log::info;
+use log::warn;
+use prometheus_client::encoding::text::encode;
+use prometheus_client::registry::Registry;
+
+const CONTENT_TYPE: &str = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+const CONN_TIMEOUT: Duration = Duration::from_millis(100);
+const MAX_REQUEST_LEN: usize = 8192;
+
+/// Stats handed over from the scheduling loop to the exporter thread. Every
+/// monitoring interval, the scheduler fills a registry nothing else holds and
+/// swaps it in as the latest snapshot, bumping @gen. It never writes to a
+/// registry again while the exporter may still be holding it. The exporter
+/// thread encodes the snapshot when it's scraped after an update and serves
+/// the cached encoding otherwise, so a scrape always reflects a single
+/// interval and the scheduling loop never encodes or waits on I/O.
+pub struct StatsBuffer {
+    snapshot: Mutex<Option<Arc<Registry>>>,
+    gen: AtomicU64,
+}
+
+impl StatsBuffer {
+    fn new() -> Self {
+        Self {
+            snapshot: Mutex::new(None),
+            gen: AtomicU64::new(0),
+        }
+    }
+
+    /// Publish @registry, which the caller must not update anymore while the
+    /// exporter holds it, as the latest snapshot.
+    pub fn publish(&self, registry: Arc<Registry>) {
+        *self.snapshot.lock().unwrap() = Some(registry);
+        self.gen.fetch_add(1, Ordering::Release);
+    }
+}
+
+/// The exporter thread's cache of the latest encoding
+struct Encoded {
+    gen: u64,
+    payload: String,
+}
+
+impl Encoded {
+    fn read(&mut self, buf: &StatsBuffer) -> &str {
+        let gen = buf.gen.load(Ordering::Acquire);
+        if gen != self.gen {
+            let snapshot = buf.snapshot.lock().unwrap().clone();
+            self.payload.clear();
+            if let Some(registry) = snapshot {
+                encode(&mut self.payload, &registry).unwrap();
+            }
+            self.gen = gen;
+        }
+        &self.payload
+    }
+}
+
+enum Listener {
+    Unix(UnixListener),
+    Tcp(TcpListener),
+}
+
+/// Serve the payload from @buf over a Unix socket, which returns the payload
+/// on connection, or over HTTP on a TCP address.
+fn serve(listener: Listener, buf: Arc<StatsBuffer>) {
+    let mut encoded = Encoded {
+        gen: 0,
+        payload: String::new(),
+    };
+
+    loop {
+        let res = match &listener {
+            Listener::Unix(l) => l.accept().and_then(|(mut conn, _)| {
+                conn.set_write_timeout(Some(CONN_TIMEOUT))?;
+                conn.write_all(encoded.read(&buf).as_bytes())
+            }),
+            Listener::Tcp(l) => l.accept().and_then(|(mut conn, _)| {
+                conn.set_read_timeout(Some(CONN_TIMEOUT))?;
+                conn.set_write_timeout(Some(CONN_TIMEOUT))?;
+
+                // The request doesn't matter. Consume the header and respond.
+                let mut req = vec![];
+                let mut chunk = [0u8; 1024];
+                while !req.ends_with(b"\r\n\r\n") && req.len() < MAX_REQUEST_LEN {
+                    match conn.read(&mut chunk)? {
+                        0 => break,
+                        len => req.extend_from_slice(&chunk[..len]),
+                    }
+                }
+
+                let payload = encoded.read(&buf);
+                write!(
+                    conn,
+                    "HTTP/1.1 200 OK\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+                    CONTENT_TYPE,
+                    payload.len()
+                )?;
+                conn.write_all(payload.as_bytes())
+            }),
+        };
+
+        if let Err(e) = res {
+            warn!("stats exporter: {}", &e);
+        }
+    }
+}
+
+/// Remove the socket left behind by a previous instance at @path. Refuse to
+/// touch anything else.
+fn remove_stale_socket(path: &str) -> Result<()> {
+    match fs::symlink_metadata(path) {
+        Ok(meta) if meta.file_type().is_socket() => fs::remove_file(path)
+            .with_context(|| format!("Failed to remove stale stats socket {:?}", path)),
+        Ok(_) => bail!("{:?} exists and is not a socket", path),
+        Err(e) if e.kind() == ErrorKind::NotFound => Ok(()),
+        Err(e) => Err(e).with_context(|| format!("Failed to stat {:?}", path)),
+    }
+}
+
+/// Start the exporter thread listening on @addr. An absolute path or a path
+/// prefixed with "unix:" is a Unix socket. Anything else is a TCP address.
+/// Returns the buffer the scheduler hands its stats over through.
+pub fn start(addr: &str) -> Result<Arc<StatsBuffer>> {
+    let unix_path = match addr.strip_prefix("unix:") {
+        Some(path) => Some(path),
+        None if addr.starts_with('/') => Some(addr),
+        None => None,
+    };
+
+    let listener = match unix_path {
+        Some(path) => {
+            remove_stale_socket(path)?;
+            Listener::Unix(
+                UnixListener::bind(path)
+                    .with_context(|| format!("Failed to bind stats socket {:?}", path))?,
+            )
+        }
+        None => Listener::Tcp(
+            TcpListener::bind(addr)
+                .with_context(|| format!("Failed to bind stats address {:?}", addr))?,
+        ),
+    };
+
+    let buf = Arc::new(StatsBuffer::new());
+    let buf_clone = buf.clone();
+    thread::Builder::new()
+        .name("stats-exporter".into())
+        .spawn(move || serve(listener, buf_clone))
+        .context("Failed to spawn the stats exporter thread")?;
+
+    info!("Exporting stats on {}", addr);
+    Ok(buf)
+}
@@ -0,0 +1,651 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+use std::collections::BTreeMap;
+use std::hint::black_box;
+use std::time::Instant;
+
+use anyhow::bail;
+use anyhow::Result;
+
+use crate::bpf_intf;
+use crate::LayerKind;
+use crate::LayerMatch;
+use crate::LayerSpec;
+
+pub const MAX_MATCH_RULES: usize = bpf_intf::consts_MAX_MATCH_RULES as usize;
+pub const MATCH_MASK_WORDS: usize = bpf_intf::consts_MATCH_MASK_WORDS as usize;
+pub const MAX_MATCH_NODES: usize = bpf_intf::consts_MAX_MATCH_NODES as usize;
+pub const MAX_MATCH_ACCEPTS: usize = bpf_intf::consts_MAX_MATCH_ACCEPTS as usize;
+pub const NR_NICES: usize = bpf_intf::consts_NR_NICES as usize;
+pub const NR_MATCH_TRIES: usize = bpf_intf::match_trie_kind_NR_MATCH_TRIES as usize;
+pub const MAX_MATCH_KEYS: usize = bpf_intf::consts_MAX_MATCH_KEYS as usize;
+pub const NR_MATCH_KEYS: usize = bpf_intf::match_key_kind_NR_MATCH_KEYS as usize;
+pub const NR_MATCH_PROP_COMBOS: usize = bpf_intf::match_prop_NR_MATCH_PROP_COMBOS as usize;
+const MAX_PATH: usize = bpf_intf::consts_MAX_PATH as usize;
+const MAX_COMM: usize = bpf_intf::consts_MAX_COMM as usize;
+
+const TRIE_CGROUP: usize = bpf_intf::match_trie_kind_MATCH_TRIE_CGROUP as usize;
+const TRIE_COMM: usize = bpf_intf::match_trie_kind_MATCH_TRIE_COMM as usize;
+const TRIE_PCOMM: usize = bpf_intf::match_trie_kind_MATCH_TRIE_PCOMM as usize;
+const KEY_UID: usize = bpf_intf::match_key_kind_MATCH_KEY_UID as usize;
+const KEY_GID: usize = bpf_intf::match_key_kind_MATCH_KEY_GID as usize;
+const KEY_CGROUP_ID: usize = bpf_intf::match_key_kind_MATCH_KEY_CGROUP_ID as usize;
+const KEY_EXEC_HASH: usize = bpf_intf::match_key_kind_MATCH_KEY_EXEC_HASH as usize;
+pub const PROP_KTHREAD: u32 = bpf_intf::match_prop_MATCH_PROP_KTHREAD;
+pub const PROP_GROUP_LEADER: u32 = bpf_intf::match_prop_MATCH_PROP_GROUP_LEADER;
+const MIN_NICE: i32 = -(NR_NICES as i32 / 2);
+const MAX_NICE: i32 = NR_NICES as i32 / 2 - 1;
+const NODE_NONE: u32 = MAX_MATCH_NODES as u32;
+
+type RuleMask = [u64; MATCH_MASK_WORDS];
+
+fn set_rule(mask: &mut RuleMask, rule: usize) {
+    mask[rule / 64] |= 1 << (rule % 64);
+}
+
+/// FNV-1a hash of an exec path. Must match hash_exec_path() in util.bpf.c.
+pub fn exec_path_hash(path: &[u8]) -> u64 {
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for &c in path.iter().take(MAX_PATH - 1) {
+        if c == 0 {
+            break;
+        }
+        hash ^= c as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+    }
+    hash
+}
+
+/// Task attributes which layer matches look at.
+#[derive(Clone, Debug, Default)]
+pub struct TaskAttrs {
+    pub cgrp_path: Vec<u8>,
+    pub comm: Vec<u8>,
+    pub pcomm: Vec<u8>,
+    pub nice: i32,
+    pub uid: u32,
+    pub gid: u32,
+    pub cgroup_id: u64,
+    pub exec_hash: u64,
+    pub props: u32,
+}
+
+impl TaskAttrs {
+    fn key(&self, kind: usize) -> u64 {
+        match kind {
+            KEY_UID => self.uid as u64,
+            KEY_GID => self.gid as u64,
+            KEY_CGROUP_ID => self.cgroup_id,
+            _ => self.exec_hash,
+        }
+    }
+}
+
+/// A task has a single value of each key kind. Record that @kind must be @val
+/// and return whether that's compatible with the previous requirements.
+fn require_key(keys: &mut [Option<u64>; NR_MATCH_KEYS], kind: usize, val: u64) -> bool {
+    match keys[kind] {
+        Some(cur) => cur == val,
+        None => {
+            keys[kind] = Some(val);
+            true
+        }
+    }
+}
+
+/// Record in (constrained props, required values) that @prop must be @set.
+fn require_prop(props: &mut (u32, u32), prop: u32, set: bool) -> bool {
+    let val = if set { prop } else { 0 };
+    if props.0 & prop != 0 {
+        return props.1 & prop == val;
+    }
+    props.0 |= prop;
+    props.1 |= val;
+    true
+}
+
+#[derive(Clone, Debug)]
+pub struct TrieNode {
+    pub child: u32,
+    pub sibling: u32,
+    pub accept: i32,
+    pub c: u8,
+}
+
+impl TrieNode {
+    fn new(c: u8) -> Self {
+        Self {
+            child: NODE_NONE,
+            sibling: NODE_NONE,
+            accept: -1,
+            c,
+        }
+    }
+}
+
+/// Userspace image of struct match_table in intf.h.
+///
+/// Each OR block of each layer becomes a rule, numbered in layer order. The
+/// prefix matches of a rule are inserted into per-kind tries, its nice
+/// matches are folded into a range which sets the rule's bit in the nice
+/// buckets and its task property matches set the bit in the property
+/// combinations they allow. Exact uid, gid, cgroup ID and exec path matches
+/// become entries of the match_keys hash map in @keys. Matching a task then
+/// is a single walk of each trie plus a lookup per key kind followed by ANDing
+/// a few bitmasks, instead of evaluating every rule of every layer.
+#[derive(Clone, Debug)]
+pub struct MatchTable {
+    pub rule_layer: Vec<u32>,
+    pub trie_root: [u32; NR_MATCH_TRIES],
+    pub trie_none: [RuleMask; NR_MATCH_TRIES],
+    pub key_none: [RuleMask; NR_MATCH_KEYS],
+    pub nr_keys: [u32; NR_MATCH_KEYS],
+    pub keys: BTreeMap<(u32, u64), RuleMask>,
+    pub nice_masks: [RuleMask; NR_NICES],
+    pub prop_masks: [RuleMask; NR_MATCH_PROP_COMBOS],
+    pub accept_masks: Vec<RuleMask>,
+    pub nodes: Vec<TrieNode>,
+}
+
+impl MatchTable {
+    fn insert(&mut self, trie: usize, prefix: &[u8]) -> Result<usize> {
+        let mut cur = self.trie_root[trie] as usize;
+
+        for &c in prefix.iter() {
+            let mut child = self.nodes[cur].child;
+            while child != NODE_NONE && self.nodes[child as usize].c != c {
+                child = self.nodes[child as usize].sibling;
+            }
+
+            if child == NODE_NONE {
+                if self.nodes.len() >= MAX_MATCH_NODES {
+                    bail!("Too many match prefix characters ({})", MAX_MATCH_NODES);
+                }
+                child = self.nodes.len() as u32;
+                let mut node = TrieNode::new(c);
+                node.sibling = self.nodes[cur].child;
+                self.nodes.push(node);
+                self.nodes[cur].child = child;
+            }
+            cur = child as usize;
+        }
+
+        Ok(cur)
+    }
+
+    fn accept(&mut self, node: usize, rule: usize) -> Result<()> {
+        if self.nodes[node].accept < 0 {
+            if self.accept_masks.len() >= MAX_MATCH_ACCEPTS {
+                bail!("Too many distinct match prefixes ({})", MAX_MATCH_ACCEPTS);
+            }
+            self.nodes[node].accept = self.accept_masks.len() as i32;
+            self.accept_masks.push([0; MATCH_MASK_WORDS]);
+        }
+        set_rule(
+            &mut self.accept_masks[self.nodes[node].accept as usize],
+            rule,
+        );
+        Ok(())
+    }
+
+    /// Fold the accept masks of the ancestors into each accepting node so
+    /// that the deepest accepting node on a path carries all matching rules.
+    fn propagate(&mut self, node: usize, inherited: RuleMask) {
+        let mut mask = inherited;
+
+        if self.nodes[node].accept >= 0 {
+            let acc = &mut self.accept_masks[self.nodes[node].accept as usize];
+            for w in 0..MATCH_MASK_WORDS {
+                acc[w] |= inherited[w];
+            }
+            mask = *acc;
+        }
+
+        let mut child = self.nodes[node].child;
+        while child != NODE_NONE {
+            self.propagate(child as usize, mask);
+            child = self.nodes[child as usize].sibling;
+        }
+    }
+
+    pub fn compile(specs: &[LayerSpec]) -> Result<Self> {
+        let mut table = Self {
+            rule_layer: vec![],
+            trie_root: [0; NR_MATCH_TRIES],
+            trie_none: [[0; MATCH_MASK_WORDS]; NR_MATCH_TRIES],
+            key_none: [[0; MATCH_MASK_WORDS]; NR_MATCH_KEYS],
+            nr_keys: [0; NR_MATCH_KEYS],
+            keys: BTreeMap::new(),
+            nice_masks: [[0; MATCH_MASK_WORDS]; NR_NICES],
+            prop_masks: [[0; MATCH_MASK_WORDS]; NR_MATCH_PROP_COMBOS],
+            accept_masks: vec![],
+            nodes: vec![],
+        };
+
+        for trie in 0..NR_MATCH_TRIES {
+            table.trie_root[trie] = table.nodes.len() as u32;
+            table.nodes.push(TrieNode::new(0));
+        }
+
+        for (layer_idx, spec) in specs.iter().enumerate() {
+            for ands in spec.matches.iter() {
+                let rule = table.rule_layer.len();
+                if rule >= MAX_MATCH_RULES {
+                    bail!("Too many match OR blocks in total ({})", MAX_MATCH_RULES);
+                }
+                table.rule_layer.push(layer_idx as u32);
+
+                let mut prefixes: [Option<&str>; NR_MATCH_TRIES] = [None; NR_MATCH_TRIES];
+                let mut keys: [Option<u64>; NR_MATCH_KEYS] = [None; NR_MATCH_KEYS];
+                let (mut nice_min, mut nice_max) = (MIN_NICE, MAX_NICE);
+                let mut props = (0u32, 0u32);
+                let mut satisfiable = true;
+
+                for one in ands.iter() {
+                    let (trie, prefix) = match one {
+                        LayerMatch::CgroupPrefix(prefix) => (TRIE_CGROUP, prefix),
+                        LayerMatch::CommPrefix(prefix) => (TRIE_COMM, prefix),
+                        LayerMatch::PcommPrefix(prefix) => (TRIE_PCOMM, prefix),
+                        LayerMatch::NiceAbove(nice) => {
+                            nice_min = nice_min.max(nice.saturating_add(1));
+                            continue;
+                        }
+                        LayerMatch::NiceBelow(nice) => {
+                            nice_max = nice_max.min(nice.saturating_sub(1));
+                            continue;
+                        }
+                        LayerMatch::NiceEquals(nice) => {
+                            nice_min = nice_min.max(*nice);
+                            nice_max = nice_max.min(*nice);
+                            continue;
+                        }
+                        LayerMatch::UidEquals(uid) => {
+                            satisfiable &= require_key(&mut keys, KEY_UID, *uid as u64);
+                            continue;
+                        }
+                        LayerMatch::GidEquals(gid) => {
+                            satisfiable &= require_key(&mut keys, KEY_GID, *gid as u64);
+                            continue;
+                        }
+                        LayerMatch::CgroupIdEquals(id) => {
+                            satisfiable &= require_key(&mut keys, KEY_CGROUP_ID, *id);
+                            continue;
+                        }
+                        LayerMatch::ExecPath(path) => {
+                            let hash = exec_path_hash(path.as_bytes());
+                            satisfiable &= require_key(&mut keys, KEY_EXEC_HASH, hash);
+                            continue;
+                        }
+                        LayerMatch::IsKthread(v) => {
+                            satisfiable &= require_prop(&mut props, PROP_KTHREAD, *v);
+                            continue;
+                        }
+                        LayerMatch::IsGroupLeader(v) => {
+                            satisfiable &= require_prop(&mut props, PROP_GROUP_LEADER, *v);
+                            continue;
+                        }
+                    };
+
+                    // Of two prefixes of the same kind, the longer one must
+                    // extend the shorter for both to match.
+                    prefixes[trie] = match prefixes[trie] {
+                        None => Some(prefix.as_str()),
+                        Some(cur) if prefix.starts_with(cur) => Some(prefix.as_str()),
+                        Some(cur) if cur.starts_with(prefix.as_str()) => Some(cur),
+                        Some(cur) => {
+                            satisfiable = false;
+                            Some(cur)
+                        }
+                    };
+                }
+
+                if !satisfiable || nice_min > nice_max {
+                    continue;
+                }
+
+                for nice in nice_min..=nice_max {
+                    set_rule(&mut table.nice_masks[(nice - MIN_NICE) as usize], rule);
+                }
+
+                for combo in 0..NR_MATCH_PROP_COMBOS as u32 {
+                    if combo & props.0 == props.1 {
+                        set_rule(&mut table.prop_masks[combo as usize], rule);
+                    }
+                }
+
+                for (kind, val) in keys.iter().enumerate() {
+                    match val {
+                        None => set_rule(&mut table.key_none[kind], rule),
+                        Some(val) => {
+                            let mask = table
+                                .keys
+                                .entry((kind as u32, *val))
+                                .or_insert([0; MATCH_MASK_WORDS]);
+                            set_rule(mask, rule);
+                        }
+                    }
+                }
+
+                for (trie, prefix) in prefixes.iter().enumerate() {
+                    match prefix {
+                        None => set_rule(&mut table.trie_none[trie], rule),
+                        Some(prefix) => {
+                            let node = table.insert(trie, prefix.as_bytes())?;
+                            table.accept(node, rule)?;
+                        }
+                    }
+                }
+            }
+        }
+
+        for trie in 0..NR_MATCH_TRIES {
+            table.propagate(table.trie_root[trie] as usize, [0; MATCH_MASK_WORDS]);
+        }
+
+        if table.keys.len() > MAX_MATCH_KEYS {
+            bail!(
+                "Too many distinct uid, gid, cgroup ID and exec path matches ({})",
+                MAX_MATCH_KEYS
+            );
+        }
+        for (kind, _) in table.keys.keys() {
+            table.nr_keys[*kind as usize] += 1;
+        }
+
+        Ok(table)
+    }
+
+    fn walk(&self, trie: usize, s: &[u8]) -> i32 {
+        let mut node = &self.nodes[self.trie_root[trie] as usize];
+        let mut accept = node.accept;
+
+        for &c in s.iter() {
+            if c == 0 {
+                break;
+            }
+            let mut child = node.child;
+            while child != NODE_NONE && self.nodes[child as usize].c != c {
+                child = self.nodes[child as usize].sibling;
+            }
+            if child == NODE_NONE {
+                break;
+            }
+            node = &self.nodes[child as usize];
+            if node.accept >= 0 {
+                accept = node.accept;
+            }
+        }
+
+        accept
+    }
+
+    /// Userspace mirror of match_task_layer() in main.bpf.c.
+    pub fn match_task(&self, t: &TaskAttrs) -> Option<usize> {
+        if t.nice < MIN_NICE || t.nice > MAX_NICE {
+            return None;
+        }
+        let mut sat = self.nice_masks[(t.nice - MIN_NICE) as usize];
+        let prop_mask = &self.prop_masks[t.props as usize % NR_MATCH_PROP_COMBOS];
+        for w in 0..MATCH_MASK_WORDS {
+            sat[w] &= prop_mask[w];
+        }
+
+        for kind in 0..NR_MATCH_KEYS {
+            let mask = match self.nr_keys[kind] {
+                0 => None,
+                _ => self.keys.get(&(kind as u32, t.key(kind))),
+            };
+            for w in 0..MATCH_MASK_WORDS {
+                sat[w] &= self.key_none[kind][w] | mask.map(|m| m[w]).unwrap_or(0);
+            }
+        }
+
+        for (trie, s) in [
+            (TRIE_CGROUP, &t.cgrp_path),
+            (TRIE_COMM, &t.comm),
+            (TRIE_PCOMM, &t.pcomm),
+        ] {
+            let accept = self.walk(trie, s);
+            for w in 0..MATCH_MASK_WORDS {
+                let acc = match accept {
+                    a if a >= 0 => self.accept_masks[a as usize][w],
+                    _ => 0,
+                };
+                sat[w] &= self.trie_none[trie][w] | acc;
+            }
+        }
+
+        for w in 0..MATCH_MASK_WORDS {
+            if sat[w] != 0 {
+                let rule = w * 64 + sat[w].trailing_zeros() as usize;
+                return Some(self.rule_layer[rule] as usize);
+            }
+        }
+        None
+    }
+}
+
+/// Byte-at-a-time comparison like match_prefix() in util.bpf.c used to do.
+fn match_prefix(prefix: &str, s: &[u8]) -> bool {
+    for (i, c) in prefix.bytes().enumerate() {
+        if s.get(i) != Some(&c) {
+            return false;
+        }
+    }
+    true
+}
+
+/// Per-task rule interpretation equivalent to what match_layer() in
+/// main.bpf.c used to do. Used as the baseline for --bench-match.
+fn match_task_naive(specs: &[LayerSpec], t: &TaskAttrs) -> Option<usize> {
+    for (layer_idx, spec) in specs.iter().enumerate() {
+        for ands in spec.matches.iter() {
+            let matched = ands.iter().all(|one| match one {
+                LayerMatch::CgroupPrefix(prefix) => match_prefix(prefix, &t.cgrp_path),
+                LayerMatch::CommPrefix(prefix) => match_prefix(prefix, &t.comm),
+                LayerMatch::PcommPrefix(prefix) => match_prefix(prefix, &t.pcomm),
+                LayerMatch::NiceAbove(v) => t.nice > *v,
+                LayerMatch::NiceBelow(v) => t.nice < *v,
+                LayerMatch::NiceEquals(v) => t.nice == *v,
+                LayerMatch::UidEquals(v) => t.uid == *v,
+                LayerMatch::GidEquals(v) => t.gid == *v,
+                LayerMatch::CgroupIdEquals(v) => t.cgroup_id == *v,
+                LayerMatch::ExecPath(v) => t.exec_hash == exec_path_hash(v.as_bytes()),
+                LayerMatch::IsKthread(v) => (t.props & PROP_KTHREAD != 0) == *v,
+                LayerMatch::IsGroupLeader(v) => (t.props & PROP_GROUP_LEADER != 0) == *v,
+            });
+            if matched {
+                return Some(layer_idx);
+            }
+        }
+    }
+    None
+}
+
+fn bench_specs(nr_layers: usize, nr_ors: usize) -> Vec<LayerSpec> {
+    let mut specs: Vec<LayerSpec> = (0..nr_layers - 1)
+        .map(|l| LayerSpec {
+            name: format!("layer{}", l),
+            comment: None,
+            matches: (0..nr_ors)
+                .map(|o| match o % 4 {
+                    0 => vec![LayerMatch::CgroupPrefix(format!(
+                        "system.slice/workload-tenant.slice/svc{}-{}.service/",
+                        l, o
+                    ))],
+                    1 => vec![
+                        LayerMatch::CgroupPrefix("workload.slice/".into()),
+                        LayerMatch::CommPrefix(format!("wrk{}_{}", l, o)),
+                    ],
+                    2 => vec![
+                        LayerMatch::PcommPrefix(format!("proc{}_{}", l, o)),
+                        LayerMatch::NiceBelow(0),
+                    ],
+                    _ => vec![
+                        LayerMatch::UidEquals((1000 + l * nr_ors + o) as u32),
+                        LayerMatch::IsKthread(false),
+                    ],
+                })
+                .collect(),
+            kind: LayerKind::Open {
+                min_exec_us: 0,
+                yield_ignore: 0.0,
+                preempt: false,
+                preempt_first: false,
+                exclusive: false,
+                perf: 0,
+            },
+        })
+        .collect();
+
+    specs.push(LayerSpec {
+        name: "default".into(),
+        comment: None,
+        matches: vec![vec![]],
+        kind: LayerKind::Open {
+            min_exec_us: 0,
+            yield_ignore: 0.0,
+            preempt: false,
+            preempt_first: false,
+            exclusive: false,
+            perf: 0,
+        },
+    });
+    specs
+}
+
+fn bench_tasks(nr_layers: usize, nr_ors: usize, nr_tasks: usize) -> Vec<TaskAttrs> {
+    let mut seed: u64 = 0x2545f4914f6cdd1d;
+    let mut rand = move || {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        seed as usize
+    };
+
+    (0..nr_tasks)
+        .map(|_| {
+            // Pick a target rule so that tasks spread across all layers
+            // including the default one.
+            let l = rand() % nr_layers;
+            let o = rand() % nr_ors;
+            let mut cgrp_path = format!("system.slice/other-{}.service/", rand() % 64);
+            let mut comm = format!("t{}", rand() % 1000);
+            let mut pcomm = format!("p{}", rand() % 1000);
+            let mut nice = (rand() % NR_NICES) as i32 + MIN_NICE;
+            let mut uid = (rand() % 1000) as u32;
+            let props = (rand() % NR_MATCH_PROP_COMBOS) as u32;
+
+            if l < nr_layers - 1 {
+                match o % 4 {
+                    0 => {
+                        cgrp_path =
+                            format!("system.slice/workload-tenant.slice/svc{}-{}.service/", l, o)
+                    }
+                    1 => {
+                        cgrp_path = "workload.slice/job.scope/".into();
+                        comm = format!("wrk{}_{}", l, o);
+                    }
+                    2 => {
+                        pcomm = format!("proc{}_{}", l, o);
+                        nice = -5;
+                    }
+                    _ => uid = (1000 + l * nr_ors + o) as u32,
+                }
+            }
+
+            let mut comm = comm.into_bytes();
+            let mut pcomm = pcomm.into_bytes();
+            comm.truncate(MAX_COMM - 1);
+            pcomm.truncate(MAX_COMM - 1);
+
+            let mut cgrp_path = cgrp_path.into_bytes();
+            cgrp_path.truncate(MAX_PATH - 2);
+
+            TaskAttrs {
+                cgrp_path,
+                comm,
+                pcomm,
+                nice,
+                uid,
+                gid: uid,
+                props,
+                ..Default::default()
+            }
+        })
+        .collect()
+}
+
+/// Compare the cost of interpreting the layer matches per task against
+/// evaluating the compiled table for synthetic configurations of increasing
+/// numbers of layers and OR blocks per layer. Both are evaluated in userspace
+/// and the compiled path mirrors match_task_layer() in BPF, so the numbers
+/// indicate relative rather than absolute in-kernel cost.
+pub fn bench_match() -> Result<()> {
+    const NR_TASKS: usize = 4096;
+    const NR_ROUNDS: usize = 16;
+
+    println!(
+        "{:>6} {:>6} {:>6} {:>6} {:>12} {:>12} {:>8}",
+        "layers", "ors", "rules", "nodes", "naive_ns", "table_ns", "speedup"
+    );
+
+    for nr_layers in [2, 4, 8, 16, 32, 64] {
+        for nr_ors in [1, 4, 16, 32] {
+            if nr_layers > crate::MAX_LAYERS
+                || nr_ors > crate::MAX_LAYER_MATCH_ORS
+                || (nr_layers - 1) * nr_ors + 1 > MAX_MATCH_RULES
+            {
+                continue;
+            }
+
+            let specs = bench_specs(nr_layers, nr_ors);
+            let table = MatchTable::compile(&specs)?;
+            let tasks = bench_tasks(nr_layers, nr_ors, NR_TASKS);
+
+            for t in tasks.iter() {
+                let naive = match_task_naive(&specs, t);
+                let compiled = table.match_task(t);
+                if naive != compiled {
+                    bail!(
+                        "Compiled match {:?} differs from {:?} for {:?}",
+                        compiled,
+                        naive,
+                        String::from_utf8_lossy(&t.cgrp_path)
+                    );
+                }
+            }
+
+            let started_at = Instant::now();
+            for _ in 0..NR_ROUNDS {
+                for t in tasks.iter() {
+                    black_box(match_task_naive(black_box(&specs), t));
+                }
+            }
+            let naive_ns = started_at.elapsed().as_nanos() as f64 / (NR_TASKS * NR_ROUNDS) as f64;
+
+            let started_at = Instant::now();
+            for _ in 0..NR_ROUNDS {
+                for t in tasks.iter() {
+                    black_box(black_box(&table).match_task(t));
+                }
+            }
+            let table_ns = started_at.elapsed().as_nanos() as f64 / (NR_TASKS * NR_ROUNDS) as f64;
+
+            println!(
+                "{:>6} {:>6} {:>6} {:>6} {:>12.1} {:>12.1} {:>7.1}x",
+                nr_layers,
+                nr_ors,
+                table.rule_layer.len(),
+                table.nodes.len(),
+                naive_ns,
+                table_ns,
+                naive_ns / table_ns
+            );
+        }
+    }
+
+    Ok(())
+}
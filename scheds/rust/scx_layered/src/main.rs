@@ -6,13 +6,22 @@ mod bpf_skel;
 pub use bpf_skel::*;
 pub mod bpf_intf;
 
+mod exporter;
+use exporter::StatsBuffer;
+mod layer_match;
+use layer_match::MatchTable;
+mod perf;
+
 use std::collections::BTreeMap;
 use std::collections::BTreeSet;
-use std::ffi::CString;
+use std::collections::VecDeque;
 use std::fs;
 use std::io::Read;
 use std::io::Write;
 use std::ops::Sub;
+use std::os::fd::AsRawFd;
+use std::os::fd::OwnedFd;
+use std::sync::atomic::fence;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::AtomicI64;
 use std::sync::atomic::AtomicU64;
@@ -20,9 +29,8 @@ use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::time::Duration;
 use std::time::Instant;
+use std::time::SystemTime;
 
-use ::fb_procfs as procfs;
-use anyhow::anyhow;
 use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
@@ -40,6 +48,7 @@ use prometheus_client::metrics::family::Family;
 use prometheus_client::metrics::gauge::Gauge;
 use prometheus_client::registry::Registry;
 use scx_utils::compat;
+use scx_utils::cpu_util::CpuUtilTracker;
 use scx_utils::init_libbpf_logging;
 use scx_utils::ravg::ravg_read;
 use scx_utils::scx_ops_attach;
@@ -47,6 +56,7 @@ use scx_utils::scx_ops_load;
 use scx_utils::scx_ops_open;
 use scx_utils::uei_exited;
 use scx_utils::uei_report;
+use scx_utils::Topology;
 use scx_utils::UserExitInfo;
 use serde::Deserialize;
 use serde::Serialize;
@@ -57,6 +67,8 @@ const MAX_PATH: usize = bpf_intf::consts_MAX_PATH as usize;
 const MAX_COMM: usize = bpf_intf::consts_MAX_COMM as usize;
 const MAX_LAYER_MATCH_ORS: usize = bpf_intf::consts_MAX_LAYER_MATCH_ORS as usize;
 const MAX_LAYERS: usize = bpf_intf::consts_MAX_LAYERS as usize;
+const MAX_LLCS: usize = bpf_intf::consts_MAX_LLCS as usize;
+const CACHELINE_SIZE: usize = bpf_intf::consts_CACHELINE_SIZE as usize;
 const USAGE_HALF_LIFE: u32 = bpf_intf::consts_USAGE_HALF_LIFE;
 const USAGE_HALF_LIFE_F64: f64 = USAGE_HALF_LIFE as f64 / 1_000_000_000.0;
 const NR_GSTATS: usize = bpf_intf::global_stat_idx_NR_GSTATS as usize;
@@ -126,6 +138,27 @@ lazy_static::lazy_static! {
 /// - NiceEquals: Matches if the task's nice value is exactly equal to
 ///   the pattern.
 ///
+/// - UidEquals, GidEquals: Matches if the task's effective user or group ID
+///   is exactly equal to the pattern. A task which changes its effective IDs,
+///   e.g. with setuid(), is matched again the next time it runs.
+///
+/// - CgroupIdEquals: Matches if the ID of the task's cgroup, the inode
+///   number of the cgroup directory, is exactly equal to the pattern. Unlike
+///   CgroupPrefix, this doesn't match tasks in descendant cgroups.
+///
+/// - ExecPath: Matches if the task or, for tasks forked after the scheduler
+///   started, its ancestors last exec'd exactly the pattern. The path is
+///   compared as passed to exec, so symlinks and relative paths aren't
+///   resolved. Tasks which were already running when the scheduler started
+///   don't match until they exec again.
+///
+/// - IsKthread, IsGroupLeader: Matches if whether the task is a kernel
+///   thread or the thread group leader equals the pattern.
+///
+/// Prefix matches are looked up in tries, the exact value matches in a hash
+/// table and the nice and boolean matches in bitmasks, so the cost of
+/// matching a task is mostly independent of the number of layers and rules.
+///
 /// While there are complexity limitations as the matches are performed in
 /// BPF, it is straightforward to add more types of matches.
 ///
@@ -180,12 +213,25 @@ lazy_static::lazy_static! {
 ///
 /// - exclusive: If true, tasks in the layer will occupy the whole core. The
 ///   other logical CPUs sharing the same core will be kept idle. This isn't
-///   a hard guarantee, so don't depend on it for security purposes.
+///   a hard guarantee, so don't depend on it for security purposes. Tasks
+///   prefer wholly idle cores and the idled sibling is woken up as soon as
+///   the exclusive task stops. excl_idle_util reports the CPU time spent
+///   keeping siblings idle.
 ///
 /// - perf: CPU performance target. 0 means no configuration. A value
 ///   between 1 and 1024 indicates the performance level CPUs running tasks
 ///   in this layer are configured to using scx_bpf_cpuperf_set().
 ///
+/// Confined and Grouped layers also take the following option:
+///
+/// - llc_isolate_misses: LLC miss rate, in misses per millisecond of the
+///   layer's CPU time, above which the layer is isolated from the other
+///   layers' LLCs. While isolated, the layer only grows into LLCs which no
+///   other layer occupies, other layers don't grow into its LLCs and both
+///   sides give up the cores in shared LLCs first when shrinking. The
+///   isolation is lifted once the miss rate drops below three quarters of
+///   the threshold. 0 disables isolation. Implies --llc-miss-stats.
+///
 /// Similar to matches, adding new policies and extending existing ones
 /// should be relatively straightforward.
 ///
@@ -214,6 +260,16 @@ lazy_static::lazy_static! {
 ///   ...
 ///   $ scx_layered f:example.json
 ///
+/// The layer specs can be changed while scx_layered is running. On SIGHUP,
+/// or whenever a spec file changes with --watch-specs, the specs are read
+/// again and the new matches and policies take effect without detaching the
+/// scheduler. Tasks are matched again the next time they wake up. The number
+/// of layers can't be changed without restarting and such specs are
+/// rejected, as are specs which fail to parse or verify, in which case the
+/// current ones are kept. The reloaded specs are also kept when the
+/// scheduler restarts, e.g. on CPU hotplug. Note that SIGHUP doesn't
+/// terminate scx_layered. Use SIGINT or SIGTERM instead.
+///
 /// Statistics
 /// ==========
 ///
@@ -269,6 +325,14 @@ lazy_static::lazy_static! {
 /// - affn_viol: % which violated configured policies due to CPU affinity
 ///   restrictions.
 ///
+/// - mig/xllc: % of tasks that ran on a different CPU than the last time and
+///   % of tasks that ran on a different LLC.
+///
+/// - llc_miss/membw: With --llc-miss-stats, LLC misses per millisecond of
+///   CPU time and the memory bandwidth they add up to assuming that each
+///   miss transfers a cacheline. "isolated" is appended while the layer is
+///   isolated by llc_isolate_misses.
+///
 /// - cpus: CUR_NR_CPUS [MIN_NR_CPUS, MAX_NR_CPUS] CUR_CPU_MASK
 ///
 #[derive(Debug, Parser)]
@@ -299,6 +363,41 @@ struct Opts {
     #[clap(short = 'n', long)]
     no_load_frac_limit: bool,
 
+    /// Size confined and grouped layers by forecast utilization. Each
+    /// layer's utilization is tracked with Holt's linear exponential
+    /// smoothing (EWMA of the level plus trend) and layers are sized for
+    /// the larger of the current and the forecast utilization. This grows
+    /// layers ahead of ramping demand. Shrinking is delayed: a layer is
+    /// sized for the highest such utilization seen over the last
+    /// --forecast-horizon intervals, so it only shrinks once demand has
+    /// stayed down for that long.
+    #[clap(long)]
+    forecast: bool,
+
+    /// Smoothing factor of the utilization level for --forecast, in (0, 1].
+    #[clap(long, default_value = "0.5")]
+    forecast_alpha: f64,
+
+    /// Smoothing factor of the utilization trend for --forecast, in (0, 1].
+    #[clap(long, default_value = "0.2")]
+    forecast_beta: f64,
+
+    /// Number of scheduling intervals to forecast ahead for --forecast. This
+    /// is also how long shrinking is delayed.
+    #[clap(long, default_value = "10")]
+    forecast_horizon: usize,
+
+    /// Count LLC misses on each CPU with perf events and charge them to the
+    /// layer of the running task. Enabled automatically if any layer sets
+    /// llc_isolate_misses.
+    #[clap(long)]
+    llc_miss_stats: bool,
+
+    /// Reload the layer specs whenever one of the spec files is modified.
+    /// The specs are also reloaded on SIGHUP regardless of this option.
+    #[clap(long)]
+    watch_specs: bool,
+
     /// Exit debug dump buffer length. 0 indicates default.
     #[clap(long, default_value = "0")]
     exit_dump_len: u32,
@@ -314,10 +413,26 @@ struct Opts {
     #[clap(short = 'o', long)]
     open_metrics_format: bool,
 
+    /// Serve the stats in OpenMetrics format on ADDR from a separate thread.
+    /// Each monitoring interval's stats are handed over as a complete
+    /// snapshot and encoded by the exporter thread at most once per
+    /// interval, so a scrape never mixes intervals and neither encoding nor
+    /// scraping delays scheduling. An absolute path or a "unix:" prefixed path is a Unix
+    /// socket which returns the stats on connection. Anything else is a TCP
+    /// address, e.g. "127.0.0.1:9000", served over HTTP.
+    #[clap(long)]
+    stats_listen: Option<String>,
+
     /// Write example layer specifications into the file and exit.
     #[clap(short = 'e', long)]
     example: Option<String>,
 
+    /// Benchmark layer matching against synthetic layer specifications of
+    /// increasing size, comparing per-rule evaluation with the compiled
+    /// match table, and exit.
+    #[clap(long)]
+    bench_match: bool,
+
     /// Layer specification. See --help.
     specs: Vec<String>,
 }
@@ -330,6 +445,12 @@ enum LayerMatch {
     NiceAbove(i32),
     NiceBelow(i32),
     NiceEquals(i32),
+    UidEquals(u32),
+    GidEquals(u32),
+    CgroupIdEquals(u64),
+    ExecPath(String),
+    IsKthread(bool),
+    IsGroupLeader(bool),
 }
 
 #[derive(Clone, Debug, Serialize, Deserialize)]
@@ -339,6 +460,8 @@ enum LayerKind {
         #[serde(default)]
         cpus_range: Option<(usize, usize)>,
         #[serde(default)]
+        llc_isolate_misses: f64,
+        #[serde(default)]
         min_exec_us: u64,
         #[serde(default)]
         yield_ignore: f64,
@@ -356,6 +479,8 @@ enum LayerKind {
         #[serde(default)]
         cpus_range: Option<(usize, usize)>,
         #[serde(default)]
+        llc_isolate_misses: f64,
+        #[serde(default)]
         min_exec_us: u64,
         #[serde(default)]
         yield_ignore: f64,
@@ -424,68 +549,6 @@ fn now_monotonic() -> u64 {
     time.tv_sec as u64 * 1_000_000_000 + time.tv_nsec as u64
 }
 
-fn read_total_cpu(reader: &procfs::ProcReader) -> Result<procfs::CpuStat> {
-    reader
-        .read_stat()
-        .context("Failed to read procfs")?
-        .total_cpu
-        .ok_or_else(|| anyhow!("Could not read total cpu stat in proc"))
-}
-
-fn calc_util(curr: &procfs::CpuStat, prev: &procfs::CpuStat) -> Result<f64> {
-    match (curr, prev) {
-        (
-            procfs::CpuStat {
-                user_usec: Some(curr_user),
-                nice_usec: Some(curr_nice),
-                system_usec: Some(curr_system),
-                idle_usec: Some(curr_idle),
-                iowait_usec: Some(curr_iowait),
-                irq_usec: Some(curr_irq),
-                softirq_usec: Some(curr_softirq),
-                stolen_usec: Some(curr_stolen),
-                ..
-            },
-            procfs::CpuStat {
-                user_usec: Some(prev_user),
-                nice_usec: Some(prev_nice),
-                system_usec: Some(prev_system),
-                idle_usec: Some(prev_idle),
-                iowait_usec: Some(prev_iowait),
-                irq_usec: Some(prev_irq),
-                softirq_usec: Some(prev_softirq),
-                stolen_usec: Some(prev_stolen),
-                ..
-            },
-        ) => {
-            let idle_usec = curr_idle.saturating_sub(*prev_idle);
-            let iowait_usec = curr_iowait.saturating_sub(*prev_iowait);
-            let user_usec = curr_user.saturating_sub(*prev_user);
-            let system_usec = curr_system.saturating_sub(*prev_system);
-            let nice_usec = curr_nice.saturating_sub(*prev_nice);
-            let irq_usec = curr_irq.saturating_sub(*prev_irq);
-            let softirq_usec = curr_softirq.saturating_sub(*prev_softirq);
-            let stolen_usec = curr_stolen.saturating_sub(*prev_stolen);
-
-            let busy_usec =
-                user_usec + system_usec + nice_usec + irq_usec + softirq_usec + stolen_usec;
-            let total_usec = idle_usec + busy_usec + iowait_usec;
-            if total_usec > 0 {
-                Ok(((busy_usec as f64) / (total_usec as f64)).clamp(0.0, 1.0))
-            } else {
-                Ok(1.0)
-            }
-        }
-        _ => bail!("Missing stats in cpustat"),
-    }
-}
-
-fn copy_into_cstr(dst: &mut [i8], src: &str) {
-    let cstr = CString::new(src).unwrap();
-    let bytes = unsafe { std::mem::transmute::<&[u8], &[i8]>(cstr.as_bytes_with_nul()) };
-    dst[0..bytes.len()].copy_from_slice(bytes);
-}
-
 fn format_bitvec(bitvec: &BitVec) -> String {
     let mut vals = Vec::<u32>::new();
     let mut val: u32 = 0;
@@ -591,8 +654,12 @@ struct Stats {
     layer_utils: Vec<f64>,
     prev_layer_cycles: Vec<u64>,
 
-    cpu_busy: f64, // Read from /proc, maybe higher than total_util
-    prev_total_cpu: procfs::CpuStat,
+    layer_llc_miss_rates: Vec<f64>, // LLC misses per msec of CPU time
+    layer_membws: Vec<f64>,         // Estimated memory bandwidth in bytes/sec
+
+    cpu_busy: f64, // Read from BPF, all sched classes and irqs, >= total_util
+    cpu_util: CpuUtilTracker,
+    excl_idle_util: f64, // CPUs kept idle for exclusive siblings
 
     bpf_stats: BpfStats,
     prev_bpf_stats: BpfStats,
@@ -634,9 +701,33 @@ impl Stats {
         layer_cycles
     }
 
-    fn new(skel: &mut BpfSkel, proc_reader: &procfs::ProcReader) -> Result<Self> {
+    fn read_cpu_busy(skel: &BpfSkel, cpu_util: &mut CpuUtilTracker) -> f64 {
+        let cpu_utils = &skel.bss().cpu_utils;
+        let utils = cpu_util.update(now_monotonic(), |cpu| {
+            let cud = &cpu_utils[cpu].util;
+            (cud.busy_ns, cud.running_at)
+        });
+
+        let all_cpus = &skel.rodata().all_cpus;
+        let (mut busy_sum, mut nr_cpus) = (0.0, 0);
+        for (cpu, util) in utils.iter().enumerate() {
+            if all_cpus[cpu / 8] & (1 << (cpu % 8)) != 0 {
+                busy_sum += util;
+                nr_cpus += 1;
+            }
+        }
+
+        match nr_cpus {
+            0 => 0.0,
+            nr => busy_sum / nr as f64,
+        }
+    }
+
+    fn new(skel: &mut BpfSkel) -> Result<Self> {
         let nr_layers = skel.rodata().nr_layers as usize;
         let bpf_stats = BpfStats::read(&read_cpu_ctxs(skel)?, nr_layers);
+        let mut cpu_util = CpuUtilTracker::new(*NR_POSSIBLE_CPUS);
+        Self::read_cpu_busy(skel, &mut cpu_util);
 
         Ok(Self {
             at: Instant::now(),
@@ -651,20 +742,19 @@ impl Stats {
             layer_utils: vec![0.0; nr_layers],
             prev_layer_cycles: vec![0; nr_layers],
 
+            layer_llc_miss_rates: vec![0.0; nr_layers],
+            layer_membws: vec![0.0; nr_layers],
+
             cpu_busy: 0.0,
-            prev_total_cpu: read_total_cpu(&proc_reader)?,
+            cpu_util,
+            excl_idle_util: 0.0,
 
             bpf_stats: bpf_stats.clone(),
             prev_bpf_stats: bpf_stats,
         })
     }
 
-    fn refresh(
-        &mut self,
-        skel: &mut BpfSkel,
-        proc_reader: &procfs::ProcReader,
-        now: Instant,
-    ) -> Result<()> {
+    fn refresh(&mut self, skel: &mut BpfSkel, now: Instant) -> Result<()> {
         let elapsed = now.duration_since(self.at).as_secs_f64() as f64;
         let cpu_ctxs = read_cpu_ctxs(skel)?;
 
@@ -693,12 +783,31 @@ impl Stats {
             })
             .collect();
 
-        let cur_total_cpu = read_total_cpu(proc_reader)?;
-        let cpu_busy = calc_util(&cur_total_cpu, &self.prev_total_cpu)?;
+        let cpu_busy = Self::read_cpu_busy(skel, &mut self.cpu_util);
 
         let cur_bpf_stats = BpfStats::read(&cpu_ctxs, self.nr_layers);
         let bpf_stats = &cur_bpf_stats - &self.prev_bpf_stats;
 
+        let layer_llc_misses: Vec<u64> = bpf_stats
+            .lstats
+            .iter()
+            .map(|lstats| lstats[bpf_intf::layer_stat_idx_LSTAT_LLC_MISS as usize])
+            .collect();
+        let layer_llc_miss_rates: Vec<f64> = layer_llc_misses
+            .iter()
+            .zip(cur_layer_cycles.iter().zip(self.prev_layer_cycles.iter()))
+            .map(|(misses, (cur, prev))| match cur - prev {
+                0 => 0.0,
+                cycles => *misses as f64 / (cycles as f64 / 1_000_000.0),
+            })
+            .collect();
+        let layer_membws: Vec<f64> = layer_llc_misses
+            .iter()
+            .map(|misses| (misses * CACHELINE_SIZE as u64) as f64 / elapsed)
+            .collect();
+        let excl_idle_ns = bpf_stats.gstats[bpf_intf::global_stat_idx_GSTAT_EXCL_IDLE_NS as usize];
+        let excl_idle_util = excl_idle_ns as f64 / 1_000_000_000.0 / elapsed;
+
         *self = Self {
             at: now,
             nr_layers: self.nr_layers,
@@ -712,8 +821,12 @@ impl Stats {
             layer_utils: layer_utils.try_into().unwrap(),
             prev_layer_cycles: cur_layer_cycles,
 
+            layer_llc_miss_rates,
+            layer_membws,
+
             cpu_busy,
-            prev_total_cpu: cur_total_cpu,
+            cpu_util: std::mem::take(&mut self.cpu_util),
+            excl_idle_util,
 
             bpf_stats,
             prev_bpf_stats: cur_bpf_stats,
@@ -730,6 +843,10 @@ struct CpuPool {
     core_cpus: Vec<BitVec>,
     sibling_cpu: Vec<i32>,
     cpu_core: Vec<usize>,
+    nr_llcs: usize,
+    cpu_llc: Vec<usize>,
+    core_llc: Vec<usize>,
+    llc_node: Vec<usize>,
     available_cores: BitVec,
     first_cpu: usize,
     fallback_cpu: usize, // next free or the first CPU if none is free
@@ -812,9 +929,33 @@ impl CpuPool {
             }
         }
 
+        // Build cpu -> LLC mapping with consecutive LLC IDs.
+        let topo = Topology::new()?;
+        let mut nr_llcs = 0;
+        let mut cpu_llc = vec![0; *NR_POSSIBLE_CPUS];
+        let mut llc_node = vec![];
+        for node in topo.nodes().iter() {
+            for llc in node.llcs().values() {
+                for cpu in llc.span().as_raw_bitvec().iter_ones() {
+                    if cpu < *NR_POSSIBLE_CPUS {
+                        cpu_llc[cpu] = nr_llcs;
+                    }
+                }
+                llc_node.push(node.id());
+                nr_llcs += 1;
+            }
+        }
+        if nr_llcs > MAX_LLCS {
+            bail!("nr_llcs {} > MAX_LLCS {}", nr_llcs, MAX_LLCS);
+        }
+        let core_llc: Vec<usize> = core_cpus
+            .iter()
+            .map(|cpus| cpu_llc[cpus.first_one().unwrap()])
+            .collect();
+
         info!(
-            "CPUs: online/possible={}/{} nr_cores={}",
-            nr_cpus, *NR_POSSIBLE_CPUS, nr_cores,
+            "CPUs: online/possible={}/{} nr_cores={} nr_llcs={}",
+            nr_cpus, *NR_POSSIBLE_CPUS, nr_cores, nr_llcs,
         );
         debug!("CPUs: siblings={:?}", &sibling_cpu[..nr_cpus]);
 
@@ -827,6 +968,10 @@ impl CpuPool {
             core_cpus,
             sibling_cpu,
             cpu_core,
+            nr_llcs,
+            cpu_llc,
+            core_llc,
+            llc_node,
             available_cores: bitvec![1; nr_cores],
             first_cpu,
             fallback_cpu: first_cpu,
@@ -842,8 +987,50 @@ impl CpuPool {
         }
     }
 
-    fn alloc<'a>(&'a mut self) -> Option<&'a BitVec> {
-        let core = self.available_cores.first_one()?;
+    /// Number of @cpus in each LLC.
+    fn llc_weights(&self, cpus: &BitVec) -> Vec<usize> {
+        let mut weights = vec![0; self.nr_llcs];
+        for cpu in cpus.iter_ones() {
+            weights[self.cpu_llc[cpu]] += 1;
+        }
+        weights
+    }
+
+    /// Allocate a free core for a layer which currently owns @layer_cpus.
+    /// Cores are picked to keep the layer packed: first from the LLCs the
+    /// layer already occupies, most occupied first, then from the NUMA node
+    /// where most of the layer's CPUs are and thus where its tasks' memory
+    /// most likely lives. Among otherwise equal candidates, LLCs with more
+    /// free cores are preferred so that the layer has room to grow in place.
+    /// Cores in the LLCs marked in @avoid_llcs are never allocated.
+    fn alloc<'a>(&'a mut self, layer_cpus: &BitVec, avoid_llcs: &[bool]) -> Option<&'a BitVec> {
+        let layer_llcs = self.llc_weights(layer_cpus);
+        let free_llcs = self.llc_weights(&self.available_cpus());
+
+        let mut layer_nodes = BTreeMap::<usize, usize>::new();
+        for (llc, weight) in layer_llcs.iter().enumerate() {
+            *layer_nodes.entry(self.llc_node[llc]).or_insert(0) += weight;
+        }
+        let pref_node = layer_nodes
+            .iter()
+            .filter(|(_, weight)| **weight > 0)
+            .max_by_key(|(_, weight)| **weight)
+            .map(|(node, _)| *node);
+
+        let core = self
+            .available_cores
+            .iter_ones()
+            .filter(|core| !avoid_llcs[self.core_llc[*core]])
+            .max_by_key(|core| {
+                let llc = self.core_llc[*core];
+                (
+                    layer_llcs[llc],
+                    Some(self.llc_node[llc]) == pref_node,
+                    free_llcs[llc],
+                    std::cmp::Reverse(*core),
+                )
+            })?;
+
         self.available_cores.set(core, false);
         self.update_fallback_cpu();
         Some(&self.core_cpus[core])
@@ -882,8 +1069,20 @@ impl CpuPool {
         Ok(())
     }
 
-    fn next_to_free<'a>(&'a self, cands: &BitVec) -> Result<Option<&'a BitVec>> {
-        let last = match cands.last_one() {
+    /// Pick the core to take away from a layer which owns @cands. The
+    /// victim comes from the LLCs marked in @avoid_llcs first and then from
+    /// the LLC where the layer has the fewest CPUs so that the layer shrinks
+    /// back into the LLCs it mostly occupies.
+    fn next_to_free<'a>(
+        &'a self,
+        cands: &BitVec,
+        avoid_llcs: &[bool],
+    ) -> Result<Option<&'a BitVec>> {
+        let layer_llcs = self.llc_weights(cands);
+        let last = match cands.iter_ones().max_by_key(|cpu| {
+            let llc = self.cpu_llc[*cpu];
+            (avoid_llcs[llc], std::cmp::Reverse(layer_llcs[llc]), *cpu)
+        }) {
             Some(ret) => ret,
             None => return Ok(None),
         };
@@ -909,6 +1108,67 @@ impl CpuPool {
     }
 }
 
+#[derive(Clone, Debug)]
+struct ForecastParams {
+    alpha: f64,
+    beta: f64,
+    horizon: usize,
+}
+
+/// Forecast of a layer's utilization using Holt's linear exponential
+/// smoothing, updated every scheduling interval.
+#[derive(Debug, Default)]
+struct UtilForecast {
+    level: f64,
+    trend: f64,
+    primed: bool,
+    // Forecasts made for the upcoming intervals, the oldest first.
+    pending: VecDeque<f64>,
+    // Absolute error of the forecast which came due in the last update.
+    error: f64,
+    // The larger of the current and the forecast utilization over the last
+    // horizon intervals, the oldest first.
+    recent: VecDeque<f64>,
+}
+
+impl UtilForecast {
+    /// Update with the utilization @util of the last interval and return
+    /// the utilization the layer should be sized for: the highest of the
+    /// current and the forecast utilization over the last horizon
+    /// intervals, so that a falling trend shrinks the layer only once it has
+    /// lasted that long.
+    fn update(&mut self, util: f64, params: &ForecastParams) -> f64 {
+        if self.primed {
+            let prev_level = self.level;
+            self.level = params.alpha * util + (1.0 - params.alpha) * (self.level + self.trend);
+            self.trend = params.beta * (self.level - prev_level) + (1.0 - params.beta) * self.trend;
+        } else {
+            self.level = util;
+            self.trend = 0.0;
+            self.primed = true;
+        }
+
+        if self.pending.len() >= params.horizon {
+            if let Some(forecast) = self.pending.pop_front() {
+                self.error = (forecast - util).abs();
+            }
+        }
+
+        let forecast = (self.level + self.trend * params.horizon as f64).max(0.0);
+        self.pending.push_back(forecast);
+
+        if self.recent.len() >= params.horizon {
+            self.recent.pop_front();
+        }
+        self.recent.push_back(util.max(forecast));
+        self.recent.iter().copied().fold(0.0, f64::max)
+    }
+
+    fn forecast(&self) -> f64 {
+        self.pending.back().copied().unwrap_or(0.0)
+    }
+}
+
 #[derive(Debug)]
 struct Layer {
     name: String,
@@ -916,6 +1176,7 @@ struct Layer {
 
     nr_cpus: usize,
     cpus: BitVec,
+    llc_isolated: bool,
 }
 
 impl Layer {
@@ -950,6 +1211,7 @@ impl Layer {
 
             nr_cpus: 0,
             cpus: bitvec![0; nr_cpus],
+            llc_isolated: false,
         })
     }
 
@@ -961,6 +1223,7 @@ impl Layer {
         (layer_load, total_load): (f64, f64),
         (layer_util, _total_util): (f64, f64),
         no_load_frac_limit: bool,
+        avoid_llcs: &[bool],
     ) -> Result<bool> {
         if self.nr_cpus >= cpus_max {
             return Ok(false);
@@ -988,7 +1251,7 @@ impl Layer {
             return Ok(false);
         }
 
-        let new_cpus = match cpu_pool.alloc().clone() {
+        let new_cpus = match cpu_pool.alloc(&self.cpus, avoid_llcs).clone() {
             Some(ret) => ret.clone(),
             None => {
                 trace!("layer-{} can't grow, no CPUs", &self.name);
@@ -1016,12 +1279,13 @@ impl Layer {
         (layer_load, total_load): (f64, f64),
         (layer_util, _total_util): (f64, f64),
         no_load_frac_limit: bool,
+        avoid_llcs: &[bool],
     ) -> Result<Option<BitVec>> {
         if self.nr_cpus <= cpus_min {
             return Ok(None);
         }
 
-        let cpus_to_free = match cpu_pool.next_to_free(&self.cpus)? {
+        let cpus_to_free = match cpu_pool.next_to_free(&self.cpus, avoid_llcs)? {
             Some(ret) => ret.clone(),
             None => return Ok(None),
         };
@@ -1067,6 +1331,7 @@ impl Layer {
         load: (f64, f64),
         util: (f64, f64),
         no_load_frac_limit: bool,
+        avoid_llcs: &[bool],
     ) -> Result<bool> {
         match self.cpus_to_free(
             cpu_pool,
@@ -1075,6 +1340,7 @@ impl Layer {
             load,
             util,
             no_load_frac_limit,
+            avoid_llcs,
         )? {
             Some(cpus_to_free) => {
                 trace!("freeing CPUs {}", &cpus_to_free);
@@ -1095,6 +1361,7 @@ impl Layer {
         load: (f64, f64),
         util: (f64, f64),
         no_load_frac_limit: bool,
+        avoid_llcs: &[bool],
     ) -> Result<i64> {
         let cpus_range = cpus_range.unwrap_or((0, std::usize::MAX));
         let mut adjusted = 0;
@@ -1106,6 +1373,7 @@ impl Layer {
             load,
             util,
             no_load_frac_limit,
+            avoid_llcs,
         )? {
             adjusted += 1;
             trace!("{} grew, adjusted={}", &self.name, adjusted);
@@ -1119,6 +1387,7 @@ impl Layer {
                 load,
                 util,
                 no_load_frac_limit,
+                avoid_llcs,
             )? {
                 adjusted -= 1;
                 trace!("{} shrunk, adjusted={}", &self.name, adjusted);
@@ -1134,19 +1403,22 @@ impl Layer {
 
 #[derive(Default)]
 struct OpenMetricsStats {
-    registry: Registry,
+    registry: Arc<Registry>,
     total: Gauge<i64, AtomicI64>,
     local: Gauge<f64, AtomicU64>,
     open_idle: Gauge<f64, AtomicU64>,
     affn_viol: Gauge<f64, AtomicU64>,
     excl_idle: Gauge<f64, AtomicU64>,
     excl_wakeup: Gauge<f64, AtomicU64>,
+    excl_idle_util: Gauge<f64, AtomicU64>,
     proc_ms: Gauge<i64, AtomicI64>,
     busy: Gauge<f64, AtomicU64>,
     util: Gauge<f64, AtomicU64>,
     load: Gauge<f64, AtomicU64>,
     l_util: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_util_frac: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_util_forecast: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_util_forecast_err: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_load: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_load_frac: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_tasks: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
@@ -1163,6 +1435,7 @@ struct OpenMetricsStats {
     l_preempt_first: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_preempt_idle: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_preempt_fail: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_preempt_cands: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_affn_viol: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_keep: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_keep_fail_max_exec: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
@@ -1173,6 +1446,10 @@ struct OpenMetricsStats {
     l_yield: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
     l_yield_ignore: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
     l_migration: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_xllc_migration: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_llc_miss: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_membw: Family<Vec<(String, String)>, Gauge<f64, AtomicU64>>,
+    l_llc_isolated: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
     l_cur_nr_cpus: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
     l_min_nr_cpus: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
     l_max_nr_cpus: Family<Vec<(String, String)>, Gauge<i64, AtomicI64>>,
@@ -1180,18 +1457,14 @@ struct OpenMetricsStats {
 
 impl OpenMetricsStats {
     fn new() -> OpenMetricsStats {
-        let mut metrics = OpenMetricsStats {
-            registry: <Registry>::default(),
-            ..Default::default()
-        };
+        let mut registry = <Registry>::default();
+        let mut metrics = OpenMetricsStats::default();
         // Helper macro to reduce on some of the boilerplate:
         // $i: The identifier of the metric to register
         // $help: The Help text associated with the metric
         macro_rules! register {
             ($i:ident, $help:expr) => {
-                metrics
-                    .registry
-                    .register(stringify!($i), $help, metrics.$i.clone())
+                registry.register(stringify!($i), $help, metrics.$i.clone())
             };
         }
         register!(total, "Total scheduling events in the period");
@@ -1212,6 +1485,10 @@ impl OpenMetricsStats {
             excl_wakeup,
             "Number of times an idle sibling CPU was woken up after an exclusive task is finished"
         );
+        register!(
+            excl_idle_util,
+            "CPU time % sibling CPUs were kept idle for exclusive tasks (100% means one CPU)"
+        );
         register!(
             proc_ms,
             "CPU time this binary has consumed during the period"
@@ -1230,6 +1507,14 @@ impl OpenMetricsStats {
             l_util_frac,
             "Fraction of total CPU utilization consumed by the layer"
         );
+        register!(
+            l_util_forecast,
+            "Forecast CPU utilization of the layer with --forecast"
+        );
+        register!(
+            l_util_forecast_err,
+            "Absolute error of the CPU utilization forecast which came due last"
+        );
         register!(l_load, "Sum of weight * duty_cycle for tasks in the layer");
         register!(l_load_frac, "Fraction of total load consumed by the layer");
         register!(l_tasks, "Number of tasks in the layer");
@@ -1282,6 +1567,10 @@ impl OpenMetricsStats {
             l_preempt_fail,
             "% of scheduling events that attempted to preempt other tasks but failed"
         );
+        register!(
+            l_preempt_cands,
+            "Average # of candidate CPUs tried per preemption scan"
+        );
         register!(
             l_affn_viol,
             "% of scheduling events that violated configured policies due to CPU affinity restrictions"
@@ -1313,26 +1602,53 @@ impl OpenMetricsStats {
         register!(l_yield, "% of scheduling events that yielded");
         register!(l_yield_ignore, "Number of times yield was ignored");
 	register!(l_migration, "% of scheduling events that migrated across CPUs");
+        register!(
+            l_xllc_migration,
+            "% of scheduling events that migrated across LLCs"
+        );
+        register!(
+            l_llc_miss,
+            "LLC misses per msec of CPU time with --llc-miss-stats"
+        );
+        register!(
+            l_membw,
+            "Memory bandwidth in MiB/s estimated from LLC misses with --llc-miss-stats"
+        );
+        register!(
+            l_llc_isolated,
+            "Whether the layer is isolated from the other layers' LLCs"
+        );
         register!(l_cur_nr_cpus, "Current # of CPUs assigned to the layer");
         register!(l_min_nr_cpus, "Minimum # of CPUs assigned to the layer");
         register!(l_max_nr_cpus, "Maximum # of CPUs assigned to the layer");
+
+        // Registration is done. Once published, the registry is only read by
+        // the exporter thread.
+        metrics.registry = Arc::new(registry);
         metrics
     }
 }
 
-struct Scheduler<'a, 'b> {
+struct Scheduler<'a> {
     skel: BpfSkel<'a>,
     struct_ops: Option<libbpf_rs::Link>,
-    layer_specs: &'b Vec<LayerSpec>,
+    layer_specs: Vec<LayerSpec>,
+    spec_inputs: Vec<String>,
+    spec_mtimes: Option<Vec<Option<SystemTime>>>, // with --watch-specs
+    slice_us: u64,
 
     sched_intv: Duration,
     monitor_intv: Duration,
     no_load_frac_limit: bool,
+    forecast: Option<ForecastParams>,
+    util_forecasts: Vec<UtilForecast>,
+    llc_miss_enabled: bool,
+    _llc_miss_counters: Vec<OwnedFd>, // referenced by llc_miss_events
+    match_keys: [Vec<(u32, u64)>; 2], // match_keys entries of each table
 
     cpu_pool: CpuPool,
     layers: Vec<Layer>,
 
-    proc_reader: procfs::ProcReader,
     sched_stats: Stats,
     report_stats: Stats,
 
@@ -1340,52 +1656,95 @@ struct Scheduler<'a, 'b> {
     processing_dur: Duration,
     prev_processing_dur: Duration,
 
+    // The stats being filled by report() and, with --stats-listen, the
+    // previous interval's snapshot which the exporter may be encoding.
     om_stats: OpenMetricsStats,
+    om_stats_prev: OpenMetricsStats,
     om_format: bool,
+    stats_buf: Option<Arc<StatsBuffer>>,
 }
 
-impl<'a, 'b> Scheduler<'a, 'b> {
-    fn init_layers(skel: &mut OpenBpfSkel, opts: &Opts, specs: &Vec<LayerSpec>) -> Result<()> {
-        skel.rodata_mut().nr_layers = specs.len() as u32;
+impl<'a> Scheduler<'a> {
+    fn write_match_table(mt: &mut bpf_types::match_table, table: &MatchTable) {
+        mt.nr_rules = table.rule_layer.len() as u32;
+        mt.rule_layer[..table.rule_layer.len()].copy_from_slice(&table.rule_layer);
+        mt.trie_root = table.trie_root;
+        mt.trie_none = table.trie_none;
+        mt.nr_keys = table.nr_keys;
+        mt.key_none = table.key_none;
+        mt.nice_masks = table.nice_masks;
+        mt.prop_masks = table.prop_masks;
+        mt.accept_masks[..table.accept_masks.len()].copy_from_slice(&table.accept_masks);
+
+        for (i, node) in table.nodes.iter().enumerate() {
+            let dst = &mut mt.nodes[i];
+            dst.child = node.child;
+            dst.sibling = node.sibling;
+            dst.accept = node.accept;
+            dst.c = node.c as _;
+        }
+
+        debug!(
+            "Compiled layer matches into {} rules, {} trie nodes, {} accept masks and {} keys",
+            table.rule_layer.len(),
+            table.nodes.len(),
+            table.accept_masks.len(),
+            table.keys.len()
+        );
+    }
+
+    fn match_key_bytes(table_idx: u32, kind: u32, val: u64) -> Vec<u8> {
+        let mut key = vec![];
+        key.extend_from_slice(&table_idx.to_ne_bytes());
+        key.extend_from_slice(&kind.to_ne_bytes());
+        key.extend_from_slice(&val.to_ne_bytes());
+        key
+    }
+
+    /// Replace the match_keys entries of match_tables[@table_idx] with the
+    /// keys of @table. @installed tracks the current entries.
+    fn install_match_keys(
+        skel: &mut BpfSkel,
+        table_idx: u32,
+        table: &MatchTable,
+        installed: &mut Vec<(u32, u64)>,
+    ) -> Result<()> {
+        for (kind, val) in installed.drain(..) {
+            skel.maps_mut()
+                .match_keys()
+                .delete(&Self::match_key_bytes(table_idx, kind, val))
+                .context("Failed to delete match key")?;
+        }
+
+        for ((kind, val), mask) in table.keys.iter() {
+            let mask: Vec<u8> = mask.iter().flat_map(|w| w.to_ne_bytes()).collect();
+            skel.maps_mut()
+                .match_keys()
+                .update(
+                    &Self::match_key_bytes(table_idx, *kind, *val),
+                    &mask,
+                    libbpf_rs::MapFlags::ANY,
+                )
+                .context("Failed to install match key")?;
+            installed.push((*kind, *val));
+        }
+        Ok(())
+    }
+
+    /// Write the per-layer policies of @specs into @bss, and the layer lists
+    /// dispatch walks into the copy at @lists_idx. Used both before load and
+    /// when reloading the specs, so this must not touch the layers' runtime
+    /// state. Returns whether any layer has perf configured.
+    fn write_layer_configs(
+        bss: &mut bpf_types::bss,
+        slice_us: u64,
+        specs: &[LayerSpec],
+        lists_idx: usize,
+    ) -> bool {
         let mut perf_set = false;
 
         for (spec_i, spec) in specs.iter().enumerate() {
-            let layer = &mut skel.bss_mut().layers[spec_i];
-
-            for (or_i, or) in spec.matches.iter().enumerate() {
-                for (and_i, and) in or.iter().enumerate() {
-                    let mt = &mut layer.matches[or_i].matches[and_i];
-                    match and {
-                        LayerMatch::CgroupPrefix(prefix) => {
-                            mt.kind = bpf_intf::layer_match_kind_MATCH_CGROUP_PREFIX as i32;
-                            copy_into_cstr(&mut mt.cgroup_prefix, prefix.as_str());
-                        }
-                        LayerMatch::CommPrefix(prefix) => {
-                            mt.kind = bpf_intf::layer_match_kind_MATCH_COMM_PREFIX as i32;
-                            copy_into_cstr(&mut mt.comm_prefix, prefix.as_str());
-                        }
-                        LayerMatch::PcommPrefix(prefix) => {
-                            mt.kind = bpf_intf::layer_match_kind_MATCH_PCOMM_PREFIX as i32;
-                            copy_into_cstr(&mut mt.pcomm_prefix, prefix.as_str());
-                        }
-                        LayerMatch::NiceAbove(nice) => {
-                            mt.kind = bpf_intf::layer_match_kind_MATCH_NICE_ABOVE as i32;
-                            mt.nice = *nice;
-                        }
-                        LayerMatch::NiceBelow(nice) => {
-                            mt.kind = bpf_intf::layer_match_kind_MATCH_NICE_BELOW as i32;
-                            mt.nice = *nice;
-                        }
-                        LayerMatch::NiceEquals(nice) => {
-                            mt.kind = bpf_intf::layer_match_kind_MATCH_NICE_EQUALS as i32;
-                            mt.nice = *nice;
-                        }
-                    }
-                }
-                layer.matches[or_i].nr_match_ands = or.len() as i32;
-            }
-
-            layer.nr_match_ors = spec.matches.len() as u32;
+            let layer = &mut bss.layers[spec_i];
 
             match &spec.kind {
                 LayerKind::Confined {
@@ -1419,25 +1778,77 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                     layer.yield_step_ns = if *yield_ignore > 0.999 {
                         0
                     } else if *yield_ignore < 0.001 {
-                        opts.slice_us * 1000
+                        slice_us * 1000
                     } else {
-                        ((opts.slice_us * 1000) as f64 * (1.0 - *yield_ignore)) as u64
+                        ((slice_us * 1000) as f64 * (1.0 - *yield_ignore)) as u64
                     };
                     layer.preempt.write(*preempt);
                     layer.preempt_first.write(*preempt_first);
                     layer.exclusive.write(*exclusive);
-                    layer.perf = u32::try_from(*perf)?;
+                    layer.perf = *perf as u32;
                 }
             }
 
+            layer.open.write(match &spec.kind {
+                LayerKind::Open { .. } | LayerKind::Grouped { .. } => true,
+                LayerKind::Confined { .. } => false,
+            });
+
+            perf_set |= layer.perf > 0;
+        }
+
+        // Layers which are consumed from regardless of the CPU. On reload,
+        // @lists_idx is the copy dispatch isn't reading.
+        let (mut nr_preempt, mut nr_open) = (0, 0);
+        for (idx, spec) in specs.iter().enumerate() {
+            let (preempt, open) = match &spec.kind {
+                LayerKind::Confined { preempt, .. } => (*preempt, false),
+                LayerKind::Grouped { preempt, .. } | LayerKind::Open { preempt, .. } => {
+                    (*preempt, true)
+                }
+            };
+            if preempt {
+                bss.preempt_layers[lists_idx][nr_preempt] = idx as u32;
+                nr_preempt += 1;
+            } else if open {
+                bss.open_layers[lists_idx][nr_open] = idx as u32;
+                nr_open += 1;
+            }
+        }
+        bss.nr_preempt_layers[lists_idx] = nr_preempt as u32;
+        bss.nr_open_layers[lists_idx] = nr_open as u32;
+
+        perf_set
+    }
+
+    fn init_layers(
+        skel: &mut OpenBpfSkel,
+        opts: &Opts,
+        specs: &Vec<LayerSpec>,
+        match_table: &MatchTable,
+    ) -> Result<()> {
+        skel.rodata_mut().nr_layers = specs.len() as u32;
+
+        Self::write_match_table(&mut skel.bss_mut().match_tables[0], match_table);
+        let perf_set = Self::write_layer_configs(skel.bss_mut(), opts.slice_us, specs, 0);
+
+        // The DSQ layout is fixed once loaded and isn't changed by reloads.
+        for (spec_i, spec) in specs.iter().enumerate() {
             match &spec.kind {
-                LayerKind::Open { .. } | LayerKind::Grouped { .. } => {
-                    layer.open.write(true);
+                LayerKind::Confined { .. } | LayerKind::Grouped { .. } => {
+                    skel.bss_mut().layers[spec_i].llc_dsqs.write(true);
                 }
                 _ => {}
             }
+        }
 
-            perf_set |= layer.perf > 0;
+        // All layers start with full cpumasks until the first refresh.
+        for cpu in 0..*NR_POSSIBLE_CPUS {
+            let cd = &mut skel.bss_mut().cpu_dispatch[cpu];
+            for idx in 0..specs.len() {
+                cd.layers[idx] = idx as u8;
+            }
+            cd.nr_layers = specs.len() as u32;
         }
 
         if perf_set && !compat::ksym_exists("scx_bpf_cpuperf_set")? {
@@ -1447,7 +1858,11 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         Ok(())
     }
 
-    fn init(opts: &Opts, layer_specs: &'b Vec<LayerSpec>) -> Result<Self> {
+    fn init(
+        opts: &Opts,
+        layer_specs: &Vec<LayerSpec>,
+        stats_buf: Option<Arc<StatsBuffer>>,
+    ) -> Result<Self> {
         let nr_layers = layer_specs.len();
         let mut cpu_pool = CpuPool::new()?;
 
@@ -1486,41 +1901,104 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         for cpu in cpu_pool.all_cpus.iter_ones() {
             skel.rodata_mut().all_cpus[cpu / 8] |= 1 << (cpu % 8);
         }
-        Self::init_layers(&mut skel, opts, layer_specs)?;
+        skel.rodata_mut().nr_llcs = cpu_pool.nr_llcs as u32;
+        for (cpu, llc) in cpu_pool.cpu_llc.iter().enumerate() {
+            skel.rodata_mut().cpu_llc_id[cpu] = *llc as u32;
+        }
+        let match_table = MatchTable::compile(layer_specs)?;
+        Self::init_layers(&mut skel, opts, layer_specs, &match_table)?;
+
+        let llc_miss_stats = opts.llc_miss_stats
+            || layer_specs.iter().any(|spec| match &spec.kind {
+                LayerKind::Confined {
+                    llc_isolate_misses, ..
+                }
+                | LayerKind::Grouped {
+                    llc_isolate_misses, ..
+                } => *llc_isolate_misses > 0.0,
+                LayerKind::Open { .. } => false,
+            });
+        let mut llc_miss_counters = vec![];
+        if llc_miss_stats {
+            match cpu_pool
+                .all_cpus
+                .iter_ones()
+                .map(|cpu| Ok((cpu, perf::open_llc_miss_counter(cpu)?)))
+                .collect::<Result<Vec<_>>>()
+            {
+                Ok(counters) => llc_miss_counters = counters,
+                Err(e) => warn!("LLC miss counters not available, ignoring ({})", &e),
+            }
+        }
+        skel.rodata_mut().llc_miss_enabled = !llc_miss_counters.is_empty();
 
         let mut skel = scx_ops_load!(skel, layered, uei)?;
 
+        for (cpu, counter) in llc_miss_counters.iter() {
+            skel.maps_mut()
+                .llc_miss_events()
+                .update(
+                    &(*cpu as u32).to_ne_bytes(),
+                    &(counter.as_raw_fd() as u32).to_ne_bytes(),
+                    libbpf_rs::MapFlags::ANY,
+                )
+                .with_context(|| format!("Failed to install LLC miss counter for CPU {}", cpu))?;
+        }
+
+        let mut match_keys = [vec![], vec![]];
+        Self::install_match_keys(&mut skel, 0, &match_table, &mut match_keys[0])?;
+
         let mut layers = vec![];
         for spec in layer_specs.iter() {
             layers.push(Layer::new(&mut cpu_pool, &spec.name, spec.kind.clone())?);
         }
 
         // Other stuff.
-        let proc_reader = procfs::ProcReader::new();
-
         let mut sched = Self {
             struct_ops: None,
-            layer_specs,
+            layer_specs: layer_specs.clone(),
+            spec_inputs: opts.specs.clone(),
+            spec_mtimes: match opts.watch_specs {
+                true => Some(spec_file_mtimes(&opts.specs)),
+                false => None,
+            },
+            slice_us: opts.slice_us,
 
             sched_intv: Duration::from_secs_f64(opts.interval),
             monitor_intv: Duration::from_secs_f64(opts.monitor),
             no_load_frac_limit: opts.no_load_frac_limit,
+            forecast: match opts.forecast {
+                true => Some(ForecastParams {
+                    alpha: opts.forecast_alpha,
+                    beta: opts.forecast_beta,
+                    horizon: opts.forecast_horizon.max(1),
+                }),
+                false => None,
+            },
+            util_forecasts: (0..nr_layers).map(|_| UtilForecast::default()).collect(),
+            llc_miss_enabled: !llc_miss_counters.is_empty(),
+            _llc_miss_counters: llc_miss_counters
+                .into_iter()
+                .map(|(_, counter)| counter)
+                .collect(),
+            match_keys,
 
             cpu_pool,
             layers,
 
-            sched_stats: Stats::new(&mut skel, &proc_reader)?,
-            report_stats: Stats::new(&mut skel, &proc_reader)?,
+            sched_stats: Stats::new(&mut skel)?,
+            report_stats: Stats::new(&mut skel)?,
 
             nr_layer_cpus_min_max: vec![(0, 0); nr_layers],
             processing_dur: Duration::from_millis(0),
             prev_processing_dur: Duration::from_millis(0),
 
-            proc_reader,
             skel,
 
             om_stats: OpenMetricsStats::new(),
+            om_stats_prev: OpenMetricsStats::new(),
             om_format: opts.open_metrics_format,
+            stats_buf,
         };
 
         // XXX If we try to refresh the cpumasks here before attaching, we
@@ -1547,9 +2025,82 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         bpf_layer.refresh_cpus = 1;
     }
 
+    fn update_bpf_cpu_dispatch(&mut self) {
+        let fallback_cpu = self.cpu_pool.fallback_cpu;
+
+        for cpu in 0..*NR_POSSIBLE_CPUS {
+            let cd = &mut self.skel.bss_mut().cpu_dispatch[cpu];
+            let mut nr_layers = 0;
+
+            for (idx, layer) in self.layers.iter().enumerate() {
+                let owned = layer.cpus.get(cpu).map_or(false, |bit| *bit);
+                if owned || (cpu == fallback_cpu && layer.nr_cpus == 0) {
+                    cd.layers[nr_layers] = idx as u8;
+                    nr_layers += 1;
+                }
+            }
+            cd.nr_layers = nr_layers as u32;
+        }
+    }
+
+    /// Isolate the layers whose LLC miss rate went over llc_isolate_misses
+    /// and lift the isolation once the rate has dropped well below it.
+    fn update_llc_isolation(&mut self) {
+        for (idx, layer) in self.layers.iter_mut().enumerate() {
+            let thresh = match &layer.kind {
+                LayerKind::Confined {
+                    llc_isolate_misses, ..
+                }
+                | LayerKind::Grouped {
+                    llc_isolate_misses, ..
+                } => *llc_isolate_misses,
+                LayerKind::Open { .. } => 0.0,
+            };
+            let rate = self.sched_stats.layer_llc_miss_rates[idx];
+            let isolated = thresh > 0.0
+                && match layer.llc_isolated {
+                    true => rate >= thresh * 0.75,
+                    false => rate > thresh,
+                };
+
+            if isolated != layer.llc_isolated {
+                debug!(
+                    "layer-{} {} LLC isolation, llc_miss={:.1}/ms",
+                    &layer.name,
+                    if isolated { "entering" } else { "leaving" },
+                    rate
+                );
+                layer.llc_isolated = isolated;
+            }
+        }
+    }
+
+    /// LLCs that layer @idx shouldn't grow into. An isolated layer avoids the
+    /// LLCs occupied by the other confined and grouped layers. The other
+    /// layers avoid the LLCs occupied by isolated layers.
+    fn avoid_llcs(&self, idx: usize) -> Vec<bool> {
+        let mut avoid = vec![false; self.cpu_pool.nr_llcs];
+        let isolated = self.layers[idx].llc_isolated;
+
+        for (other_idx, other) in self.layers.iter().enumerate() {
+            if other_idx == idx
+                || (!isolated && !other.llc_isolated)
+                || matches!(other.kind, LayerKind::Open { .. })
+            {
+                continue;
+            }
+            for cpu in other.cpus.iter_ones() {
+                avoid[self.cpu_pool.cpu_llc[cpu]] = true;
+            }
+        }
+        avoid
+    }
+
     fn refresh_cpumasks(&mut self) -> Result<()> {
         let mut updated = false;
 
+        self.update_llc_isolation();
+
         for idx in 0..self.layers.len() {
             match self.layers[idx].kind {
                 LayerKind::Confined {
@@ -1566,10 +2117,12 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                         self.sched_stats.layer_loads[idx],
                         self.sched_stats.total_load,
                     );
-                    let util = (
-                        self.sched_stats.layer_utils[idx],
-                        self.sched_stats.total_util,
-                    );
+                    let mut layer_util = self.sched_stats.layer_utils[idx];
+                    if let Some(params) = &self.forecast {
+                        layer_util = self.util_forecasts[idx].update(layer_util, params);
+                    }
+                    let util = (layer_util, self.sched_stats.total_util);
+                    let avoid_llcs = self.avoid_llcs(idx);
                     if self.layers[idx].resize_confined_or_grouped(
                         &mut self.cpu_pool,
                         cpus_range,
@@ -1577,6 +2130,7 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                         load,
                         util,
                         self.no_load_frac_limit,
+                        &avoid_llcs,
                     )? != 0
                     {
                         Self::update_bpf_layer_cpumask(
@@ -1591,38 +2145,149 @@ impl<'a, 'b> Scheduler<'a, 'b> {
         }
 
         if updated {
-            let available_cpus = self.cpu_pool.available_cpus();
-            let nr_available_cpus = available_cpus.count_ones();
-            for idx in 0..self.layers.len() {
-                let layer = &mut self.layers[idx];
-                let bpf_layer = &mut self.skel.bss_mut().layers[idx];
-                match &layer.kind {
-                    LayerKind::Open { .. } => {
-                        layer.cpus.copy_from_bitslice(&available_cpus);
-                        layer.nr_cpus = nr_available_cpus;
-                        Self::update_bpf_layer_cpumask(layer, bpf_layer);
-                    }
-                    _ => {}
+            self.update_open_cpumasks();
+        }
+
+        Ok(())
+    }
+
+    /// Open layers get all the CPUs which aren't owned by confined or grouped
+    /// layers. Propagate changes in the latter to the former and to the
+    /// per-CPU dispatch lists.
+    fn update_open_cpumasks(&mut self) {
+        let available_cpus = self.cpu_pool.available_cpus();
+        let nr_available_cpus = available_cpus.count_ones();
+        for idx in 0..self.layers.len() {
+            let layer = &mut self.layers[idx];
+            let bpf_layer = &mut self.skel.bss_mut().layers[idx];
+            match &layer.kind {
+                LayerKind::Open { .. } => {
+                    layer.cpus.copy_from_bitslice(&available_cpus);
+                    layer.nr_cpus = nr_available_cpus;
+                    Self::update_bpf_layer_cpumask(layer, bpf_layer);
                 }
+                _ => {}
             }
+        }
 
-            self.skel.bss_mut().fallback_cpu = self.cpu_pool.fallback_cpu as u32;
+        self.update_bpf_cpu_dispatch();
 
-            for (lidx, layer) in self.layers.iter().enumerate() {
-                self.nr_layer_cpus_min_max[lidx] = (
-                    self.nr_layer_cpus_min_max[lidx].0.min(layer.nr_cpus),
-                    self.nr_layer_cpus_min_max[lidx].1.max(layer.nr_cpus),
-                );
+        for (lidx, layer) in self.layers.iter().enumerate() {
+            self.nr_layer_cpus_min_max[lidx] = (
+                self.nr_layer_cpus_min_max[lidx].0.min(layer.nr_cpus),
+                self.nr_layer_cpus_min_max[lidx].1.max(layer.nr_cpus),
+            );
+        }
+    }
+
+    /// Re-read the layer specs and apply them without detaching. Matches and
+    /// the layer lists are written to the inactive copies and flipped in,
+    /// policies are rewritten in place, and every task is matched again the
+    /// next time it becomes runnable. A layer which switches between open
+    /// and confined or grouped restarts from no CPUs and is resized by the
+    /// following refreshes. The number of layers is fixed at load time and
+    /// a reload which changes it is rejected.
+    fn reload_layer_specs(&mut self) -> Result<()> {
+        let specs = parse_layer_specs(&self.spec_inputs)?;
+        verify_layer_specs(&specs)?;
+
+        if specs.len() != self.layers.len() {
+            bail!(
+                "The number of layers can't change without restarting ({} -> {})",
+                self.layers.len(),
+                specs.len()
+            );
+        }
+
+        let mut new_layers = vec![];
+        for spec in specs.iter() {
+            new_layers.push(Layer::new(
+                &mut self.cpu_pool,
+                &spec.name,
+                spec.kind.clone(),
+            )?);
+        }
+
+        if !self.llc_miss_enabled
+            && specs.iter().any(|spec| match &spec.kind {
+                LayerKind::Confined {
+                    llc_isolate_misses, ..
+                }
+                | LayerKind::Grouped {
+                    llc_isolate_misses, ..
+                } => *llc_isolate_misses > 0.0,
+                LayerKind::Open { .. } => false,
+            })
+        {
+            warn!("LLC miss counters weren't enabled on startup, llc_isolate_misses is ignored");
+        }
+
+        // Compile into the inactive match table and layer lists and flip
+        // once both are complete.
+        let match_table = MatchTable::compile(&specs)?;
+        let mt_idx = (self.skel.bss().match_table_idx + 1) % 2;
+        Self::install_match_keys(
+            &mut self.skel,
+            mt_idx,
+            &match_table,
+            &mut self.match_keys[mt_idx as usize],
+        )?;
+
+        let bss = self.skel.bss_mut();
+        Self::write_match_table(&mut bss.match_tables[mt_idx as usize], &match_table);
+        Self::write_layer_configs(bss, self.slice_us, &specs, mt_idx as usize);
+        fence(Ordering::SeqCst);
+        bss.match_table_idx = mt_idx;
+        bss.layer_refresh_seq += 1;
+
+        for (idx, new_layer) in new_layers.into_iter().enumerate() {
+            let layer = &mut self.layers[idx];
+            let was_open = matches!(layer.kind, LayerKind::Open { .. });
+            let is_open = matches!(new_layer.kind, LayerKind::Open { .. });
+
+            if was_open != is_open {
+                if !was_open {
+                    self.cpu_pool.free(&layer.cpus)?;
+                }
+                layer.cpus.fill(false);
+                layer.nr_cpus = 0;
+                Self::update_bpf_layer_cpumask(layer, &mut self.skel.bss_mut().layers[idx]);
             }
+
+            layer.name = new_layer.name;
+            layer.kind = new_layer.kind;
         }
 
+        self.update_open_cpumasks();
+        self.layer_specs = specs;
         Ok(())
     }
 
+    fn maybe_reload_layer_specs(&mut self) {
+        let mut reload = RELOAD_REQUESTED.swap(false, Ordering::Relaxed);
+
+        if let Some(mtimes) = &self.spec_mtimes {
+            let cur_mtimes = spec_file_mtimes(&self.spec_inputs);
+            if cur_mtimes != *mtimes {
+                self.spec_mtimes = Some(cur_mtimes);
+                reload = true;
+            }
+        }
+
+        if reload {
+            match self.reload_layer_specs() {
+                Ok(()) => info!("Reloaded layer specs"),
+                Err(e) => warn!(
+                    "Failed to reload layer specs, keeping the current ones ({:#})",
+                    &e
+                ),
+            }
+        }
+    }
+
     fn step(&mut self) -> Result<()> {
         let started_at = Instant::now();
-        self.sched_stats
-            .refresh(&mut self.skel, &self.proc_reader, started_at)?;
+        self.sched_stats.refresh(&mut self.skel, started_at)?;
 
         self.refresh_cpumasks()?;
 
@@ -1632,8 +2297,19 @@ impl<'a, 'b> Scheduler<'a, 'b> {
 
     fn report(&mut self) -> Result<()> {
         let started_at = Instant::now();
-        self.report_stats
-            .refresh(&mut self.skel, &self.proc_reader, started_at)?;
+
+        // Fill the stats which aren't published. The exporter only holds
+        // the other copy unless it's still encoding this one from two
+        // intervals ago, in which case start from a fresh set rather than
+        // writing under it.
+        if self.stats_buf.is_some() {
+            std::mem::swap(&mut self.om_stats, &mut self.om_stats_prev);
+            if Arc::strong_count(&self.om_stats.registry) > 1 {
+                self.om_stats = OpenMetricsStats::new();
+            }
+        }
+
+        self.report_stats.refresh(&mut self.skel, started_at)?;
         let stats = &self.report_stats;
 
         let processing_dur = self.processing_dur - self.prev_processing_dur;
@@ -1689,6 +2365,9 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             stats.bpf_stats.gstats[bpf_intf::global_stat_idx_GSTAT_EXCL_WAKEUP as usize] as f64
                 / total as f64,
         );
+        self.om_stats
+            .excl_idle_util
+            .set(stats.excl_idle_util * 100.0);
         self.om_stats.proc_ms.set(processing_dur.as_millis() as i64);
         self.om_stats.busy.set(stats.cpu_busy * 100.0);
         self.om_stats.util.set(stats.total_util * 100.0);
@@ -1713,11 +2392,12 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             );
 
             info!(
-                "excl_coll={} excl_preempt={} excl_idle={} excl_wakeup={}",
+                "excl_coll={} excl_preempt={} excl_idle={} excl_wakeup={} excl_idle_util={:5.1}",
                 fmt_pct(lsum_pct(bpf_intf::layer_stat_idx_LSTAT_EXCL_COLLISION)),
                 fmt_pct(lsum_pct(bpf_intf::layer_stat_idx_LSTAT_EXCL_PREEMPT)),
                 fmt_pct(self.om_stats.excl_idle.get()),
                 fmt_pct(self.om_stats.excl_wakeup.get()),
+                self.om_stats.excl_idle_util.get(),
             );
         }
 
@@ -1770,6 +2450,14 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                 l_util_frac,
                 calc_frac(stats.layer_utils[lidx], stats.total_util)
             );
+            let l_util_forecast = set!(
+                l_util_forecast,
+                self.util_forecasts[lidx].forecast() * 100.0
+            );
+            let l_util_forecast_err = set!(
+                l_util_forecast_err,
+                self.util_forecasts[lidx].error * 100.0
+            );
             let l_load = set!(l_load, stats.layer_loads[lidx]);
             let l_load_frac = set!(
                 l_load_frac,
@@ -1822,6 +2510,15 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                 l_preempt_fail,
                 lstat_pct(bpf_intf::layer_stat_idx_LSTAT_PREEMPT_FAIL)
             );
+            let l_preempt_cands = set!(
+                l_preempt_cands,
+                match lstat(bpf_intf::layer_stat_idx_LSTAT_PREEMPT_SCAN) {
+                    0 => 0.0,
+                    scans => {
+                        lstat(bpf_intf::layer_stat_idx_LSTAT_PREEMPT_CAND) as f64 / scans as f64
+                    }
+                }
+            );
             let l_affn_viol = set!(
                 l_affn_viol,
                 lstat_pct(bpf_intf::layer_stat_idx_LSTAT_AFFN_VIOL)
@@ -1853,6 +2550,13 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                 l_migration,
                 lstat_pct(bpf_intf::layer_stat_idx_LSTAT_MIGRATION)
             );
+            let l_xllc_migration = set!(
+                l_xllc_migration,
+                lstat_pct(bpf_intf::layer_stat_idx_LSTAT_XLLC_MIGRATION)
+            );
+            let l_llc_miss = set!(l_llc_miss, stats.layer_llc_miss_rates[lidx]);
+            let l_membw = set!(l_membw, stats.layer_membws[lidx] / (1024.0 * 1024.0));
+            let l_llc_isolated = set!(l_llc_isolated, layer.llc_isolated as i64);
             let l_cur_nr_cpus = set!(l_cur_nr_cpus, layer.nr_cpus as i64);
             let l_min_nr_cpus = set!(l_min_nr_cpus, self.nr_layer_cpus_min_max[lidx].0 as i64);
             let l_max_nr_cpus = set!(l_max_nr_cpus, self.nr_layer_cpus_min_max[lidx].1 as i64);
@@ -1867,6 +2571,15 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                     l_tasks.get(),
                     width = header_width,
                 );
+                if self.forecast.is_some() && self.util_forecasts[lidx].primed {
+                    info!(
+                        "  {:<width$}  util_forecast/err={:7.1}/{:7.1}",
+                        "",
+                        l_util_forecast.get(),
+                        l_util_forecast_err.get(),
+                        width = header_width,
+                    );
+                }
                 info!(
                     "  {:<width$}  tot={:7} local={} wake/exp/last/reenq={}/{}/{}/{}",
                     "",
@@ -1890,20 +2603,36 @@ impl<'a, 'b> Scheduler<'a, 'b> {
                     width = header_width,
                 );
                 info!(
-                    "  {:<width$}  open_idle={} mig={} affn_viol={}",
+                    "  {:<width$}  open_idle={} mig/xllc={}/{} affn_viol={}",
                     "",
                     fmt_pct(l_open_idle.get()),
                     fmt_pct(l_migration.get()),
+                    fmt_pct(l_xllc_migration.get()),
                     fmt_pct(l_affn_viol.get()),
                     width = header_width,
                 );
+                if self.llc_miss_enabled {
+                    info!(
+                        "  {:<width$}  llc_miss/membw={:7.1}/{:7.1}MiB/s{}",
+                        "",
+                        l_llc_miss.get(),
+                        l_membw.get(),
+                        if l_llc_isolated.get() != 0 {
+                            " isolated"
+                        } else {
+                            ""
+                        },
+                        width = header_width,
+                    );
+                }
                 info!(
-                    "  {:<width$}  preempt/first/idle/fail={}/{}/{}/{} min_exec={}/{:7.2}ms",
+                    "  {:<width$}  preempt/first/idle/fail={}/{}/{}/{} cands={:4.2} min_exec={}/{:7.2}ms",
                     "",
                     fmt_pct(l_preempt.get()),
                     fmt_pct(l_preempt_first.get()),
                     fmt_pct(l_preempt_idle.get()),
                     fmt_pct(l_preempt_fail.get()),
+                    l_preempt_cands.get(),
                     fmt_pct(l_min_exec.get()),
                     l_min_exec_us.get() as f64 / 1000.0,
                     width = header_width,
@@ -1948,6 +2677,9 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             encode(&mut buffer, &self.om_stats.registry).unwrap();
             print!("{}", buffer);
         }
+        if let Some(stats_buf) = &self.stats_buf {
+            stats_buf.publish(self.om_stats.registry.clone());
+        }
         self.processing_dur += Instant::now().duration_since(started_at);
         Ok(())
     }
@@ -1961,6 +2693,7 @@ impl<'a, 'b> Scheduler<'a, 'b> {
             let now = Instant::now();
 
             if now >= next_sched_at {
+                self.maybe_reload_layer_specs();
                 self.step()?;
                 while next_sched_at < now {
                     next_sched_at += self.sched_intv;
@@ -1986,7 +2719,7 @@ impl<'a, 'b> Scheduler<'a, 'b> {
     }
 }
 
-impl<'a, 'b> Drop for Scheduler<'a, 'b> {
+impl<'a> Drop for Scheduler<'a> {
     fn drop(&mut self) {
         if let Some(struct_ops) = self.struct_ops.take() {
             drop(struct_ops);
@@ -1994,6 +2727,57 @@ impl<'a, 'b> Drop for Scheduler<'a, 'b> {
     }
 }
 
+static RELOAD_REQUESTED: AtomicBool = AtomicBool::new(false);
+
+extern "C" fn handle_sighup(_: libc::c_int) {
+    RELOAD_REQUESTED.store(true, Ordering::Relaxed);
+}
+
+/// Make SIGHUP reload the layer specs. ctrlc's termination feature makes
+/// SIGHUP shut down the scheduler like SIGINT and SIGTERM, so this must be
+/// called after ctrlc::set_handler() to take SIGHUP over.
+fn set_sighup_handler() -> Result<()> {
+    let ret = unsafe {
+        let mut action: libc::sigaction = std::mem::zeroed();
+        action.sa_sigaction = handle_sighup as libc::sighandler_t;
+        action.sa_flags = libc::SA_RESTART;
+        libc::sigemptyset(&mut action.sa_mask);
+        libc::sigaction(libc::SIGHUP, &action, std::ptr::null_mut())
+    };
+    if ret != 0 {
+        bail!(
+            "Error setting SIGHUP handler ({})",
+            std::io::Error::last_os_error()
+        );
+    }
+    Ok(())
+}
+
+fn parse_layer_specs(inputs: &[String]) -> Result<Vec<LayerSpec>> {
+    let mut specs = vec![];
+    for (idx, input) in inputs.iter().enumerate() {
+        specs.append(
+            &mut LayerSpec::parse(input)
+                .context(format!("Failed to parse specs[{}] ({:?})", idx, input))?,
+        );
+    }
+    Ok(specs)
+}
+
+/// Modification times of the spec files in @inputs. None for inline specs and
+/// files which can't be stat'd.
+fn spec_file_mtimes(inputs: &[String]) -> Vec<Option<SystemTime>> {
+    inputs
+        .iter()
+        .map(|input| match input.split_once(':') {
+            Some(("f", path)) | Some(("file", path)) => {
+                fs::metadata(path).and_then(|md| md.modified()).ok()
+            }
+            _ => None,
+        })
+        .collect()
+}
+
 fn write_example_file(path: &str) -> Result<()> {
     let example = LayerConfig {
         specs: vec![
@@ -2007,6 +2791,7 @@ fn write_example_file(path: &str) -> Result<()> {
                 kind: LayerKind::Confined {
                     cpus_range: Some((0, 16)),
                     util_range: (0.8, 0.9),
+                    llc_isolate_misses: 0.0,
                     min_exec_us: 1000,
                     yield_ignore: 0.0,
                     preempt: false,
@@ -2038,6 +2823,7 @@ fn write_example_file(path: &str) -> Result<()> {
                 kind: LayerKind::Grouped {
                     cpus_range: None,
                     util_range: (0.5, 0.6),
+                    llc_isolate_misses: 0.0,
                     min_exec_us: 200,
                     yield_ignore: 0.0,
                     preempt: false,
@@ -2110,6 +2896,11 @@ fn verify_layer_specs(specs: &[LayerSpec]) -> Result<()> {
                             bail!("Spec {:?} has too long a process name prefix", spec.name);
                         }
                     }
+                    LayerMatch::ExecPath(path) => {
+                        if path.is_empty() || path.len() >= MAX_PATH {
+                            bail!("Spec {:?} has an empty or too long exec path", spec.name);
+                        }
+                    }
                     _ => {}
                 }
             }
@@ -2147,8 +2938,20 @@ fn verify_layer_specs(specs: &[LayerSpec]) -> Result<()> {
             }
             _ => {}
         }
+
+        match &spec.kind {
+            LayerKind::Confined { perf, .. }
+            | LayerKind::Grouped { perf, .. }
+            | LayerKind::Open { perf, .. } => {
+                if *perf > 1024 {
+                    bail!("Spec {:?} has invalid perf {}", spec.name, perf);
+                }
+            }
+        }
     }
 
+    MatchTable::compile(specs)?;
+
     Ok(())
 }
 
@@ -2179,14 +2982,24 @@ fn main() -> Result<()> {
         return Ok(());
     }
 
-    let mut layer_config = LayerConfig { specs: vec![] };
-    for (idx, input) in opts.specs.iter().enumerate() {
-        layer_config.specs.append(
-            &mut LayerSpec::parse(input)
-                .context(format!("Failed to parse specs[{}] ({:?})", idx, input))?,
-        );
+    if opts.bench_match {
+        return layer_match::bench_match();
     }
 
+    // Holt's smoothing diverges with factors outside (0, 1].
+    for (name, val) in [
+        ("--forecast-alpha", opts.forecast_alpha),
+        ("--forecast-beta", opts.forecast_beta),
+    ] {
+        if !(val > 0.0 && val <= 1.0) {
+            bail!("{} must be in (0, 1], got {}", name, val);
+        }
+    }
+
+    let layer_config = LayerConfig {
+        specs: parse_layer_specs(&opts.specs)?,
+    };
+
     debug!("specs={}", serde_json::to_string_pretty(&layer_config)?);
     verify_layer_specs(&layer_config.specs)?;
 
@@ -2197,9 +3010,22 @@ fn main() -> Result<()> {
     })
     .context("Error setting Ctrl-C handler")?;
 
+    set_sighup_handler()?;
+
+    // The exporter outlives scheduler restarts.
+    let stats_buf = match &opts.stats_listen {
+        Some(addr) => Some(exporter::start(addr)?),
+        None => None,
+    };
+
+    // Restart with the specs in effect, which may have been reloaded since
+    // startup.
+    let mut specs = layer_config.specs;
     loop {
-        let mut sched = Scheduler::init(&opts, &layer_config.specs)?;
-        if !sched.run(shutdown.clone())?.should_restart() {
+        let mut sched = Scheduler::init(&opts, &specs, stats_buf.clone())?;
+        let should_restart = sched.run(shutdown.clone())?.should_restart();
+        specs = sched.layer_specs.clone();
+        if !should_restart {
             break;
         }
     }
@@ -0,0 +1,72 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+use std::os::fd::FromRawFd;
+use std::os::fd::OwnedFd;
+
+use anyhow::bail;
+use anyhow::Result;
+
+const PERF_TYPE_HARDWARE: u32 = 0;
+const PERF_COUNT_HW_CACHE_MISSES: u64 = 3;
+
+/// struct perf_event_attr up to PERF_ATTR_SIZE_VER5. Only the fields needed
+/// to open plain per-CPU counting events are used.
+#[repr(C)]
+#[derive(Default)]
+struct PerfEventAttr {
+    type_: u32,
+    size: u32,
+    config: u64,
+    sample_period: u64,
+    sample_type: u64,
+    read_format: u64,
+    flags: u64,
+    wakeup_events: u32,
+    bp_type: u32,
+    config1: u64,
+    config2: u64,
+    branch_sample_type: u64,
+    sample_regs_user: u64,
+    sample_stack_user: u32,
+    clockid: i32,
+    sample_regs_intr: u64,
+    aux_watermark: u32,
+    sample_max_stack: u16,
+    reserved: u16,
+}
+
+fn perf_event_open(attr: &PerfEventAttr, cpu: usize) -> Result<OwnedFd> {
+    let fd = unsafe {
+        libc::syscall(
+            libc::SYS_perf_event_open,
+            attr as *const PerfEventAttr,
+            -1 as libc::pid_t,
+            cpu as libc::c_int,
+            -1 as libc::c_int,
+            0 as libc::c_ulong,
+        )
+    };
+    if fd < 0 {
+        bail!(
+            "perf_event_open failed on CPU {} ({})",
+            cpu,
+            std::io::Error::last_os_error()
+        );
+    }
+    Ok(unsafe { OwnedFd::from_raw_fd(fd as i32) })
+}
+
+/// Open a counter of last level cache misses on @cpu covering all tasks. LLC
+/// misses are mostly served from memory, so the count times the cacheline
+/// size doubles as an estimate of the memory bandwidth consumed.
+pub fn open_llc_miss_counter(cpu: usize) -> Result<OwnedFd> {
+    let attr = PerfEventAttr {
+        type_: PERF_TYPE_HARDWARE,
+        size: std::mem::size_of::<PerfEventAttr>() as u32,
+        config: PERF_COUNT_HW_CACHE_MISSES,
+        ..Default::default()
+    };
+    perf_event_open(&attr, cpu)
+}
@@ -15,6 +15,7 @@
 
 #ifndef __KERNEL__
 typedef unsigned char u8;
+typedef int s32;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 #endif
@@ -59,12 +60,23 @@ enum consts {
 	 * anyway and will be retried until loads are balanced.
 	 */
 	MAX_DOM_ACTIVE_PIDS	= 1024,
+
+	/*
+	 * A wakee is paired with its waker as the consumer of a
+	 * producer/consumer pipeline once the same waker has woken it up this
+	 * many times in a row, and the waker wakes and the wakee blocks at
+	 * least PAIR_MIN_FREQ times per 100ms.
+	 */
+	PAIR_MIN_STREAK		= 4,
+	PAIR_MAX_STREAK		= 64,
+	PAIR_MIN_FREQ		= 10,
 };
 
 /* Statistics */
 enum stat_idx {
 	/* The following fields add up to all dispatched tasks */
 	RUSTY_STAT_WAKE_SYNC,
+	RUSTY_STAT_WAKE_PAIR,
 	RUSTY_STAT_SYNC_PREV_IDLE,
 	RUSTY_STAT_PREV_IDLE,
 	RUSTY_STAT_GREEDY_IDLE,
@@ -101,12 +113,18 @@ struct task_ctx {
 	u32 weight;
 	bool runnable;
 	u64 dom_active_pids_gen;
+	/* where the task's dom_active_task snapshot is for the current gen */
+	u32 dom_active_dom;
+	u32 dom_active_idx;
 	u64 deadline;
 
 	u64 sum_runtime;
 	u64 avg_runtime;
 	u64 last_run_at;
 
+	/* when the task was last enqueued, cleared once it starts running */
+	u64 enq_at;
+
 	/* frequency with which a task is blocked (consumer) */
 	u64 blocked_freq;
 	u64 last_blocked_at;
@@ -115,6 +133,13 @@ struct task_ctx {
 	u64 waker_freq;
 	u64 last_woke_at;
 
+	/* the task which last woke this one up and how many times in a row */
+	s32 last_waker_pid;
+	u32 waker_streak;
+
+	/* the producer this task is paired with as the consumer, 0 if none */
+	s32 pair_pid;
+
 	/* The task is a workqueue worker thread */
 	bool is_kworker;
 
@@ -127,6 +152,21 @@ struct task_ctx {
 	struct ravg_data dcyc_rd;
 };
 
+/*
+ * Snapshot of a task which was recently active in a domain. Userspace can't
+ * look up task local storage by pid, so BPF keeps these up-to-date for the
+ * load balancer to read the task's load and migration constraints from.
+ */
+struct dom_active_task {
+	s32 pid;
+	u32 dom_id;
+	u32 weight;
+	s32 pair_pid;
+	u64 dom_mask;
+	bool is_kworker;
+	struct ravg_data dcyc_rd;
+};
+
 struct bucket_ctx {
 	u64 dcycle;
 	struct ravg_data rd;
@@ -139,6 +179,7 @@ struct dom_ctx {
 	struct bpf_cpumask __kptr *node_cpumask;
 
 	u64 min_vruntime;
+	u64 slice_ns;
 
 	u64 dbg_dcycle_printed_at;
 	struct bucket_ctx buckets[LB_LOAD_BUCKETS];
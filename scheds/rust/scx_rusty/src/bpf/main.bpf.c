@@ -8,8 +8,8 @@
  * calculates the load factor of each domain and tells the BPF part how to load
  * balance the domains.
  *
- * Every task has an entry in the task_data map which lists which domain the
- * task belongs to. When a task first enters the system (rusty_prep_enable),
+ * Every task has a task_ctx in task local storage which lists which domain
+ * the task belongs to. When a task first enters the system (rusty_prep_enable),
  * they are round-robined to a domain.
  *
  * rusty_select_cpu is the primary scheduling logic, invoked when a task
@@ -31,12 +31,14 @@
  * then greedy load stealing will attempt to find a task on another dispatch
  * queue to run.
  *
- * Load balancing is almost entirely handled by userspace. BPF populates the
- * task weight, dom mask and current dom in the task_data map and executes the
- * load balance based on userspace populating the lb_data map.
+ * Load balancing is almost entirely handled by userspace. BPF records the
+ * weight, load, dom mask and current dom of recently active tasks in the
+ * dom_active_tasks map and executes the load balance based on userspace
+ * populating the lb_data map.
  */
 #include <scx/common.bpf.h>
 #include <scx/ravg_impl.bpf.h>
+#include <scx/cpu_util_impl.bpf.h>
 #include "intf.h"
 
 #include <errno.h>
@@ -65,6 +67,16 @@ const volatile u32 cpu_dom_id_map[MAX_CPUS];
 const volatile u32 dom_numa_id_map[MAX_DOMS];
 const volatile u64 dom_cpumasks[MAX_DOMS][MAX_CPUS / 64];
 const volatile u64 numa_cpumasks[MAX_NUMA_NODES][MAX_CPUS / 64];
+
+/*
+ * Domains on other NUMA nodes in ascending SLIT distance order from each node,
+ * terminated by NO_DOM_FOUND, and the number of tasks which need to be queued
+ * on each of them before they can be stolen from. The thresholds are
+ * greedy_threshold_x_numa scaled by the distance relative to the nearest
+ * remote node so that farther domains need more backlog to be worth it.
+ */
+const volatile u32 xnuma_dom_order[MAX_NUMA_NODES][MAX_DOMS];
+const volatile u32 xnuma_dom_threshold[MAX_NUMA_NODES][MAX_DOMS];
 const volatile u32 load_half_life = 1000000000	/* 1s */;
 
 const volatile bool kthreads_local;
@@ -83,6 +95,19 @@ static u64 slice_ns = SCX_SLICE_DFL;
 struct pcpu_ctx {
 	u32 dom_rr_cur; /* used when scanning other doms */
 	u32 dom_id;
+
+	/*
+	 * Number of tasks which started running on the CPU, and the number of
+	 * those which went through ops.enqueue() and the sum of the time they
+	 * spent queued before that. Read by the userspace tuner.
+	 */
+	u64 nr_runs;
+	u64 nr_waits;
+	u64 sum_wait_ns;
+
+	/* busy time of the CPU, read by the userspace tuner */
+	struct cpu_util_data util;
+
 	/*
 	 * Add some padding so that libbpf-rs can generate the rest of the
 	 * padding to CACHELINE_SIZE. This is necessary for now because most
@@ -93,7 +118,7 @@ struct pcpu_ctx {
 	 * This is currently being fixed in libbpf-cargo, so we should be able
 	 * to remove this workaround soon.
 	 */
-	u32 pad[8];
+	u32 pad[4];
 } __attribute__((aligned(CACHELINE_SIZE)));
 
 struct pcpu_ctx pcpu_ctx[MAX_CPUS];
@@ -140,25 +165,40 @@ struct {
 	__uint(map_flags, 0);
 } dom_dcycle_locks SEC(".maps");
 
+/*
+ * Ring of the tasks which have been active in each domain since userspace last
+ * bumped @gen. The indices live in .bss for userspace to update directly while
+ * the task snapshots are in dom_active_tasks, which userspace reads a whole
+ * domain at a time.
+ */
 struct dom_active_pids {
 	u64 gen;
 	u64 read_idx;
 	u64 write_idx;
-	s32 pids[MAX_DOM_ACTIVE_PIDS];
 };
 
 struct dom_active_pids dom_active_pids[MAX_DOMS];
 
+struct dom_active_tasks {
+	struct dom_active_task tasks[MAX_DOM_ACTIVE_PIDS];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct dom_active_tasks);
+	__uint(max_entries, MAX_DOMS);
+	__uint(map_flags, 0);
+} dom_active_tasks SEC(".maps");
+
 const u64 ravg_1 = 1 << RAVG_FRAC_BITS;
 
-/* Map pid -> task_ctx */
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, pid_t);
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
 	__type(value, struct task_ctx);
-	__uint(max_entries, 1000000);
-	__uint(map_flags, 0);
-} task_data SEC(".maps");
+} task_ctxs SEC(".maps");
 
 static struct dom_ctx *try_lookup_dom_ctx(u32 dom_id)
 {
@@ -178,9 +218,7 @@ static struct dom_ctx *lookup_dom_ctx(u32 dom_id)
 
 static struct task_ctx *try_lookup_task_ctx(struct task_struct *p)
 {
-	s32 pid = p->pid;
-
-	return bpf_map_lookup_elem(&task_data, &pid);
+	return bpf_task_storage_get(&task_ctxs, p, 0, 0);
 }
 
 static struct task_ctx *lookup_task_ctx(struct task_struct *p)
@@ -194,6 +232,42 @@ static struct task_ctx *lookup_task_ctx(struct task_struct *p)
 	return taskc;
 }
 
+static struct dom_active_task *lookup_dom_active_task(u32 dom_id, u32 idx)
+{
+	struct dom_active_tasks *tasks;
+
+	if (!(tasks = bpf_map_lookup_elem(&dom_active_tasks, &dom_id)))
+		return NULL;
+
+	return MEMBER_VPTR(*tasks, .tasks[idx]);
+}
+
+/*
+ * Refresh @p's dom_active_task snapshot if @p has been recorded as active in
+ * the current generation. If the ring wrapped around and the slot now belongs
+ * to another task, leave it alone.
+ */
+static void update_dom_active_task(struct task_struct *p, struct task_ctx *taskc)
+{
+	struct dom_active_task *dat;
+	u32 dom_id = taskc->dom_active_dom;
+
+	if (dom_id >= MAX_DOMS ||
+	    taskc->dom_active_pids_gen != dom_active_pids[dom_id].gen)
+		return;
+
+	dat = lookup_dom_active_task(dom_id, taskc->dom_active_idx);
+	if (!dat || dat->pid != p->pid)
+		return;
+
+	dat->dom_id = taskc->dom_id;
+	dat->weight = taskc->weight;
+	dat->pair_pid = taskc->pair_pid;
+	dat->dom_mask = taskc->dom_mask;
+	dat->is_kworker = taskc->is_kworker;
+	dat->dcyc_rd = taskc->dcyc_rd;
+}
+
 static struct pcpu_ctx *lookup_pcpu_ctx(s32 cpu)
 {
 	struct pcpu_ctx *pcpuc;
@@ -455,6 +529,7 @@ struct {
 struct tune_input{
 	u64 gen;
 	u64 slice_ns;
+	u64 dom_slice_ns[MAX_DOMS];
 	u64 direct_greedy_cpumask[MAX_CPUS / 64];
 	u64 kick_greedy_cpumask[MAX_CPUS / 64];
 } tune_input;
@@ -485,6 +560,7 @@ static inline bool is_offline_cpu(s32 cpu)
 
 static void refresh_tune_params(void)
 {
+	u32 dom_id;
 	s32 cpu;
 
 	if (tune_params_gen == tune_input.gen)
@@ -493,6 +569,22 @@ static void refresh_tune_params(void)
 	tune_params_gen = tune_input.gen;
 	slice_ns = tune_input.slice_ns;
 
+	bpf_for(dom_id, 0, nr_doms) {
+		struct dom_ctx *domc;
+		u64 *dom_slice_ns;
+
+		if (!(domc = lookup_dom_ctx(dom_id)))
+			return;
+
+		dom_slice_ns = MEMBER_VPTR(tune_input, .dom_slice_ns[dom_id]);
+		if (!dom_slice_ns) {
+			scx_bpf_error("Failed to lookup dom%u slice", dom_id);
+			return;
+		}
+
+		domc->slice_ns = *dom_slice_ns;
+	}
+
 	bpf_for(cpu, 0, nr_cpu_ids) {
 		u32 dom_id = cpu_to_dom_id(cpu);
 		struct dom_ctx *domc;
@@ -530,6 +622,20 @@ static u64 min(u64 a, u64 b)
 	return a <= b ? a : b;
 }
 
+/*
+ * The slice for tasks in @dom_id. The userspace tuner may pick a different
+ * slice for each domain. Use the global one until it has.
+ */
+static u64 dom_slice_ns(u32 dom_id)
+{
+	struct dom_ctx *domc;
+
+	if (!(domc = try_lookup_dom_ctx(dom_id)) || !domc->slice_ns)
+		return slice_ns;
+
+	return domc->slice_ns;
+}
+
 /*
  * ** Taken directly from fair.c in the Linux kernel **
  *
@@ -725,7 +831,7 @@ static void clamp_task_vtime(struct task_struct *p, struct task_ctx *taskc, u64
 		return;
 
 	dom_vruntime = dom_min_vruntime(domc);
-	min_vruntime = dom_vruntime - slice_ns;
+	min_vruntime = dom_vruntime - dom_slice_ns(taskc->dom_id);
 	/*
 	 * Allow an idling task to accumulate at most one slice worth of
 	 * vruntime budget. This prevents e.g. a task for sleeping for 1 day,
@@ -791,6 +897,7 @@ static bool task_set_domain(struct task_ctx *taskc, struct task_struct *p,
 				  scale_inverse_fair(taskc->avg_runtime, taskc->weight);
 		bpf_cpumask_and(t_cpumask, (const struct cpumask *)d_cpumask,
 				p->cpus_ptr);
+		update_dom_active_task(p, taskc);
 	}
 
 	return taskc->dom_id == new_dom_id;
@@ -851,6 +958,59 @@ err_out:
 	return cpu;
 }
 
+/*
+ * @p is the consumer of a producer/consumer pair and is being woken up by its
+ * producer. Try to run @p in the producer's domain so that the two share the
+ * LLC. If @p belongs to a different domain, it's moved over only if the
+ * producer's domain is under-utilized and can take it. The load balancer then
+ * keeps the pair together.
+ */
+static s32 try_pair_wakeup(struct task_struct *p, struct task_ctx *taskc,
+			   bool has_idle_cores)
+{
+	struct task_struct *current = (void *)bpf_get_current_task_btf();
+	struct bpf_cpumask *p_cpumask;
+	struct pcpu_ctx *pcpuc;
+	u32 waker_dom;
+	s32 cpu;
+
+	if (taskc->pair_pid != current->pid || (current->flags & PF_EXITING))
+		return -ENOENT;
+
+	cpu = bpf_get_smp_processor_id();
+	if (!(pcpuc = lookup_pcpu_ctx(cpu)))
+		return -ENOENT;
+
+	waker_dom = pcpuc->dom_id;
+	if (waker_dom != taskc->dom_id) {
+		if (waker_dom >= MAX_DOMS || !(taskc->dom_mask & (1LLU << waker_dom)))
+			return -ENOENT;
+		if (!direct_greedy_cpumask ||
+		    !bpf_cpumask_test_cpu(cpu, (const struct cpumask *)
+					  direct_greedy_cpumask))
+			return -ENOENT;
+		if (!task_set_domain(taskc, p, waker_dom, false))
+			return -ENOENT;
+	}
+
+	if (!(p_cpumask = taskc->cpumask))
+		return -ENOENT;
+
+	if (has_idle_cores) {
+		cpu = scx_bpf_pick_idle_cpu((const struct cpumask *)p_cpumask,
+					    SCX_PICK_IDLE_CORE);
+		if (cpu >= 0)
+			goto found;
+	}
+
+	cpu = scx_bpf_pick_idle_cpu((const struct cpumask *)p_cpumask, 0);
+	if (cpu < 0)
+		return cpu;
+found:
+	stat_add(RUSTY_STAT_WAKE_PAIR, 1);
+	return cpu;
+}
+
 s32 BPF_STRUCT_OPS(rusty_select_cpu, struct task_struct *p, s32 prev_cpu,
 		   u64 wake_flags)
 {
@@ -887,6 +1047,13 @@ s32 BPF_STRUCT_OPS(rusty_select_cpu, struct task_struct *p, s32 prev_cpu,
 
 	has_idle_cores = !bpf_cpumask_empty(idle_smtmask);
 
+	/* Keep producer/consumer pairs on the same LLC */
+	if (taskc->pair_pid) {
+		cpu = try_pair_wakeup(p, taskc, has_idle_cores);
+		if (cpu >= 0)
+			goto direct;
+	}
+
 	/* did @p get pulled out to a foreign domain by e.g. greedy execution? */
 	prev_domestic = bpf_cpumask_test_cpu(prev_cpu,
 					     (const struct cpumask *)p_cpumask);
@@ -1081,8 +1248,8 @@ static void place_task_dl(struct task_struct *p, struct task_ctx *taskc,
 			  u64 enq_flags)
 {
 	clamp_task_vtime(p, taskc, enq_flags);
-	scx_bpf_dispatch_vtime(p, taskc->dom_id, slice_ns, taskc->deadline,
-			       enq_flags);
+	scx_bpf_dispatch_vtime(p, taskc->dom_id, dom_slice_ns(taskc->dom_id),
+			       taskc->deadline, enq_flags);
 }
 
 void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
@@ -1100,6 +1267,8 @@ void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
 		return;
 	}
 
+	taskc->enq_at = bpf_ktime_get_ns();
+
 	/*
 	 * Migrate @p to a new domain if requested by userland through lb_data.
 	 */
@@ -1116,7 +1285,8 @@ void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
 
 	if (taskc->dispatch_local) {
 		taskc->dispatch_local = false;
-		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, slice_ns, enq_flags);
+		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, dom_slice_ns(taskc->dom_id),
+				 enq_flags);
 		return;
 	}
 
@@ -1136,7 +1306,8 @@ void BPF_STRUCT_OPS(rusty_enqueue, struct task_struct *p, u64 enq_flags)
 
 dom_queue:
 	if (fifo_sched)
-		scx_bpf_dispatch(p, taskc->dom_id, slice_ns, enq_flags);
+		scx_bpf_dispatch(p, taskc->dom_id, dom_slice_ns(taskc->dom_id),
+				 enq_flags);
 	else
 		place_task_dl(p, taskc, enq_flags);
 
@@ -1195,7 +1366,7 @@ u32 dom_node_id(u32 dom_id)
 
 void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
 {
-	u32 curr_dom = cpu_to_dom_id(cpu), dom;
+	u32 curr_dom = cpu_to_dom_id(cpu), dom, i;
 	struct pcpu_ctx *pcpuc;
 	u32 my_node;
 
@@ -1238,12 +1409,21 @@ void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
 	if (!greedy_threshold_x_numa || nr_nodes == 1)
 		return;
 
-	/* try to steal a task from domains on other NUMA nodes */
-	bpf_repeat(nr_doms - 1) {
-		dom = pcpuc->dom_rr_cur++ % nr_doms;
+	/*
+	 * Try to steal a task from domains on other NUMA nodes, nearest first.
+	 * Only steal from a domain if it has at least its distance-scaled
+	 * threshold of tasks queued.
+	 */
+	bpf_for(i, 0, nr_doms) {
+		const volatile u32 *domp, *threshp;
 
-		if (dom_node_id(dom) == my_node || dom == curr_dom ||
-		    scx_bpf_dsq_nr_queued(dom) >= greedy_threshold_x_numa)
+		domp = MEMBER_VPTR(xnuma_dom_order, [my_node][i]);
+		threshp = MEMBER_VPTR(xnuma_dom_threshold, [my_node][i]);
+		if (!domp || !threshp || *domp >= MAX_DOMS)
+			break;
+
+		dom = *domp;
+		if (scx_bpf_dsq_nr_queued(dom) < *threshp)
 			continue;
 
 		if (scx_bpf_consume(dom)) {
@@ -1273,6 +1453,34 @@ static u64 update_freq(u64 freq, u64 interval)
 	return calc_avg(freq, new_freq);
 }
 
+/*
+ * Track whether @p is being woken up by the same @waker over and over again
+ * and both are doing so frequently, which is what a producer handing work to
+ * a consumer through a queue looks like. If so, @p is paired with @waker and
+ * select_cpu() and the load balancer try to keep the two in the same domain.
+ */
+static void update_pair(struct task_struct *p, struct task_ctx *wakee_ctx,
+			struct task_struct *waker, struct task_ctx *waker_ctx)
+{
+	if (p == waker)
+		return;
+
+	if (wakee_ctx->last_waker_pid == waker->pid) {
+		if (wakee_ctx->waker_streak < PAIR_MAX_STREAK)
+			wakee_ctx->waker_streak++;
+	} else {
+		wakee_ctx->last_waker_pid = waker->pid;
+		wakee_ctx->waker_streak = 1;
+	}
+
+	if (wakee_ctx->waker_streak >= PAIR_MIN_STREAK &&
+	    waker_ctx->waker_freq >= PAIR_MIN_FREQ &&
+	    wakee_ctx->blocked_freq >= PAIR_MIN_FREQ)
+		wakee_ctx->pair_pid = waker->pid;
+	else
+		wakee_ctx->pair_pid = 0;
+}
+
 void BPF_STRUCT_OPS(rusty_runnable, struct task_struct *p, u64 enq_flags)
 {
 	u64 now = bpf_ktime_get_ns(), interval;
@@ -1286,6 +1494,7 @@ void BPF_STRUCT_OPS(rusty_runnable, struct task_struct *p, u64 enq_flags)
 
 	task_load_adj(p, wakee_ctx, now, true);
 	dom_dcycle_adj(wakee_ctx->dom_id, wakee_ctx->weight, now, true);
+	update_dom_active_task(p, wakee_ctx);
 
 	if (fifo_sched)
 		return;
@@ -1299,6 +1508,8 @@ void BPF_STRUCT_OPS(rusty_runnable, struct task_struct *p, u64 enq_flags)
 	interval = now - waker_ctx->last_woke_at;
 	waker_ctx->waker_freq = update_freq(waker_ctx->waker_freq, interval);
 	waker_ctx->last_woke_at = now;
+
+	update_pair(p, wakee_ctx, waker, waker_ctx);
 }
 
 static void running_update_vtime(struct task_struct *p,
@@ -1320,11 +1531,26 @@ void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 {
 	struct task_ctx *taskc;
 	struct dom_ctx *domc;
+	struct pcpu_ctx *pcpuc;
 	u32 dom_id, dap_gen;
+	u64 now = bpf_ktime_get_ns();
 
 	if (!(taskc = lookup_task_ctx(p)))
 		return;
 
+	/*
+	 * Account how long @p waited to run for the userspace tuner. Only the
+	 * local CPU writes its pcpu_ctx, so no atomics are needed.
+	 */
+	if ((pcpuc = lookup_pcpu_ctx(bpf_get_smp_processor_id()))) {
+		pcpuc->nr_runs++;
+		if (taskc->enq_at) {
+			pcpuc->nr_waits++;
+			pcpuc->sum_wait_ns += now - taskc->enq_at;
+			taskc->enq_at = 0;
+		}
+	}
+
 	dom_id = taskc->dom_id;
 	if (dom_id >= MAX_DOMS) {
 		scx_bpf_error("Invalid dom ID");
@@ -1340,17 +1566,20 @@ void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 	if (taskc->dom_active_pids_gen != dap_gen) {
 		u64 idx = __sync_fetch_and_add(&dom_active_pids[dom_id].write_idx, 1) %
 			MAX_DOM_ACTIVE_PIDS;
-		s32 *pidp;
+		struct dom_active_task *dat;
 
-		pidp = MEMBER_VPTR(dom_active_pids, [dom_id].pids[idx]);
-		if (!pidp) {
-			scx_bpf_error("dom_active_pids[%u][%llu] indexing failed",
+		dat = lookup_dom_active_task(dom_id, idx);
+		if (!dat) {
+			scx_bpf_error("dom_active_tasks[%u][%llu] indexing failed",
 				      dom_id, idx);
 			return;
 		}
 
-		*pidp = p->pid;
+		dat->pid = p->pid;
 		taskc->dom_active_pids_gen = dap_gen;
+		taskc->dom_active_dom = dom_id;
+		taskc->dom_active_idx = idx;
+		update_dom_active_task(p, taskc);
 	}
 
 	if (fifo_sched)
@@ -1361,7 +1590,7 @@ void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 		return;
 
 	running_update_vtime(p, taskc, domc);
-	taskc->last_run_at = bpf_ktime_get_ns();
+	taskc->last_run_at = now;
 }
 
 static void stopping_update_vtime(struct task_struct *p,
@@ -1401,6 +1630,23 @@ void BPF_STRUCT_OPS(rusty_stopping, struct task_struct *p, bool runnable)
 	stopping_update_vtime(p, taskc, domc);
 }
 
+/*
+ * Account the CPU's busy time for the userspace tuner. This is done from the
+ * sched_switch tracepoint rather than ops.running() and ops.stopping() so that
+ * tasks of other sched classes, e.g. in partial mode, and the switches in
+ * between count as busy too.
+ */
+SEC("tp_btf/sched_switch")
+int BPF_PROG(rusty_sched_switch, bool preempt, struct task_struct *prev,
+	     struct task_struct *next)
+{
+	struct pcpu_ctx *pcpuc;
+
+	if ((pcpuc = lookup_pcpu_ctx(bpf_get_smp_processor_id())))
+		cpu_util_switch(&pcpuc->util, prev, next, bpf_ktime_get_ns());
+	return 0;
+}
+
 void BPF_STRUCT_OPS(rusty_quiescent, struct task_struct *p, u64 deq_flags)
 {
 	u64 now = bpf_ktime_get_ns(), interval;
@@ -1412,6 +1658,7 @@ void BPF_STRUCT_OPS(rusty_quiescent, struct task_struct *p, u64 deq_flags)
 
 	task_load_adj(p, taskc, now, false);
 	dom_dcycle_adj(taskc->dom_id, taskc->weight, now, false);
+	update_dom_active_task(p, taskc);
 
 	if (fifo_sched)
 		return;
@@ -1518,54 +1765,36 @@ s32 BPF_STRUCT_OPS(rusty_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
 	u64 now = bpf_ktime_get_ns();
-	struct task_ctx taskc = {
-		.dom_active_pids_gen = -1,
-		.last_blocked_at = now,
-		.last_woke_at = now,
-
-	};
-	struct task_ctx *map_value;
+	struct task_ctx *taskc;
 	long ret;
-	pid_t pid;
-
-	pid = p->pid;
 
-	/*
-	 * XXX - We want BPF_NOEXIST but bpf_map_delete_elem() in .disable() may
-	 * fail spuriously due to BPF recursion protection triggering
-	 * unnecessarily.
-	 */
-	ret = bpf_map_update_elem(&task_data, &pid, &taskc, 0 /*BPF_NOEXIST*/);
-	if (ret) {
+	taskc = bpf_task_storage_get(&task_ctxs, p, 0,
+				     BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (!taskc) {
 		stat_add(RUSTY_STAT_TASK_GET_ERR, 1);
-		return ret;
+		return -ENOMEM;
 	}
 
+	taskc->dom_active_pids_gen = -1;
+	taskc->last_blocked_at = now;
+	taskc->last_woke_at = now;
+
 	if (debug >= 2)
 		bpf_printk("%s[%d]: INIT (weight %u))", p->comm, p->pid, p->scx.weight);
 
-	/*
-	 * Read the entry from the map immediately so we can add the cpumask
-	 * with bpf_kptr_xchg().
-	 */
-	map_value = bpf_map_lookup_elem(&task_data, &pid);
-	if (!map_value)
-		/* Should never happen -- it was just inserted above. */
-		return -EINVAL;
-
-	ret = create_save_cpumask(&map_value->cpumask);
+	ret = create_save_cpumask(&taskc->cpumask);
 	if (ret) {
-		bpf_map_delete_elem(&task_data, &pid);
+		bpf_task_storage_delete(&task_ctxs, p);
 		return ret;
 	}
 
-	ret = create_save_cpumask(&map_value->tmp_cpumask);
+	ret = create_save_cpumask(&taskc->tmp_cpumask);
 	if (ret) {
-		bpf_map_delete_elem(&task_data, &pid);
+		bpf_task_storage_delete(&task_ctxs, p);
 		return ret;
 	}
 
-	task_pick_and_set_domain(map_value, p, p->cpus_ptr, true);
+	task_pick_and_set_domain(taskc, p, p->cpus_ptr, true);
 
 	return 0;
 }
@@ -1573,20 +1802,12 @@ s32 BPF_STRUCT_OPS(rusty_init_task, struct task_struct *p,
 void BPF_STRUCT_OPS(rusty_exit_task, struct task_struct *p,
 		    struct scx_exit_task_args *args)
 {
-	pid_t pid = p->pid;
-	long ret;
-
 	/*
-	 * XXX - There's no reason delete should fail here but BPF's recursion
-	 * protection can unnecessarily fail the operation. The fact that
-	 * deletions aren't reliable means that we sometimes leak task_ctx and
-	 * can't use BPF_NOEXIST on allocation in .prep_enable().
+	 * The task_ctx would be freed along with @p anyway. Delete it now so
+	 * that a task which comes back into the scheduler starts with a
+	 * fresh one and its cpumasks can be created again.
 	 */
-	ret = bpf_map_delete_elem(&task_data, &pid);
-	if (ret) {
-		stat_add(RUSTY_STAT_TASK_GET_ERR, 1);
-		return;
-	}
+	bpf_task_storage_delete(&task_ctxs, p);
 }
 
 static s32 create_node(u32 node_id)
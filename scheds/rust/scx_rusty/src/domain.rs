@@ -9,6 +9,7 @@ use anyhow::Result;
 
 use scx_utils::Cpumask;
 use scx_utils::Topology;
+use scx_utils::LOCAL_DISTANCE;
 
 #[derive(Clone, Debug)]
 pub struct Domain {
@@ -45,6 +46,8 @@ pub struct DomainGroup {
     cpu_dom_map: BTreeMap<usize, usize>,
     dom_numa_map: BTreeMap<usize, usize>,
     num_numa_nodes: usize,
+    node_sys_ids: Vec<usize>,
+    node_distance: Vec<Vec<usize>>,
     span: Cpumask,
 }
 
@@ -57,7 +60,7 @@ impl DomainGroup {
         // contiguous (at least for now, until we can update libraries to not
         // return vectors of domain values).
         let mut dom_id = 0;
-        let (doms, num_numa_nodes) = if !cpumasks.is_empty() {
+        let (doms, num_numa_nodes, node_sys_ids, node_distance) = if !cpumasks.is_empty() {
             let mut doms: BTreeMap<usize, Domain> = BTreeMap::new();
             for mask_str in cpumasks.iter() {
                 let mask = Cpumask::from_str(&mask_str)?;
@@ -66,7 +69,7 @@ impl DomainGroup {
                 dom_numa_map.insert(dom_id, 0);
                 dom_id += 1;
             }
-            (doms, 1)
+            (doms, 1, vec![0], vec![vec![LOCAL_DISTANCE]])
         } else {
             let mut doms: BTreeMap<usize, Domain> = BTreeMap::new();
             for (node_id, node) in top.nodes().iter().enumerate() {
@@ -78,7 +81,22 @@ impl DomainGroup {
                     dom_id += 1;
                 }
             }
-            (doms, top.nodes().len())
+
+            // NUMA IDs in the domain group are indices into top.nodes() and
+            // may differ from the kernel's node IDs which the SLIT distances
+            // are keyed by.
+            let node_distance: Vec<Vec<usize>> = top
+                .nodes()
+                .iter()
+                .map(|from| {
+                    top.nodes()
+                        .iter()
+                        .map(|to| top.node_distance(from.id(), to.id()))
+                        .collect()
+                })
+                .collect();
+            let node_sys_ids: Vec<usize> = top.nodes().iter().map(|node| node.id()).collect();
+            (doms, top.nodes().len(), node_sys_ids, node_distance)
         };
 
         let mut cpu_dom_map = BTreeMap::new();
@@ -88,7 +106,7 @@ impl DomainGroup {
             }
         }
 
-        Ok(Self { doms, cpu_dom_map, dom_numa_map, num_numa_nodes, span })
+        Ok(Self { doms, cpu_dom_map, dom_numa_map, num_numa_nodes, node_sys_ids, node_distance, span })
     }
 
     pub fn numa_doms(&self, numa_id: &usize) -> Vec<Domain> {
@@ -123,6 +141,27 @@ impl DomainGroup {
         self.dom_numa_map.get(dom_id).copied()
     }
 
+    /// Get the kernel's ID for NUMA node @numa_id, e.g. as used in
+    /// /proc/PID/numa_maps.
+    pub fn node_sys_id(&self, numa_id: usize) -> usize {
+        self.node_sys_ids[numa_id]
+    }
+
+    /// Get the SLIT distance between NUMA nodes @from and @to.
+    pub fn node_distance(&self, from: usize, to: usize) -> usize {
+        self.node_distance[from][to]
+    }
+
+    /// Get the distance to the closest NUMA node other than @from, or
+    /// LOCAL_DISTANCE if there's only a single node.
+    pub fn nearest_remote_distance(&self, from: usize) -> usize {
+        (0..self.num_numa_nodes)
+            .filter(|to| *to != from)
+            .map(|to| self.node_distance(from, to))
+            .min()
+            .unwrap_or(LOCAL_DISTANCE)
+    }
+
     pub fn weight(&self) -> usize {
         self.span.weight()
     }
@@ -137,6 +137,9 @@ use crate::bpf_intf;
 use crate::DomainGroup;
 
 use std::cell::Cell;
+use std::cell::RefCell;
+use std::collections::BTreeMap;
+use std::collections::BTreeSet;
 use std::fmt;
 use std::sync::Arc;
 
@@ -154,7 +157,7 @@ use std::collections::VecDeque;
 
 const RAVG_FRAC_BITS: u32 = bpf_intf::ravg_consts_RAVG_FRAC_BITS;
 
-fn now_monotonic() -> u64 {
+pub fn now_monotonic() -> u64 {
     let mut time = libc::timespec {
         tv_sec: 0,
         tv_nsec: 0,
@@ -164,6 +167,40 @@ fn now_monotonic() -> u64 {
     time.tv_sec as u64 * 1_000_000_000 + time.tv_nsec as u64
 }
 
+/// Read the resident memory of @pid in KiB on each NUMA node, keyed by the
+/// kernel's node ID, from /proc/PID/numa_maps. Returns an empty map if the
+/// task is gone or the kernel doesn't support NUMA.
+fn read_task_numa_mem(pid: i32) -> BTreeMap<usize, u64> {
+    let mut numa_mem = BTreeMap::new();
+    let numa_maps = match std::fs::read_to_string(format!("/proc/{}/numa_maps", pid)) {
+        Ok(numa_maps) => numa_maps,
+        Err(_) => return numa_mem,
+    };
+
+    for line in numa_maps.lines() {
+        // N<node>=<pages> fields precede kernelpagesize_kB on each line.
+        let mut page_kb = 4;
+        let mut node_pages = vec![];
+        for field in line.split_whitespace() {
+            if let Some(kb) = field.strip_prefix("kernelpagesize_kB=") {
+                page_kb = kb.parse::<u64>().unwrap_or(page_kb);
+            } else if let Some((node, pages)) =
+                field.strip_prefix('N').and_then(|f| f.split_once('='))
+            {
+                if let (Ok(node), Ok(pages)) = (node.parse::<usize>(), pages.parse::<u64>()) {
+                    node_pages.push((node, pages));
+                }
+            }
+        }
+
+        for (node, pages) in node_pages {
+            *numa_mem.entry(node).or_insert(0) += pages * page_kb;
+        }
+    }
+
+    numa_mem
+}
+
 fn clear_map(map: &libbpf_rs::Map) {
     for key in map.keys() {
         let _ = map.delete(&key);
@@ -322,6 +359,29 @@ struct TaskInfo {
     dom_mask: u64,
     migrated: Cell<bool>,
     is_kworker: bool,
+    numa_mem: RefCell<Option<BTreeMap<usize, u64>>>,
+    // The producer which is migrated along with this task and its load,
+    // which is included in @load. See populate_tasks_by_load().
+    pair: Option<(i32, f64)>,
+}
+
+impl TaskInfo {
+    /// Tasks with less resident memory than this are cheap to move between
+    /// NUMA nodes regardless of where their memory lives.
+    const MEM_LOCALITY_SMALL_KB: u64 = 4096;
+
+    /// Whether moving the task to NUMA node @node_sys_id keeps most of its
+    /// memory accesses local, i.e. at least half of its resident memory is
+    /// already on that node or the task is small. NUMA residency is sampled
+    /// lazily on the first call as reading numa_maps isn't cheap.
+    fn mem_local_to(&self, node_sys_id: usize) -> bool {
+        let mut numa_mem = self.numa_mem.borrow_mut();
+        let numa_mem = numa_mem.get_or_insert_with(|| read_task_numa_mem(self.pid));
+        let total_kb: u64 = numa_mem.values().sum();
+        let local_kb = numa_mem.get(&node_sys_id).copied().unwrap_or(0);
+
+        total_kb <= Self::MEM_LOCALITY_SMALL_KB || local_kb * 2 >= total_kb
+    }
 }
 
 impl LoadOrdered for TaskInfo {
@@ -509,6 +569,10 @@ pub struct LoadBalancer<'a, 'b> {
 
     lb_apply_weight: bool,
     balance_load: bool,
+    mem_locality: bool,
+
+    nr_remote_mem_migrations: u64,
+    nr_pair_migrations: u64,
 }
 
 // Verify that the number of buckets is a factor of the maximum weight to
@@ -522,6 +586,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         skip_kworkers: bool,
         lb_apply_weight: bool,
         balance_load: bool,
+        mem_locality: bool,
     ) -> Self {
         Self {
             skel,
@@ -533,6 +598,10 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
 
             lb_apply_weight: lb_apply_weight.clone(),
             balance_load,
+            mem_locality,
+
+            nr_remote_mem_migrations: 0,
+            nr_pair_migrations: 0,
 
             dom_group,
         }
@@ -562,6 +631,19 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         numa_stats
     }
 
+    /// The number of tasks migrated across NUMA nodes in this round while
+    /// most of their memory resided outside of the destination node. Only
+    /// tracked if memory locality aware balancing is enabled.
+    pub fn nr_remote_mem_migrations(&self) -> u64 {
+        self.nr_remote_mem_migrations
+    }
+
+    /// The number of producer/consumer pairs migrated together in this
+    /// round.
+    pub fn nr_pair_migrations(&self) -> u64 {
+        self.nr_pair_migrations
+    }
+
     fn create_domain_hierarchy(&mut self) -> Result<()> {
         let ledger = self.calculate_load_avgs()?;
 
@@ -677,80 +759,146 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         }
         dom.queried_tasks = true;
 
-        // Read active_pids and update write_idx and gen.
-        //
-        // XXX - We can't read task_ctx inline because self.skel.bss()
-        // borrows mutably and thus conflicts with self.skel.maps().
+        // Read the snapshots of the tasks which have been active in the
+        // domain since the last round. BPF keeps them in dom_active_tasks as
+        // task_ctx lives in task local storage which can't be looked up by
+        // pid, and the whole domain can be read with a single lookup.
         const MAX_PIDS: u64 = bpf_intf::consts_MAX_DOM_ACTIVE_PIDS as u64;
-        let active_pids = &mut self.skel.bss_mut().dom_active_pids[dom.id];
-        let mut pids = vec![];
-
+        let active_pids = &self.skel.bss().dom_active_pids[dom.id];
         let (mut ridx, widx) = (active_pids.read_idx, active_pids.write_idx);
         if widx - ridx > MAX_PIDS {
             ridx = widx - MAX_PIDS;
         }
 
-        for idx in ridx..widx {
-            let pid = active_pids.pids[(idx % MAX_PIDS) as usize];
-            pids.push(pid);
-        }
-
-        active_pids.read_idx = active_pids.write_idx;
+        let load_half_life = self.skel.rodata().load_half_life;
+        let dom_key = (dom.id as u32).to_ne_bytes();
+        let active_tasks_elem = self
+            .skel
+            .maps()
+            .dom_active_tasks()
+            .lookup(&dom_key, libbpf_rs::MapFlags::ANY)
+            .context("Failed to lookup dom_active_tasks")?;
+
+        // Update read_idx and gen so that BPF starts recording afresh.
+        let active_pids = &mut self.skel.bss_mut().dom_active_pids[dom.id];
+        active_pids.read_idx = widx;
         active_pids.gen += 1;
 
-        // Read task_ctx and load.
-        let load_half_life = self.skel.rodata().load_half_life;
-        let maps = self.skel.maps();
-        let task_data = maps.task_data();
+        let active_tasks_elem = match active_tasks_elem {
+            Some(elem) => elem,
+            None => return Ok(()),
+        };
+        let active_tasks = unsafe {
+            std::slice::from_raw_parts(
+                active_tasks_elem.as_slice().as_ptr() as *const bpf_intf::dom_active_task,
+                MAX_PIDS as usize,
+            )
+        };
+
         let now_mono = now_monotonic();
+        let mut seen = BTreeSet::new();
+        let mut tasks = vec![];
 
-        for pid in pids.iter() {
-            let key = unsafe { std::mem::transmute::<i32, [u8; 4]>(*pid) };
+        for idx in ridx..widx {
+            let task = &active_tasks[(idx % MAX_PIDS) as usize];
+            if task.pid <= 0 || task.dom_id as usize != dom.id || !seen.insert(task.pid) {
+                continue;
+            }
 
-            if let Some(task_data_elem) = task_data.lookup(&key, libbpf_rs::MapFlags::ANY)? {
-                let task_ctx =
-                    unsafe { &*(task_data_elem.as_slice().as_ptr() as *const bpf_intf::task_ctx) };
-                if task_ctx.dom_id as usize != dom.id {
-                    continue;
-                }
+            let rd = &task.dcyc_rd;
+            let mut load = ravg_read(
+                rd.val,
+                rd.val_at,
+                rd.old,
+                rd.cur,
+                now_mono,
+                load_half_life,
+                RAVG_FRAC_BITS,
+            );
 
-                let rd = &task_ctx.dcyc_rd;
-                let mut load = ravg_read(
-                        rd.val,
-                        rd.val_at,
-                        rd.old,
-                        rd.cur,
-                        now_mono,
-                        load_half_life,
-                        RAVG_FRAC_BITS,
-                    );
+            if self.lb_apply_weight {
+                let weight = (task.weight as f64).min(self.infeas_threshold);
+                load *= weight;
+            }
+
+            tasks.push((
+                TaskInfo {
+                    pid: task.pid,
+                    load: OrderedFloat(load),
+                    dom_mask: task.dom_mask,
+                    migrated: Cell::new(false),
+                    is_kworker: task.is_kworker,
+                    numa_mem: RefCell::new(None),
+                    pair: None,
+                },
+                task.pair_pid,
+            ));
+        }
+
+        for task in Self::fold_pairs(tasks) {
+            dom.tasks.insert(task);
+        }
 
-                if self.lb_apply_weight {
-                    let weight = (task_ctx.weight as f64).min(self.infeas_threshold);
-                    load *= weight;
+        Ok(())
+    }
+
+    /// BPF pairs a consumer task with the producer which keeps waking it up.
+    /// Splitting such a pair across domains makes every handoff cross LLCs,
+    /// so a pair whose tasks are both in @tasks is folded into a single
+    /// entry for the consumer which carries the producer's load. Both are
+    /// then migrated together. A producer feeding multiple consumers is
+    /// folded into the first one only.
+    fn fold_pairs(tasks: Vec<(TaskInfo, i32)>) -> Vec<TaskInfo> {
+        let pid_to_idx: BTreeMap<i32, usize> = tasks
+            .iter()
+            .enumerate()
+            .map(|(idx, (task, _))| (task.pid, idx))
+            .collect();
+
+        let mut folded = vec![false; tasks.len()];
+        let mut pairs = vec![None; tasks.len()];
+        for (idx, (task, pair_pid)) in tasks.iter().enumerate() {
+            if *pair_pid == 0 || *pair_pid == task.pid || folded[idx] || pairs[idx].is_some() {
+                continue;
+            }
+            if let Some(&pidx) = pid_to_idx.get(pair_pid) {
+                if folded[pidx] || pairs[pidx].is_some() {
+                    continue;
                 }
+                folded[pidx] = true;
+                pairs[idx] = Some(pidx);
+            }
+        }
 
-                dom.tasks.insert(
-                    TaskInfo {
-                        pid: *pid,
-                        load: OrderedFloat(load),
-                        dom_mask: task_ctx.dom_mask,
-                        migrated: Cell::new(false),
-                        is_kworker: task_ctx.is_kworker,
-                    },
-                );
+        let mut tasks: Vec<Option<TaskInfo>> =
+            tasks.into_iter().map(|(task, _)| Some(task)).collect();
+        let mut result = Vec::with_capacity(tasks.len());
+        for idx in 0..tasks.len() {
+            if folded[idx] {
+                continue;
             }
+            let mut task = tasks[idx].take().unwrap();
+            if let Some(pidx) = pairs[idx] {
+                let producer = tasks[pidx].take().unwrap();
+                task.load = OrderedFloat(*task.load + *producer.load);
+                task.dom_mask &= producer.dom_mask;
+                task.is_kworker |= producer.is_kworker;
+                task.pair = Some((producer.pid, *producer.load));
+            }
+            result.push(task);
         }
 
-        Ok(())
+        result
     }
 
     // Find the first candidate pid which hasn't already been migrated and
-    // can run in @pull_dom.
+    // can run in @pull_dom. If @mem_node is set, also skip tasks whose
+    // memory mostly lives outside of that NUMA node.
     fn find_first_candidate<'d, I>(
         tasks_by_load: I,
         pull_dom: u32,
         skip_kworkers: bool,
+        mem_node: Option<usize>,
     ) -> Option<&'d TaskInfo>
     where
         I: IntoIterator<Item = &'d TaskInfo>,
@@ -761,6 +909,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
                 task.migrated.get()
                     || (task.dom_mask & (1 << pull_dom) == 0)
                     || (skip_kworkers && task.is_kworker)
+                    || mem_node.map_or(false, |node| !task.mem_local_to(node))
             })
             .next()
         {
@@ -769,75 +918,139 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         }
     }
 
-    /// Try to find a task in @push_dom to be moved into @pull_dom. If a task is
-    /// found, move the task between the domains, and return the amount of load
-    /// transferred between the two.
-    fn try_find_move_task(
-        &mut self,
-        (push_dom, to_push): (&mut Domain, f64),
-        (pull_dom, to_pull): (&mut Domain, f64),
+    // We want to pick a task to transfer from push_dom to pull_dom to
+    // reduce the load imbalance between the two closest to $to_xfer. IOW,
+    // pick a task which has the closest load value to $to_xfer that can be
+    // migrated. Find such task by locating the first migratable task while
+    // scanning left from $to_xfer and the counterpart while scanning right
+    // and picking the better of the two.
+    fn find_best_candidate<'d>(
+        tasks: &'d [TaskInfo],
+        pull_dom: u32,
+        skip_kworkers: bool,
+        mem_node: Option<usize>,
         to_xfer: f64,
-    ) -> Result<Option<f64>> {
-        let to_pull = to_pull.abs();
-        let calc_new_imbal = |xfer: f64| (to_push - xfer).abs() + (to_pull - xfer).abs();
-
-        self.populate_tasks_by_load(push_dom)?;
-
-        // We want to pick a task to transfer from push_dom to pull_dom to
-        // reduce the load imbalance between the two closest to $to_xfer.
-        // IOW, pick a task which has the closest load value to $to_xfer
-        // that can be migrated. Find such task by locating the first
-        // migratable task while scanning left from $to_xfer and the
-        // counterpart while scanning right and picking the better of the
-        // two.
-        let tasks = std::mem::take(&mut push_dom.tasks).into_vec();
-        let (task, new_imbal) = match (
+        calc_new_imbal: impl Fn(f64) -> f64,
+    ) -> Option<(&'d TaskInfo, f64)> {
+        match (
             Self::find_first_candidate(
                 tasks
-                    .as_slice()
                     .iter()
                     .filter(|x| x.load <= OrderedFloat(to_xfer))
                     .rev(),
-                pull_dom.id.try_into().unwrap(),
-                self.skip_kworkers,
+                pull_dom,
+                skip_kworkers,
+                mem_node,
             ),
             Self::find_first_candidate(
                 tasks
-                    .as_slice()
                     .iter()
                     .filter(|x| x.load >= OrderedFloat(to_xfer)),
-                pull_dom.id.try_into().unwrap(),
-                self.skip_kworkers,
+                pull_dom,
+                skip_kworkers,
+                mem_node,
             ),
         ) {
-            (None, None) => return Ok(None),
+            (None, None) => None,
             (Some(task), None) | (None, Some(task)) => {
-                (task, calc_new_imbal(*task.load))
+                Some((task, calc_new_imbal(*task.load)))
             }
             (Some(task0), Some(task1)) => {
                 let (new_imbal0, new_imbal1) = (calc_new_imbal(*task0.load), calc_new_imbal(*task1.load));
                 if new_imbal0 <= new_imbal1 {
-                    (task0, new_imbal0)
+                    Some((task0, new_imbal0))
                 } else {
-                    (task1, new_imbal1)
+                    Some((task1, new_imbal1))
                 }
             }
-        };
+        }
+    }
+
+    /// If memory locality aware balancing is enabled and @push_dom and
+    /// @pull_dom are on different NUMA nodes, return the kernel ID of
+    /// @pull_dom's node.
+    fn mem_locality_node(&self, push_dom: usize, pull_dom: usize) -> Option<usize> {
+        if !self.mem_locality {
+            return None;
+        }
+
+        let push_numa = self.dom_group.dom_numa_id(&push_dom).unwrap();
+        let pull_numa = self.dom_group.dom_numa_id(&pull_dom).unwrap();
+        if push_numa == pull_numa {
+            None
+        } else {
+            Some(self.dom_group.node_sys_id(pull_numa))
+        }
+    }
+
+    /// Try to find a task in @push_dom to be moved into @pull_dom. If a task is
+    /// found, move the task between the domains, and return the amount of load
+    /// transferred between the two.
+    ///
+    /// When moving across NUMA nodes with memory locality enabled, tasks
+    /// whose memory is already on the destination node, or which are small,
+    /// are preferred. Other tasks are only picked if none of those can reduce
+    /// the imbalance, and are counted as remote memory migrations.
+    fn try_find_move_task(
+        &mut self,
+        (push_dom, to_push): (&mut Domain, f64),
+        (pull_dom, to_pull): (&mut Domain, f64),
+        to_xfer: f64,
+    ) -> Result<Option<f64>> {
+        let to_pull = to_pull.abs();
+        let calc_new_imbal = |xfer: f64| (to_push - xfer).abs() + (to_pull - xfer).abs();
+
+        self.populate_tasks_by_load(push_dom)?;
+
+        let mem_node = self.mem_locality_node(push_dom.id, pull_dom.id);
+        let pull_dom_id: u32 = pull_dom.id.try_into().unwrap();
+        let old_imbal = to_push + to_pull;
+
+        let tasks = std::mem::take(&mut push_dom.tasks).into_vec();
+        let mut candidate = None;
+        if mem_node.is_some() {
+            candidate = Self::find_best_candidate(
+                tasks.as_slice(), pull_dom_id, self.skip_kworkers, mem_node, to_xfer, calc_new_imbal,
+            )
+            .filter(|(_, new_imbal)| *new_imbal <= old_imbal);
+        }
+        if candidate.is_none() {
+            candidate = Self::find_best_candidate(
+                tasks.as_slice(), pull_dom_id, self.skip_kworkers, None, to_xfer, calc_new_imbal,
+            )
+            .filter(|(_, new_imbal)| *new_imbal <= old_imbal);
+        }
 
         // If the best candidate can't reduce the imbalance, there's nothing
         // to do for this pair.
-        let old_imbal = to_push + to_pull;
-        if old_imbal < new_imbal {
-            std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
-            return Ok(None);
+        let task = match candidate {
+            Some((task, _)) => task,
+            None => {
+                std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
+                return Ok(None);
+            }
+        };
+
+        if let Some(node) = mem_node {
+            if !task.mem_local_to(node) {
+                self.nr_remote_mem_migrations += 1;
+            }
         }
 
         let load = *(task.load);
         let pid = task.pid;
+        let pair = task.pair;
         task.migrated.set(true);
         std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
 
-        push_dom.transfer_load(load, pid, pull_dom, &mut self.skel);
+        match pair {
+            Some((pair_pid, pair_load)) => {
+                push_dom.transfer_load(load - pair_load, pid, pull_dom, &mut self.skel);
+                push_dom.transfer_load(pair_load, pair_pid, pull_dom, &mut self.skel);
+                self.nr_pair_migrations += 1;
+            }
+            None => push_dom.transfer_load(load, pid, pull_dom, &mut self.skel),
+        }
         Ok(Some(load))
     }
 
@@ -849,7 +1062,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
 
         let push_imbal = push_node.load.imbal();
         let pull_imbal = pull_node.load.imbal();
-        let xfer = push_node.xfer_between(&pull_node);
+        let xfer = push_node.xfer_between(&pull_node) * self.xfer_distance_ratio(push_node, pull_node);
 
         if push_imbal <= 0.0f64 || pull_imbal >= 0.0f64 {
             bail!("push node {}:{}, pull node {}:{}",
@@ -899,6 +1112,17 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         Ok(pushed)
     }
 
+    /// Migrating a task to a farther NUMA node costs more in lost memory
+    /// locality. Shrink the amount of load we try to move at once by the
+    /// distance between the nodes relative to the push node's nearest remote
+    /// node, so that far nodes only receive lighter tasks.
+    fn xfer_distance_ratio(&self, push_node: &NumaNode, pull_node: &NumaNode) -> f64 {
+        let nearest = self.dom_group.nearest_remote_distance(push_node.id);
+        let dist = self.dom_group.node_distance(push_node.id, pull_node.id);
+
+        (nearest as f64 / dist as f64).min(1.0f64)
+    }
+
     fn balance_between_nodes(&mut self) -> Result<()> {
         if self.nodes.len() < 2 {
             return Ok(());
@@ -958,25 +1182,26 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
                 break;
             }
 
+            // Collect the under-loaded nodes and visit them nearest first.
+            // The sort is stable, so nodes at the same distance are still
+            // visited from the least busy one.
+            while self.nodes.len() > 0 && self.nodes[0].load.state() == BalanceState::NeedsPull {
+                pullers.push(self.nodes.remove_index(0));
+            }
+            pullers.sort_by_key(|pull_node| self.dom_group.node_distance(push_node.id, pull_node.id));
+
             let push_cutoff = push_node.load.push_cutoff();
             let mut pushed = 0f64;
-            while self.nodes.len() > 0 && pushed < push_cutoff {
-                // To the least busy node
-                let mut pull_node = self.nodes.remove_index(0);
-                let pull_id = pull_node.id;
-                if pull_node.load.state() != BalanceState::NeedsPull {
-                    self.nodes.insert(pull_node);
+            for pull_node in pullers.iter_mut() {
+                if pushed >= push_cutoff {
                     break;
                 }
-                let migrated = self.transfer_between_nodes(&mut push_node, &mut pull_node)?;
-                pullers.push(pull_node);
+                let migrated = self.transfer_between_nodes(&mut push_node, pull_node)?;
                 if migrated > 0.0f64 {
-                    // Break after a successful migration so that we can
-                    // rebalance the pulling domains before the next
-                    // transfer attempt, and ensure that we're trying to
-                    // pull from domains in descending-imbalance order.
                     pushed += migrated;
-                    debug!("NODE {} sending {:.06} --> NODE {}", push_node.id, migrated, pull_id);
+                    debug!("NODE {} sending {:.06} --> NODE {} (distance {})",
+                           push_node.id, migrated, pull_node.id,
+                           self.dom_group.node_distance(push_node.id, pull_node.id));
                 }
             }
             while pullers.len() > 0 {
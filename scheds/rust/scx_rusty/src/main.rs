@@ -10,6 +10,7 @@ mod domain;
 use domain::DomainGroup;
 
 pub mod tuner;
+use tuner::AdaptiveParams;
 use tuner::Tuner;
 
 pub mod load_balance;
@@ -86,8 +87,9 @@ const MAX_CPUS: usize = bpf_intf::consts_MAX_CPUS as usize;
 /// could match the performance of production setup using CFS.
 ///
 /// WARNING: scx_rusty currently assumes that all domains have equal
-/// processing power and at similar distances from each other. This
-/// limitation will be removed in the future.
+/// processing power and, within a NUMA node, at similar distances from each
+/// other. Across NUMA nodes, the SLIT distances reported by the firmware are
+/// used to prefer nearer nodes when stealing tasks and balancing load.
 #[derive(Debug, Parser)]
 struct Opts {
     /// Scheduling slice duration for under-utilized hosts, in microseconds.
@@ -98,6 +100,32 @@ struct Opts {
     #[clap(short = 'o', long, default_value = "1000")]
     slice_us_overutil: u64,
 
+    /// Instead of switching between the under and over-utilized slices
+    /// depending on host-wide utilization, continuously adjust each domain's
+    /// slice, within the same bounds, to keep its average runqueue wait
+    /// around --adaptive-target-wait-us. Each domain's greedy execution
+    /// thresholds also start at --direct-greedy-under and --kick-greedy-under
+    /// and are raised while its runqueue wait stays under the target, and
+    /// lowered while it is over the target or the domain switches contexts
+    /// faster than --adaptive-max-csw-rate. They are applied with hysteresis.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    adaptive_slice: bool,
+
+    /// Target average runqueue wait for --adaptive-slice, in microseconds.
+    #[clap(long, default_value = "1000")]
+    adaptive_target_wait_us: u64,
+
+    /// Hysteresis band for --adaptive-slice, in percent of the target wait
+    /// and of the greedy thresholds.
+    #[clap(long, default_value = "20.0")]
+    adaptive_hysteresis: f64,
+
+    /// Per-CPU context switch rate, in switches per second, above which
+    /// --adaptive-slice stops shrinking a domain's slice and lowers its
+    /// greedy thresholds.
+    #[clap(long, default_value = "20000")]
+    adaptive_max_csw_rate: u64,
+
     /// Monitoring and load balance interval in seconds.
     #[clap(short = 'i', long, default_value = "2.0")]
     interval: f64,
@@ -141,10 +169,19 @@ struct Opts {
     /// When non-zero, enable greedy task stealing across NUMA nodes. The order
     /// of greedy task stealing follows greedy-threshold as described above, and
     /// greedy-threshold must be nonzero to enable task stealing across NUMA
-    /// nodes.
+    /// nodes. Remote domains are tried in ascending NUMA distance order, and
+    /// the threshold is scaled by each domain's distance relative to the
+    /// nearest remote node.
     #[clap(long, default_value = "0")]
     greedy_threshold_x_numa: u32,
 
+    /// When migrating tasks across NUMA nodes, sample where their memory
+    /// resides through /proc/PID/numa_maps and prefer tasks whose memory is
+    /// already on the destination node or which are small. This adds some
+    /// load balancing overhead on multi-socket hosts.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    mem_locality: bool,
+
     /// Disable load balancing. Unless disabled, periodically userspace will
     /// calculate the load factor of each domain and instruct BPF which
     /// processes to move.
@@ -222,6 +259,7 @@ pub fn sub_or_zero(curr: &u64, prev: &u64) -> u64 {
 
 struct Metrics {
     wsync: Counter,
+    wpair: Counter,
     wsync_prev_idle: Counter,
     prev_idle: Counter,
     greedy_idle: Counter,
@@ -239,6 +277,8 @@ struct Metrics {
     task_errors: Counter,
     lb_data_errors: Counter,
     load_balance: Counter,
+    remote_mem_migrations: Counter,
+    pair_migrations: Counter,
     slice_length: Gauge,
     cpu_busy_pct: Histogram,
     processing_duration: Histogram,
@@ -248,6 +288,7 @@ impl Metrics {
     fn new() -> Self {
         Self {
             wsync: counter!("dispatched_tasks_total", "type" => "wsync"),
+            wpair: counter!("dispatched_tasks_total", "type" => "wpair"),
             wsync_prev_idle: counter!("dispatched_tasks_total", "type" => "wsync_prev_idle"),
             prev_idle: counter!("dispatched_tasks_total", "type" => "prev_idle"),
             greedy_idle: counter!("dispatched_tasks_total", "type" => "greedy_idle"),
@@ -265,6 +306,8 @@ impl Metrics {
             task_errors: counter!("task_errors_total"),
             lb_data_errors: counter!("lb_data_errors_total"),
             load_balance: counter!("load_balance_total"),
+            remote_mem_migrations: counter!("remote_mem_migrations_total"),
+            pair_migrations: counter!("pair_migrations_total"),
 
             slice_length: gauge!("slice_length_us"),
 
@@ -282,6 +325,7 @@ struct Scheduler<'a> {
     tune_interval: Duration,
     balance_load: bool,
     balanced_kworkers: bool,
+    mem_locality: bool,
 
     top: Arc<Topology>,
 
@@ -376,6 +420,46 @@ impl<'a> Scheduler<'a> {
             }
         }
 
+        // Greedy stealing across NUMA nodes visits the domains on other nodes
+        // in ascending distance order and requires more queued tasks the
+        // farther away the domain is.
+        for numa in 0..domains.nr_nodes() {
+            let nearest = domains.nearest_remote_distance(numa);
+            let mut remote_doms: Vec<(usize, usize)> = domains
+                .doms()
+                .keys()
+                .filter_map(|dom_id| {
+                    let dom_numa = domains.dom_numa_id(dom_id).unwrap();
+                    if dom_numa == numa {
+                        None
+                    } else {
+                        Some((domains.node_distance(numa, dom_numa), *dom_id))
+                    }
+                })
+                .collect();
+            remote_doms.sort();
+
+            let rodata = skel.rodata_mut();
+            for i in 0..MAX_DOMS {
+                rodata.xnuma_dom_order[numa][i] = bpf_intf::consts_NO_DOM_FOUND;
+            }
+            for (i, &(dist, dom_id)) in remote_doms.iter().enumerate() {
+                let thresh = (opts.greedy_threshold_x_numa as usize * dist + nearest - 1) / nearest;
+                rodata.xnuma_dom_order[numa][i] = dom_id as u32;
+                rodata.xnuma_dom_threshold[numa][i] = thresh as u32;
+            }
+
+            if domains.nr_nodes() > 1 {
+                info!(
+                    "NUMA[{:02}] distance= {:?}",
+                    numa,
+                    (0..domains.nr_nodes())
+                        .map(|to| domains.node_distance(numa, to))
+                        .collect::<Vec<usize>>()
+                );
+            }
+        }
+
         if opts.partial {
             skel.struct_ops.rusty_mut().flags |= *compat::SCX_OPS_SWITCH_PARTIAL;
         }
@@ -406,6 +490,7 @@ impl<'a> Scheduler<'a> {
             tune_interval: Duration::from_secs_f64(opts.tune_interval),
             balance_load: !opts.no_load_balance,
             balanced_kworkers: opts.balanced_kworkers,
+            mem_locality: opts.mem_locality,
 
             top,
             dom_group: domains.clone(),
@@ -422,6 +507,14 @@ impl<'a> Scheduler<'a> {
                 opts.kick_greedy_under,
                 opts.slice_us_underutil * 1000,
                 opts.slice_us_overutil * 1000,
+                match opts.adaptive_slice {
+                    true => Some(AdaptiveParams {
+                        target_wait_ns: opts.adaptive_target_wait_us * 1000,
+                        hysteresis: opts.adaptive_hysteresis / 100.0,
+                        max_csw_rate: opts.adaptive_max_csw_rate as f64,
+                    }),
+                    false => None,
+                },
             )?,
 
             metrics: Metrics::new(),
@@ -514,10 +607,13 @@ impl<'a> Scheduler<'a> {
         &self,
         bpf_stats: &[u64],
         lb_stats: &[NumaStat],
+        nr_remote_mem_migrations: u64,
+        nr_pair_migrations: u64,
     ) {
         let stat = |idx| bpf_stats[idx as usize];
 
         let wsync = stat(bpf_intf::stat_idx_RUSTY_STAT_WAKE_SYNC);
+        let wpair = stat(bpf_intf::stat_idx_RUSTY_STAT_WAKE_PAIR);
         let wsync_prev_idle = stat(bpf_intf::stat_idx_RUSTY_STAT_SYNC_PREV_IDLE);
         let prev_idle = stat(bpf_intf::stat_idx_RUSTY_STAT_PREV_IDLE);
         let greedy_idle = stat(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_IDLE);
@@ -531,6 +627,7 @@ impl<'a> Scheduler<'a> {
         
         self.metrics.wsync_prev_idle.increment(wsync_prev_idle);
         self.metrics.wsync.increment(wsync);
+        self.metrics.wpair.increment(wpair);
         self.metrics.prev_idle.increment(prev_idle);
         self.metrics.greedy_idle.increment(greedy_idle);
         self.metrics.pinned.increment(pinned);
@@ -554,9 +651,33 @@ impl<'a> Scheduler<'a> {
         self.metrics.task_errors.increment(stat(bpf_intf::stat_idx_RUSTY_STAT_TASK_GET_ERR));
         self.metrics.lb_data_errors.increment(self.nr_lb_data_errors);
         self.metrics.load_balance.increment(stat(bpf_intf::stat_idx_RUSTY_STAT_LOAD_BALANCE));
+        self.metrics.remote_mem_migrations.increment(nr_remote_mem_migrations);
+        self.metrics.pair_migrations.increment(nr_pair_migrations);
         
         self.metrics.slice_length.set(self.tuner.slice_ns as f64 / 1000.0);
 
+        // The tuner's per-domain inputs and decisions, so that the slice
+        // controller's behavior can be followed over time.
+        for dom_id in self.dom_group.doms().keys() {
+            let dom = dom_id.to_string();
+            gauge!("dom_slice_length_us", "dom" => dom.clone())
+                .set(self.tuner.dom_slice_ns[*dom_id] as f64 / 1000.0);
+            gauge!("dom_util_pct", "dom" => dom.clone())
+                .set(self.tuner.dom_util[*dom_id] * 100.0);
+            gauge!("dom_wait_us", "dom" => dom.clone())
+                .set(self.tuner.dom_wait_ns[*dom_id] / 1000.0);
+            gauge!("dom_csw_rate", "dom" => dom.clone())
+                .set(self.tuner.dom_csw_rate[*dom_id]);
+            gauge!("dom_direct_greedy", "dom" => dom.clone())
+                .set(self.tuner.dom_direct_greedy[*dom_id] as u32 as f64);
+            gauge!("dom_kick_greedy", "dom" => dom.clone())
+                .set(self.tuner.dom_kick_greedy[*dom_id] as u32 as f64);
+            gauge!("dom_direct_greedy_under_pct", "dom" => dom.clone())
+                .set(self.tuner.dom_direct_greedy_under[*dom_id] * 100.0);
+            gauge!("dom_kick_greedy_under_pct", "dom" => dom)
+                .set(self.tuner.dom_kick_greedy_under[*dom_id] * 100.0);
+        }
+
         // We need to dynamically create the metrics for each node and domain 
         // because we don't know how many there are at compile time. Metrics 
         // will be cached and reused so this is not a performance issue.
@@ -582,15 +703,20 @@ impl<'a> Scheduler<'a> {
             self.balanced_kworkers,
             self.tuner.fully_utilized.clone(),
             self.balance_load.clone(),
+            self.mem_locality,
         );
 
         lb.load_balance()?;
         self.metrics.processing_duration.record(started_at.elapsed().as_micros() as f64);
 
         let stats = lb.get_stats();
+        let nr_remote_mem_migrations = lb.nr_remote_mem_migrations();
+        let nr_pair_migrations = lb.nr_pair_migrations();
         self.report(
             &bpf_stats,
             &stats,
+            nr_remote_mem_migrations,
+            nr_pair_migrations,
         );
 
         self.prev_at = started_at;
@@ -2,68 +2,47 @@
 
 // This software may be used and distributed according to the terms of the
 // GNU General Public License version 2.
-use std::collections::BTreeMap;
 use std::sync::Arc;
+use std::time::Instant;
 
+use crate::load_balance::now_monotonic;
 use crate::sub_or_zero;
 use crate::DomainGroup;
 use crate::BpfSkel;
+use crate::MAX_CPUS;
 
-use ::fb_procfs as procfs;
-use anyhow::anyhow;
-use anyhow::bail;
 use anyhow::Result;
 
+use scx_utils::cpu_util::CpuUtilTracker;
 use scx_utils::Cpumask;
 
-fn calc_util(curr: &procfs::CpuStat, prev: &procfs::CpuStat) -> Result<f64> {
-    match (curr, prev) {
-        (
-            procfs::CpuStat {
-                user_usec: Some(curr_user),
-                nice_usec: Some(curr_nice),
-                system_usec: Some(curr_system),
-                idle_usec: Some(curr_idle),
-                iowait_usec: Some(curr_iowait),
-                irq_usec: Some(curr_irq),
-                softirq_usec: Some(curr_softirq),
-                stolen_usec: Some(curr_stolen),
-                ..
-            },
-            procfs::CpuStat {
-                user_usec: Some(prev_user),
-                nice_usec: Some(prev_nice),
-                system_usec: Some(prev_system),
-                idle_usec: Some(prev_idle),
-                iowait_usec: Some(prev_iowait),
-                irq_usec: Some(prev_irq),
-                softirq_usec: Some(prev_softirq),
-                stolen_usec: Some(prev_stolen),
-                ..
-            },
-        ) => {
-            let idle_usec = sub_or_zero(curr_idle, prev_idle);
-            let iowait_usec = sub_or_zero(curr_iowait, prev_iowait);
-            let user_usec = sub_or_zero(curr_user, prev_user);
-            let system_usec = sub_or_zero(curr_system, prev_system);
-            let nice_usec = sub_or_zero(curr_nice, prev_nice);
-            let irq_usec = sub_or_zero(curr_irq, prev_irq);
-            let softirq_usec = sub_or_zero(curr_softirq, prev_softirq);
-            let stolen_usec = sub_or_zero(curr_stolen, prev_stolen);
-
-            let busy_usec =
-                user_usec + system_usec + nice_usec + irq_usec + softirq_usec + stolen_usec;
-            let total_usec = idle_usec + busy_usec + iowait_usec;
-            if total_usec > 0 {
-                Ok(((busy_usec as f64) / (total_usec as f64)).clamp(0.0, 1.0))
-            } else {
-                Ok(1.0)
-            }
-        }
-        _ => {
-            bail!("Missing stats in cpustat");
-        }
-    }
+/// Parameters of the closed-loop controller which adjusts each domain's slice
+/// and greedy execution from measured runqueue wait times instead of
+/// switching between the under and over-utilized slices.
+#[derive(Clone, Debug)]
+pub struct AdaptiveParams {
+    /// Average runqueue wait the controller tries to keep each domain at.
+    pub target_wait_ns: u64,
+    /// Fraction around the target wait, and around the greedy thresholds,
+    /// within which the controller leaves the current decisions alone.
+    pub hysteresis: f64,
+    /// Per-CPU context switch rate, in switches per second, above which the
+    /// controller stops shrinking a domain's slice and starts lowering its
+    /// greedy thresholds.
+    pub max_csw_rate: f64,
+}
+
+impl AdaptiveParams {
+    const SLICE_SHRINK_RATIO: f64 = 0.75;
+    const SLICE_GROW_RATIO: f64 = 1.25;
+    const GREEDY_STEP: f64 = 0.05;
+    const GREEDY_MAX_UNDER: f64 = 0.99;
+}
+
+/// Exponential weighted moving average, new_avg := old_avg * .75 + new * .25,
+/// matching calc_avg() in the BPF code.
+fn calc_avg(old_val: f64, new_val: f64) -> f64 {
+    old_val * 0.75 + new_val * 0.25
 }
 
 pub struct Tuner {
@@ -71,13 +50,23 @@ pub struct Tuner {
     pub kick_greedy_mask: Cpumask,
     pub fully_utilized: bool,
     pub slice_ns: u64,
+    pub dom_slice_ns: Vec<u64>,
+    pub dom_util: Vec<f64>,
+    pub dom_wait_ns: Vec<f64>,
+    pub dom_csw_rate: Vec<f64>,
+    pub dom_direct_greedy: Vec<bool>,
+    pub dom_kick_greedy: Vec<bool>,
+    pub dom_direct_greedy_under: Vec<f64>,
+    pub dom_kick_greedy_under: Vec<f64>,
     underutil_slice_ns: u64,
     overutil_slice_ns: u64,
     dom_group: Arc<DomainGroup>,
     direct_greedy_under: f64,
     kick_greedy_under: f64,
-    proc_reader: procfs::ProcReader,
-    prev_cpu_stats: BTreeMap<u32, procfs::CpuStat>,
+    adaptive: Option<AdaptiveParams>,
+    cpu_util: CpuUtilTracker,
+    prev_cpu_runs: Vec<(u64, u64, u64)>,
+    prev_at: Instant,
 }
 
 impl Tuner {
@@ -85,12 +74,9 @@ impl Tuner {
                direct_greedy_under: f64,
                kick_greedy_under: f64,
                underutil_slice_ns: u64,
-               overutil_slice_ns: u64) -> Result<Self> {
-        let proc_reader = procfs::ProcReader::new();
-        let prev_cpu_stats = proc_reader
-            .read_stat()?
-            .cpus_map
-            .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+               overutil_slice_ns: u64,
+               adaptive: Option<AdaptiveParams>) -> Result<Self> {
+        let nr_doms = dom_group.nr_doms();
 
        Ok(Self {
            direct_greedy_mask: Cpumask::new()?,
@@ -98,46 +84,185 @@ impl Tuner {
            fully_utilized: false,
            direct_greedy_under: direct_greedy_under / 100.0,
            kick_greedy_under: kick_greedy_under / 100.0,
-           proc_reader,
-           prev_cpu_stats,
+           adaptive,
+           dom_direct_greedy: vec![false; nr_doms],
+           dom_kick_greedy: vec![false; nr_doms],
+           dom_direct_greedy_under: vec![direct_greedy_under / 100.0; nr_doms],
+           dom_kick_greedy_under: vec![kick_greedy_under / 100.0; nr_doms],
+           cpu_util: CpuUtilTracker::new(MAX_CPUS),
+           prev_cpu_runs: vec![(0, 0, 0); MAX_CPUS],
+           prev_at: Instant::now(),
            slice_ns: underutil_slice_ns,
+           dom_slice_ns: vec![underutil_slice_ns; nr_doms],
+           dom_util: vec![0.0; nr_doms],
+           dom_wait_ns: vec![0.0; nr_doms],
+           dom_csw_rate: vec![0.0; nr_doms],
            underutil_slice_ns: underutil_slice_ns,
            overutil_slice_ns: overutil_slice_ns,
            dom_group,
        })
     }
 
+    /// Read the number of tasks which started running on each CPU of each
+    /// domain and how long they waited in the runqueue since the last step,
+    /// and update the per-domain average wait time and context switch rate.
+    fn update_dom_waits(&mut self, skel: &BpfSkel) {
+        let now = Instant::now();
+        let dur = now.duration_since(self.prev_at).as_secs_f64();
+        self.prev_at = now;
+
+        for (dom_id, dom) in self.dom_group.doms().iter() {
+            let (mut nr_runs, mut nr_waits, mut wait_ns) = (0u64, 0u64, 0u64);
+            for cpu in dom.mask().into_iter() {
+                let pcpuc = &skel.bss().pcpu_ctx[cpu];
+                let (prev_runs, prev_waits, prev_wait) = self.prev_cpu_runs[cpu];
+                nr_runs += sub_or_zero(&pcpuc.nr_runs, &prev_runs);
+                nr_waits += sub_or_zero(&pcpuc.nr_waits, &prev_waits);
+                wait_ns += sub_or_zero(&pcpuc.sum_wait_ns, &prev_wait);
+                self.prev_cpu_runs[cpu] = (pcpuc.nr_runs, pcpuc.nr_waits, pcpuc.sum_wait_ns);
+            }
+
+            // Every run counts towards the context switch rate, but only
+            // the tasks which went through the runqueue have a wait time.
+            if nr_waits > 0 {
+                let wait = wait_ns as f64 / nr_waits as f64;
+                self.dom_wait_ns[*dom_id] = calc_avg(self.dom_wait_ns[*dom_id], wait);
+            }
+            if dur > 0.0 && dom.weight() > 0 {
+                let rate = nr_runs as f64 / dur / dom.weight() as f64;
+                self.dom_csw_rate[*dom_id] = calc_avg(self.dom_csw_rate[*dom_id], rate);
+            }
+        }
+    }
+
+    /// Move each domain's slice towards keeping its runqueue wait around the
+    /// target. A slice is shrunk while waits are too long, unless the domain
+    /// is already switching contexts too often, and grown back while waits
+    /// are comfortably short. Slices stay within the over and under-utilized
+    /// slices.
+    fn adapt_slices(&mut self, params: &AdaptiveParams) {
+        let target = params.target_wait_ns as f64;
+        let (min_slice, max_slice) = (
+            self.overutil_slice_ns.min(self.underutil_slice_ns),
+            self.overutil_slice_ns.max(self.underutil_slice_ns),
+        );
+
+        for dom_id in self.dom_group.doms().keys() {
+            let wait = self.dom_wait_ns[*dom_id];
+            let slice = self.dom_slice_ns[*dom_id] as f64;
+
+            let new_slice = if wait > target * (1.0 + params.hysteresis) {
+                if self.dom_csw_rate[*dom_id] < params.max_csw_rate {
+                    slice * AdaptiveParams::SLICE_SHRINK_RATIO
+                } else {
+                    slice
+                }
+            } else if wait < target * (1.0 - params.hysteresis) {
+                slice * AdaptiveParams::SLICE_GROW_RATIO
+            } else {
+                slice
+            };
+
+            self.dom_slice_ns[*dom_id] = (new_slice as u64).clamp(min_slice, max_slice);
+        }
+    }
+
+    /// Move each domain's greedy thresholds with its runqueue wait and
+    /// context switch rate. A domain whose tasks barely wait and which isn't
+    /// switching too often has room to spare, so idle CPUs in it accept
+    /// remote tasks at a higher utilization. A domain whose own tasks wait
+    /// too long, or which already switches too often, stops taking remote
+    /// tasks earlier. Thresholds configured as 0 or 100 are left alone.
+    fn adapt_greedy(&mut self, params: &AdaptiveParams) {
+        let target = params.target_wait_ns as f64;
+        let adapt = |under: f64, base: f64, wait: f64, csw_rate: f64| -> f64 {
+            if base <= 0.0 || base > 0.99999 {
+                return base;
+            }
+            let busy = wait > target * (1.0 + params.hysteresis);
+            let thrashing = csw_rate >= params.max_csw_rate;
+            let under = if busy || thrashing {
+                under - AdaptiveParams::GREEDY_STEP
+            } else if wait < target * (1.0 - params.hysteresis) {
+                under + AdaptiveParams::GREEDY_STEP
+            } else {
+                under
+            };
+            under.clamp(0.0, AdaptiveParams::GREEDY_MAX_UNDER)
+        };
+
+        for dom_id in self.dom_group.doms().keys() {
+            let (wait, csw_rate) = (self.dom_wait_ns[*dom_id], self.dom_csw_rate[*dom_id]);
+            self.dom_direct_greedy_under[*dom_id] = adapt(
+                self.dom_direct_greedy_under[*dom_id],
+                self.direct_greedy_under,
+                wait,
+                csw_rate,
+            );
+            self.dom_kick_greedy_under[*dom_id] = adapt(
+                self.dom_kick_greedy_under[*dom_id],
+                self.kick_greedy_under,
+                wait,
+                csw_rate,
+            );
+        }
+    }
+
+    /// Decide whether greedy execution should be enabled for a domain with
+    /// @util. Without the adaptive controller, this is a plain comparison
+    /// against @under. With it, @under is the domain's adapted threshold and
+    /// the decision only flips once @util leaves the hysteresis band around
+    /// it.
+    fn greedy_enabled(&self, enabled: bool, util: f64, under: f64) -> bool {
+        if under > 0.99999 {
+            return true;
+        }
+
+        match &self.adaptive {
+            None => util < under,
+            Some(params) => {
+                let band = under * params.hysteresis;
+                if enabled {
+                    util < under + band
+                } else {
+                    util < under - band
+                }
+            }
+        }
+    }
+
     /// Apply a step in the Tuner by:
     ///
-    /// 1. Recording CPU stats from procfs
+    /// 1. Reading the busy time of each CPU accounted by BPF
     /// 2. Calculating current per-domain and host-wide utilization
     /// 3. Updating direct_greedy_under and kick_greedy_under cpumasks according
-    ///    to the observed utilization
+    ///    to the observed utilization and, in adaptive mode, to thresholds
+    ///    moved by each domain's runqueue wait and context switch rate
+    /// 4. Picking the slice for each domain, either from host-wide
+    ///    utilization or, in adaptive mode, from the measured runqueue waits
     pub fn step(&mut self, skel: &mut BpfSkel) -> Result<()> {
-        let curr_cpu_stats = self
-            .proc_reader
-            .read_stat()?
-            .cpus_map
-            .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+        let pcpu_ctx = &skel.bss().pcpu_ctx;
+        let cpu_utils = self.cpu_util.update(now_monotonic(), |cpu| {
+            let util = &pcpu_ctx[cpu].util;
+            (util.busy_ns, util.running_at)
+        });
         let mut dom_util_sum = vec![0.0f64; self.dom_group.nr_doms()];
 
         let mut avg_util = 0.0f64;
         for (dom_id, dom) in self.dom_group.doms().iter() {
             for cpu in dom.mask().into_iter() {
-                let cpu32 = cpu as u32;
-                if let (Some(curr), Some(prev)) = (
-                    curr_cpu_stats.get(&cpu32),
-                    self.prev_cpu_stats.get(&cpu32),
-                ) {
-                    let util = calc_util(curr, prev)?;
-                    dom_util_sum[*dom_id] += util;
-                    avg_util += util;
-                }
+                dom_util_sum[*dom_id] += cpu_utils[cpu];
+                avg_util += cpu_utils[cpu];
             }
         }
         avg_util /= self.dom_group.weight() as f64;
         self.fully_utilized = avg_util >= 0.99999;
 
+        self.update_dom_waits(skel);
+        if let Some(params) = self.adaptive.clone() {
+            self.adapt_greedy(&params);
+        }
+
         self.direct_greedy_mask.clear();
         self.kick_greedy_mask.clear();
         for (dom_id, dom) in self.dom_group.doms().iter() {
@@ -148,9 +273,20 @@ impl Tuner {
                 0 => 0.0,
                 nr => dom_util_sum[*dom_id] / nr as f64,
             };
+            self.dom_util[*dom_id] = util;
 
-            let enable_direct = self.direct_greedy_under > 0.99999 || util < self.direct_greedy_under;
-            let enable_kick = self.kick_greedy_under > 0.99999 || util < self.kick_greedy_under;
+            let enable_direct = self.greedy_enabled(
+                self.dom_direct_greedy[*dom_id],
+                util,
+                self.dom_direct_greedy_under[*dom_id],
+            );
+            let enable_kick = self.greedy_enabled(
+                self.dom_kick_greedy[*dom_id],
+                util,
+                self.dom_kick_greedy_under[*dom_id],
+            );
+            self.dom_direct_greedy[*dom_id] = enable_direct;
+            self.dom_kick_greedy[*dom_id] = enable_kick;
 
             if enable_direct {
                 self.direct_greedy_mask |= dom.mask();
@@ -160,6 +296,30 @@ impl Tuner {
             }
         }
 
+        match self.adaptive.clone() {
+            Some(params) => {
+                self.adapt_slices(&params);
+
+                // Report the CPU-weighted average of the domain slices as
+                // the global one, which BPF only falls back to.
+                let mut slice_sum = 0u64;
+                for (dom_id, dom) in self.dom_group.doms().iter() {
+                    slice_sum += self.dom_slice_ns[*dom_id] * dom.weight() as u64;
+                }
+                self.slice_ns = slice_sum / (self.dom_group.weight() as u64).max(1);
+            }
+            None => {
+                if self.fully_utilized {
+                    self.slice_ns = self.overutil_slice_ns;
+                } else {
+                    self.slice_ns = self.underutil_slice_ns;
+                }
+                for slice in self.dom_slice_ns.iter_mut() {
+                    *slice = self.slice_ns;
+                }
+            }
+        }
+
         let ti = &mut skel.bss_mut().tune_input;
         let write_to_bpf = |target: &mut [u64; 8], mask: &Cpumask| {
             let raw_slice = mask.as_raw_slice();
@@ -169,17 +329,13 @@ impl Tuner {
 
         write_to_bpf(&mut ti.direct_greedy_cpumask, &self.direct_greedy_mask);
         write_to_bpf(&mut ti.kick_greedy_cpumask, &self.kick_greedy_mask);
-        if self.fully_utilized {
-            self.slice_ns = self.overutil_slice_ns;
-        } else {
-            self.slice_ns = self.underutil_slice_ns;
-        }
         ti.slice_ns = self.slice_ns;
+        for (dom_id, slice) in self.dom_slice_ns.iter().enumerate() {
+            ti.dom_slice_ns[dom_id] = *slice;
+        }
 
         ti.gen += 1;
 
-        self.prev_cpu_stats = curr_cpu_stats;
-
         Ok(())
     }
 }